@@ -0,0 +1,479 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "piece-table.h"
+
+#ifdef _WIN32
+#  include <windows.h>
+#else
+#  include <sys/resource.h>
+#  include <time.h>
+#  include <unistd.h>
+#endif
+
+// Benchmarks core operations on documents from 1 KB up to a maximum size,
+// reporting throughput, latency percentiles and memory of each workload.
+//   gcc -O2 bench.c piece_table.c -o bench -lpthread
+//   ./bench [max_document_bytes] [operations]
+// Edits fragment the document, so lookups are measured on the edited text.
+// Memory mode runs one long editing session instead, printing memory
+// every sample_every operations as CSV:
+//   ./bench memory [operations] [sample_every] > memory.csv
+
+#define PASTE_LENGTH (64u * 1024u)
+
+// Document a memory session starts from
+#define SESSION_DOCUMENT_LENGTH (1024u * 1024u)
+
+typedef struct latencies
+{
+  double* seconds;
+  unsigned int count;
+  double total;
+} latencies;
+
+double now_seconds()
+{
+#ifdef _WIN32
+  LARGE_INTEGER frequency, counter;
+  QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&counter);
+  return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+#endif
+}
+
+size_t peak_rss_bytes()
+{
+#ifdef _WIN32
+  return 0;
+#else
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#  ifdef __APPLE__
+  return (size_t)usage.ru_maxrss;
+#  else
+  return (size_t)usage.ru_maxrss * 1024;
+#  endif
+#endif
+}
+
+size_t current_rss_bytes()
+{
+#ifdef __linux__
+  // resident pages are the second field
+  unsigned long size = 0, resident = 0;
+  FILE* statm = fopen("/proc/self/statm", "r");
+  if(statm)
+  {
+    if(fscanf(statm, "%lu %lu", &size, &resident) != 2)
+    {
+      resident = 0;
+    }
+    fclose(statm);
+  }
+  return (size_t)resident * (size_t)sysconf(_SC_PAGESIZE);
+#else
+  // no portable current RSS, peak only grows with it
+  return peak_rss_bytes();
+#endif
+}
+
+void record(latencies* l, const double start)
+{
+  double elapsed = now_seconds() - start;
+  l->seconds[l->count++] = elapsed;
+  l->total += elapsed;
+}
+
+int compare_doubles(const void* a, const void* b)
+{
+  double da = *(const double*)a, db = *(const double*)b;
+  return (da > db) - (da < db);
+}
+
+double percentile(const latencies* l, const double p)
+{
+  unsigned int i = (unsigned int)(p * (l->count - 1));
+  return l->seconds[i];
+}
+
+void report(const char* size, const char* workload, latencies* l)
+{
+  if(l->count == 0)
+  {
+    return;
+  }
+
+  qsort(l->seconds, l->count, sizeof(double), compare_doubles);
+  printf("%-8s %-14s %9u %12.0f %9.2f %9.2f %9.2f %9.2f\n",
+         size,
+         workload,
+         l->count,
+         l->count / l->total,
+         percentile(l, 0.5) * 1e6,
+         percentile(l, 0.99) * 1e6,
+         percentile(l, 0.999) * 1e6,
+         l->seconds[l->count - 1] * 1e6);
+
+  l->count = 0;
+  l->total = 0;
+}
+
+void format_size(char* out, const size_t bytes)
+{
+  if(bytes >= 1024 * 1024 * 1024)
+  {
+    sprintf(out, "%zuG", bytes / (1024 * 1024 * 1024));
+  }
+  else if(bytes >= 1024 * 1024)
+  {
+    sprintf(out, "%zuM", bytes / (1024 * 1024));
+  }
+  else
+  {
+    sprintf(out, "%zuK", bytes / 1024);
+  }
+}
+
+char* make_document(const unsigned int length)
+{
+  char* document = (char*)malloc(length + 1);
+  if(!document)
+  {
+    return NULL;
+  }
+  for(unsigned int i = 0; i < length; i++)
+  {
+    document[i] = i % 64 == 63 ? '\n' : 'a' + i % 26;
+  }
+  document[length] = '\0';
+  return document;
+}
+
+int run(const unsigned int document_length,
+        const unsigned int operations,
+        const char* paste,
+        latencies* l)
+{
+  char size[16];
+  format_size(size, document_length);
+
+  char* document = make_document(document_length);
+  if(!document)
+  {
+    printf("Unable to allocate document!\n");
+    return 1;
+  }
+  piece_table* pt = piece_table_from_string(document);
+  free(document);
+  if(!pt)
+  {
+    printf("Cannot create piece_table!\n");
+    return 1;
+  }
+
+  unsigned int length = document_length;
+  srand(42);
+
+  // typing at a cursor in the middle, with a newline now and then
+  unsigned int cursor = length / 2;
+  for(unsigned int i = 0; i < operations; i++)
+  {
+    double start = now_seconds();
+    piece_table_insert(pt, cursor, i % 60 == 59 ? "\n" : "x");
+    record(l, start);
+    cursor++;
+    length++;
+  }
+  report(size, "typing", l);
+
+  for(unsigned int i = 0; i < operations; i++)
+  {
+    unsigned int position = (unsigned int)rand() % (length + 1);
+    unsigned int insert_length = 1 + (unsigned int)rand() % 16;
+    double start = now_seconds();
+    piece_table_insert(pt, position, paste + PASTE_LENGTH - insert_length);
+    record(l, start);
+    length += insert_length;
+  }
+  report(size, "random_insert", l);
+
+  for(unsigned int i = 0; i < operations && length > 16; i++)
+  {
+    unsigned int remove_length = 1 + (unsigned int)rand() % 16;
+    unsigned int position =
+      (unsigned int)rand() % (length - remove_length + 1);
+    double start = now_seconds();
+    piece_table_remove(pt, position, remove_length);
+    record(l, start);
+    length -= remove_length;
+  }
+  report(size, "random_remove", l);
+
+  unsigned int pastes = operations / 100 ? operations / 100 : 1;
+  for(unsigned int i = 0; i < pastes; i++)
+  {
+    unsigned int position = (unsigned int)rand() % (length + 1);
+    double start = now_seconds();
+    piece_table_insert(pt, position, paste);
+    record(l, start);
+    length += PASTE_LENGTH;
+  }
+  report(size, "paste_64k", l);
+
+  // lookups on the fragmented document
+  unsigned int lines = length / 64 + 1;
+  unsigned long checksum = 0;
+  for(unsigned int i = 0; i < operations; i++)
+  {
+    unsigned int line = 1 + (unsigned int)rand() % lines;
+    double start = now_seconds();
+    char* text = piece_table_get_line(pt, line);
+    record(l, start);
+    checksum += text ? (unsigned char)text[0] : 0;
+    free(text);
+  }
+  report(size, "get_line", l);
+
+  for(unsigned int i = 0; i < operations; i++)
+  {
+    double start = now_seconds();
+    checksum += (unsigned char)piece_table_get_char_at(pt, i % length);
+    record(l, start);
+  }
+  report(size, "get_char_at", l);
+
+  for(unsigned int i = 0; i < 3; i++)
+  {
+    double start = now_seconds();
+    char* text = piece_table_to_string(pt);
+    record(l, start);
+    checksum += text ? (unsigned char)text[i] : 0;
+    free(text);
+  }
+  report(size, "to_string", l);
+
+  piece_table_memory_usage usage;
+  piece_table_memory_stats(pt, &usage);
+  // peak is the high-water mark of the whole process, so it stays at
+  // the largest document run so far
+  printf("%-8s pieces: %zu, library: %zu bytes, rss: %zu bytes, "
+         "process peak rss: %zu bytes, checksum: %lu\n\n",
+         size,
+         usage.pieces_count,
+         usage.total_bytes,
+         current_rss_bytes(),
+         peak_rss_bytes(),
+         checksum);
+
+  piece_table_free(pt);
+  return 0;
+}
+
+void print_sample(piece_table* pt,
+                  const unsigned int operations,
+                  const double start)
+{
+  piece_table_memory_usage usage;
+  piece_table_memory_stats(pt, &usage);
+  printf("%u,%.3f,%d,%zu,%zu,%zu,%zu,%zu,%zu,%zu,%zu,%zu,%zu\n",
+         operations,
+         now_seconds() - start,
+         piece_table_get_length(pt),
+         current_rss_bytes(),
+         usage.total_bytes,
+         usage.pieces_count,
+         usage.pieces_bytes,
+         usage.add_buffer_used_bytes,
+         usage.add_buffer_capacity_bytes,
+         usage.add_buffer_wasted_bytes,
+         usage.undo_records_count,
+         usage.undo_records_bytes,
+         usage.piece_index_bytes);
+  fflush(stdout);
+}
+
+// Typing in micro insert sessions broken by backspaces, edits elsewhere,
+// pastes and jumps of the cursor, as an editor does for hours
+int memory_session(const unsigned int operations,
+                   const unsigned int sample_every,
+                   const char* paste)
+{
+  char* document = make_document(SESSION_DOCUMENT_LENGTH);
+  piece_table* pt = document ? piece_table_from_string(document) : NULL;
+  free(document);
+  if(!pt)
+  {
+    printf("Cannot create piece_table!\n");
+    return 1;
+  }
+
+  printf("operations,seconds,length,rss_bytes,library_bytes,pieces,"
+         "pieces_bytes,add_buffer_used_bytes,add_buffer_capacity_bytes,"
+         "add_buffer_wasted_bytes,undo_records,undo_records_bytes,"
+         "piece_index_bytes\n");
+
+  srand(42);
+  double start = now_seconds();
+  unsigned int length = SESSION_DOCUMENT_LENGTH;
+  unsigned int cursor = 0;
+  bool typing = false;
+  for(unsigned int i = 0; i < operations; i++)
+  {
+    if(i % sample_every == 0)
+    {
+      print_sample(pt, i, start);
+    }
+
+    unsigned int action = (unsigned int)rand() % 1000;
+    if(action >= 60)
+    {
+      if(!typing)
+      {
+        typing = piece_table_start_micro_inserts(pt, cursor);
+      }
+      // keystroke is a plain insert if no session could be started
+      const char* key = i % 60 == 59 ? "\n" : "x";
+      if(typing ? piece_table_micro_insert(pt, key)
+                : piece_table_insert(pt, cursor, key))
+      {
+        cursor++;
+        length++;
+      }
+      continue;
+    }
+
+    // anything else ends the typing session
+    if(typing)
+    {
+      piece_table_stop_micro_inserts(pt);
+      typing = false;
+    }
+
+    if(action < 2)
+    {
+      cursor = (unsigned int)rand() % (length + 1);
+    }
+    else if(action < 40)
+    {
+      if(cursor > 0)
+      {
+        piece_table_remove(pt, --cursor, 1);
+        length--;
+      }
+    }
+    else if(action < 50)
+    {
+      unsigned int remove_length = 1 + (unsigned int)rand() % 64;
+      if(length > remove_length)
+      {
+        unsigned int position =
+          (unsigned int)rand() % (length - remove_length + 1);
+        piece_table_remove(pt, position, remove_length);
+        length -= remove_length;
+        cursor = cursor > position + remove_length ? cursor - remove_length
+                 : cursor > position               ? position
+                                                   : cursor;
+      }
+    }
+    else
+    {
+      unsigned int paste_length = 64 + (unsigned int)rand() % 960;
+      piece_table_insert(pt, cursor, paste + PASTE_LENGTH - paste_length);
+      cursor += paste_length;
+      length += paste_length;
+    }
+  }
+  if(typing)
+  {
+    piece_table_stop_micro_inserts(pt);
+  }
+  print_sample(pt, operations, start);
+
+  int result = 0;
+  if(piece_table_get_length(pt) != (int)length)
+  {
+    fprintf(stderr,
+            "Length mismatch: %d != %u!\n",
+            piece_table_get_length(pt),
+            length);
+    result = 1;
+  }
+
+  piece_table_free(pt);
+  return result;
+}
+
+int main(int argc, char** argv)
+{
+  char* paste = (char*)malloc(PASTE_LENGTH + 1);
+  if(!paste)
+  {
+    printf("Unable to allocate memory!\n");
+    return 1;
+  }
+  memset(paste, 'p', PASTE_LENGTH);
+  paste[PASTE_LENGTH] = '\0';
+
+  if(argc > 1 && strcmp(argv[1], "memory") == 0)
+  {
+    unsigned int operations =
+      argc > 2 ? (unsigned int)strtoul(argv[2], NULL, 10) : 2000000;
+    unsigned int sample_every =
+      argc > 3 ? (unsigned int)strtoul(argv[3], NULL, 10) : 50000;
+    int result =
+      memory_session(operations, sample_every ? sample_every : 1, paste);
+    free(paste);
+    return result;
+  }
+
+  size_t max_length =
+    argc > 1 ? (size_t)strtoull(argv[1], NULL, 10) : 64u * 1024u * 1024u;
+  unsigned int operations =
+    argc > 2 ? (unsigned int)atoi(argv[2]) : 10000;
+  if(max_length > 1024u * 1024u * 1024u)
+  {
+    max_length = 1024u * 1024u * 1024u;
+  }
+
+  latencies l;
+  l.seconds = (double*)malloc(sizeof(double) * (operations + 3));
+  l.count = 0;
+  l.total = 0;
+  if(!l.seconds)
+  {
+    printf("Unable to allocate memory!\n");
+    free(paste);
+    return 1;
+  }
+
+  printf("%-8s %-14s %9s %12s %9s %9s %9s %9s\n",
+         "size",
+         "workload",
+         "ops",
+         "ops/s",
+         "p50 us",
+         "p99 us",
+         "p99.9 us",
+         "max us");
+
+  // 1 KB to 1 GB, growing 16 times at each step
+  for(size_t length = 1024; length <= max_length; length *= 16)
+  {
+    if(run((unsigned int)length, operations, paste, &l) != 0)
+    {
+      free(paste);
+      free(l.seconds);
+      return 1;
+    }
+  }
+
+  free(paste);
+  free(l.seconds);
+
+  return 0;
+}
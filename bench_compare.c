@@ -0,0 +1,814 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "piece-table.h"
+
+#ifdef _WIN32
+#  include <windows.h>
+#else
+#  include <time.h>
+#endif
+
+// Runs the same editing traces on the piece table and on simple gap buffer
+// & rope reference implementations, printing throughput & memory of each.
+//   gcc -O2 bench_compare.c piece_table.c -o bench_compare -lpthread
+//   ./bench_compare [document_bytes] [operations]
+// Final texts of all engines are compared, so the baselines double as
+// a check of the piece table. Memory of the piece table includes its undo
+// history, the baselines keep none.
+
+#define PASTE_LENGTH (64u * 1024u)
+
+// Rope leaves hold at most this many bytes
+#define ROPE_CHUNK 512
+
+typedef enum edit_type
+{
+  EDIT_INSERT,
+  EDIT_REMOVE
+} edit_type;
+
+typedef struct edit
+{
+  edit_type type;
+  unsigned int position;
+  unsigned int length;
+  // null terminated text of length bytes, for inserts
+  const char* text;
+} edit;
+
+typedef struct trace
+{
+  const char* name;
+  edit* edits;
+  unsigned int count;
+} trace;
+
+// Operations every engine implements
+typedef struct engine
+{
+  const char* name;
+  void* (*from_string)(const char* string);
+  void (*insert)(void* e,
+                 const unsigned int position,
+                 const char* text,
+                 const unsigned int length);
+  void (*remove)(void* e,
+                 const unsigned int position,
+                 const unsigned int length);
+  char (*get_char_at)(void* e, const unsigned int position);
+  char* (*to_string)(void* e);
+  size_t (*memory)(void* e);
+  void (*free)(void* e);
+} engine;
+
+double now_seconds()
+{
+#ifdef _WIN32
+  LARGE_INTEGER frequency, counter;
+  QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&counter);
+  return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+#endif
+}
+
+/// Piece Table Engine
+
+void* piece_table_engine_from_string(const char* string)
+{
+  return piece_table_from_string(string);
+}
+
+void piece_table_engine_insert(void* e,
+                               const unsigned int position,
+                               const char* text,
+                               const unsigned int length)
+{
+  (void)length;
+  piece_table_insert((piece_table*)e, position, text);
+}
+
+void piece_table_engine_remove(void* e,
+                               const unsigned int position,
+                               const unsigned int length)
+{
+  piece_table_remove((piece_table*)e, position, length);
+}
+
+char piece_table_engine_get_char_at(void* e, const unsigned int position)
+{
+  return piece_table_get_char_at((piece_table*)e, position);
+}
+
+char* piece_table_engine_to_string(void* e)
+{
+  return piece_table_to_string((piece_table*)e);
+}
+
+size_t piece_table_engine_memory(void* e)
+{
+  piece_table_memory_usage usage;
+  piece_table_memory_stats((piece_table*)e, &usage);
+  return usage.total_bytes;
+}
+
+void piece_table_engine_free(void* e)
+{
+  piece_table_free((piece_table*)e);
+}
+
+/// Gap Buffer Engine
+
+// Text before gap_start, then a gap up to gap_end, then the rest of the text
+typedef struct gap_buffer
+{
+  char* data;
+  unsigned int capacity;
+  unsigned int gap_start;
+  unsigned int gap_end;
+} gap_buffer;
+
+void* gap_buffer_from_string(const char* string)
+{
+  gap_buffer* gb = (gap_buffer*)malloc(sizeof(gap_buffer));
+  if(!gb)
+  {
+    return NULL;
+  }
+
+  unsigned int length = (unsigned int)strlen(string);
+  gb->capacity = length + 4096;
+  gb->data = (char*)malloc(gb->capacity);
+  if(!gb->data)
+  {
+    free(gb);
+    return NULL;
+  }
+  // gap starts at the end of text
+  memcpy(gb->data, string, length);
+  gb->gap_start = length;
+  gb->gap_end = gb->capacity;
+
+  return gb;
+}
+
+void gap_buffer_move_gap(gap_buffer* gb, const unsigned int position)
+{
+  if(position < gb->gap_start)
+  {
+    unsigned int moved = gb->gap_start - position;
+    memmove(gb->data + gb->gap_end - moved, gb->data + position, moved);
+    gb->gap_start -= moved;
+    gb->gap_end -= moved;
+  }
+  else if(position > gb->gap_start)
+  {
+    unsigned int moved = position - gb->gap_start;
+    memmove(gb->data + gb->gap_start, gb->data + gb->gap_end, moved);
+    gb->gap_start += moved;
+    gb->gap_end += moved;
+  }
+}
+
+void gap_buffer_insert(void* e,
+                       const unsigned int position,
+                       const char* text,
+                       const unsigned int length)
+{
+  gap_buffer* gb = (gap_buffer*)e;
+  if(gb->gap_end - gb->gap_start < length)
+  {
+    // growing geometrically, text after the gap moves to the new end
+    unsigned int after = gb->capacity - gb->gap_end;
+    unsigned int capacity = gb->capacity * 2 + length;
+    char* data = (char*)realloc(gb->data, capacity);
+    if(!data)
+    {
+      return;
+    }
+    memmove(data + capacity - after, data + gb->gap_end, after);
+    gb->data = data;
+    gb->gap_end = capacity - after;
+    gb->capacity = capacity;
+  }
+
+  gap_buffer_move_gap(gb, position);
+  memcpy(gb->data + gb->gap_start, text, length);
+  gb->gap_start += length;
+}
+
+void gap_buffer_remove(void* e,
+                       const unsigned int position,
+                       const unsigned int length)
+{
+  gap_buffer* gb = (gap_buffer*)e;
+  gap_buffer_move_gap(gb, position);
+  gb->gap_end += length;
+}
+
+char gap_buffer_get_char_at(void* e, const unsigned int position)
+{
+  gap_buffer* gb = (gap_buffer*)e;
+  return position < gb->gap_start
+           ? gb->data[position]
+           : gb->data[position + gb->gap_end - gb->gap_start];
+}
+
+char* gap_buffer_to_string(void* e)
+{
+  gap_buffer* gb = (gap_buffer*)e;
+  unsigned int after = gb->capacity - gb->gap_end;
+  char* string = (char*)malloc(gb->gap_start + after + 1);
+  if(!string)
+  {
+    return NULL;
+  }
+  memcpy(string, gb->data, gb->gap_start);
+  memcpy(string + gb->gap_start, gb->data + gb->gap_end, after);
+  string[gb->gap_start + after] = '\0';
+
+  return string;
+}
+
+size_t gap_buffer_memory(void* e)
+{
+  return sizeof(gap_buffer) + ((gap_buffer*)e)->capacity;
+}
+
+void gap_buffer_free(void* e)
+{
+  free(((gap_buffer*)e)->data);
+  free(e);
+}
+
+/// Rope Engine
+
+// Leaves of a rope kept in a treap ordered by text position,
+// random priorities keep it balanced in expectation
+typedef struct rope_node
+{
+  struct rope_node* left;
+  struct rope_node* right;
+  unsigned int priority;
+  unsigned int length;
+  // length of text of the whole subtree
+  unsigned int weight;
+  char text[ROPE_CHUNK];
+} rope_node;
+
+typedef struct rope
+{
+  rope_node* root;
+  size_t nodes;
+  unsigned int seed;
+} rope;
+
+unsigned int rope_weight(const rope_node* n)
+{
+  return n ? n->weight : 0;
+}
+
+void rope_update(rope_node* n)
+{
+  n->weight = rope_weight(n->left) + n->length + rope_weight(n->right);
+}
+
+rope_node* rope_node_new(rope* r, const char* text, const unsigned int length)
+{
+  rope_node* n = (rope_node*)malloc(sizeof(rope_node));
+  if(!n)
+  {
+    return NULL;
+  }
+
+  // xorshift, so priorities don't disturb rand() of the traces
+  r->seed ^= r->seed << 13;
+  r->seed ^= r->seed >> 17;
+  r->seed ^= r->seed << 5;
+  n->priority = r->seed;
+  n->left = NULL;
+  n->right = NULL;
+  n->length = length;
+  n->weight = length;
+  memcpy(n->text, text, length);
+  r->nodes++;
+
+  return n;
+}
+
+// every position of a comes before b
+rope_node* rope_merge(rope_node* a, rope_node* b)
+{
+  if(!a || !b)
+  {
+    return a ? a : b;
+  }
+
+  if(a->priority > b->priority)
+  {
+    a->right = rope_merge(a->right, b);
+    rope_update(a);
+    return a;
+  }
+  b->left = rope_merge(a, b->left);
+  rope_update(b);
+  return b;
+}
+
+// left gets text before position, splitting a leaf if needed
+void rope_split(rope* r,
+                rope_node* n,
+                const unsigned int position,
+                rope_node** left,
+                rope_node** right)
+{
+  if(!n)
+  {
+    *left = NULL;
+    *right = NULL;
+    return;
+  }
+
+  unsigned int left_weight = rope_weight(n->left);
+  if(position <= left_weight)
+  {
+    rope_split(r, n->left, position, left, &n->left);
+    rope_update(n);
+    *right = n;
+  }
+  else if(position >= left_weight + n->length)
+  {
+    rope_split(
+      r, n->right, position - left_weight - n->length, &n->right, right);
+    rope_update(n);
+    *left = n;
+  }
+  else
+  {
+    unsigned int offset = position - left_weight;
+    rope_node* tail = rope_node_new(r, n->text + offset, n->length - offset);
+    rope_node* after = n->right;
+    n->right = NULL;
+    n->length = offset;
+    rope_update(n);
+    *left = n;
+    *right = rope_merge(tail, after);
+  }
+}
+
+// inserts into the leaf holding position if it has room
+bool rope_insert_in_place(rope_node* n,
+                          const unsigned int position,
+                          const char* text,
+                          const unsigned int length)
+{
+  if(!n)
+  {
+    return false;
+  }
+
+  unsigned int left_weight = rope_weight(n->left);
+  bool inserted = false;
+  if(position < left_weight)
+  {
+    inserted = rope_insert_in_place(n->left, position, text, length);
+  }
+  else if(position <= left_weight + n->length)
+  {
+    if(n->length + length > ROPE_CHUNK)
+    {
+      return false;
+    }
+    unsigned int offset = position - left_weight;
+    memmove(n->text + offset + length, n->text + offset, n->length - offset);
+    memcpy(n->text + offset, text, length);
+    n->length += length;
+    inserted = true;
+  }
+  else
+  {
+    inserted = rope_insert_in_place(
+      n->right, position - left_weight - n->length, text, length);
+  }
+
+  if(inserted)
+  {
+    n->weight += length;
+  }
+  return inserted;
+}
+
+void rope_free_nodes(rope* r, rope_node* n)
+{
+  if(!n)
+  {
+    return;
+  }
+  rope_free_nodes(r, n->left);
+  rope_free_nodes(r, n->right);
+  free(n);
+  r->nodes--;
+}
+
+void rope_insert(void* e,
+                 const unsigned int position,
+                 const char* text,
+                 const unsigned int length)
+{
+  rope* r = (rope*)e;
+  if(rope_insert_in_place(r->root, position, text, length))
+  {
+    return;
+  }
+
+  // leaf is full, text goes into leaves of its own
+  rope_node *left, *right, *middle = NULL;
+  rope_split(r, r->root, position, &left, &right);
+  for(unsigned int i = 0; i < length; i += ROPE_CHUNK)
+  {
+    unsigned int chunk = length - i < ROPE_CHUNK ? length - i : ROPE_CHUNK;
+    middle = rope_merge(middle, rope_node_new(r, text + i, chunk));
+  }
+  r->root = rope_merge(rope_merge(left, middle), right);
+}
+
+void* rope_from_string(const char* string)
+{
+  rope* r = (rope*)malloc(sizeof(rope));
+  if(!r)
+  {
+    return NULL;
+  }
+  r->root = NULL;
+  r->nodes = 0;
+  r->seed = 2463534242u;
+  rope_insert(r, 0, string, (unsigned int)strlen(string));
+
+  return r;
+}
+
+void rope_remove(void* e,
+                 const unsigned int position,
+                 const unsigned int length)
+{
+  rope* r = (rope*)e;
+  rope_node *left, *middle, *right;
+  rope_split(r, r->root, position, &left, &right);
+  rope_split(r, right, length, &middle, &right);
+  rope_free_nodes(r, middle);
+  r->root = rope_merge(left, right);
+}
+
+char rope_get_char_at(void* e, const unsigned int position)
+{
+  rope_node* n = ((rope*)e)->root;
+  unsigned int remaining_offset = position;
+  while(n)
+  {
+    unsigned int left_weight = rope_weight(n->left);
+    if(remaining_offset < left_weight)
+    {
+      n = n->left;
+    }
+    else if(remaining_offset < left_weight + n->length)
+    {
+      return n->text[remaining_offset - left_weight];
+    }
+    else
+    {
+      remaining_offset -= left_weight + n->length;
+      n = n->right;
+    }
+  }
+
+  return '\0';
+}
+
+char* rope_copy(const rope_node* n, char* out)
+{
+  if(!n)
+  {
+    return out;
+  }
+  out = rope_copy(n->left, out);
+  memcpy(out, n->text, n->length);
+  return rope_copy(n->right, out + n->length);
+}
+
+char* rope_to_string(void* e)
+{
+  rope* r = (rope*)e;
+  char* string = (char*)malloc(rope_weight(r->root) + 1);
+  if(!string)
+  {
+    return NULL;
+  }
+  *rope_copy(r->root, string) = '\0';
+
+  return string;
+}
+
+size_t rope_memory(void* e)
+{
+  return sizeof(rope) + ((rope*)e)->nodes * sizeof(rope_node);
+}
+
+void rope_free(void* e)
+{
+  rope_free_nodes((rope*)e, ((rope*)e)->root);
+  free(e);
+}
+
+/// Traces
+
+// text of length bytes, null terminated right after
+const char* text_of_length(const char* paste, const unsigned int length)
+{
+  return paste + PASTE_LENGTH - length;
+}
+
+void add_edit(trace* t,
+              const edit_type type,
+              const unsigned int position,
+              const unsigned int length,
+              const char* text)
+{
+  t->edits[t->count].type = type;
+  t->edits[t->count].position = position;
+  t->edits[t->count].length = length;
+  t->edits[t->count].text = text;
+  t->count++;
+}
+
+// typing at a cursor in the middle, fixing typos with backspaces
+void make_typing_trace(trace* t,
+                       unsigned int length,
+                       const unsigned int operations,
+                       const char keys[26][2])
+{
+  unsigned int cursor = length / 2;
+  for(unsigned int i = 0; i < operations; i++)
+  {
+    if(rand() % 10 == 0 && cursor > 0)
+    {
+      add_edit(t, EDIT_REMOVE, --cursor, 1, NULL);
+      length--;
+    }
+    else
+    {
+      add_edit(t, EDIT_INSERT, cursor++, 1, keys[rand() % 26]);
+      length++;
+    }
+  }
+}
+
+// short inserts & removes all over the document
+void make_random_trace(trace* t,
+                       unsigned int length,
+                       const unsigned int operations,
+                       const char* paste)
+{
+  for(unsigned int i = 0; i < operations; i++)
+  {
+    unsigned int edit_length = 1 + (unsigned int)rand() % 16;
+    if(rand() % 2 == 0 || length < edit_length)
+    {
+      add_edit(t,
+               EDIT_INSERT,
+               (unsigned int)rand() % (length + 1),
+               edit_length,
+               text_of_length(paste, edit_length));
+      length += edit_length;
+    }
+    else
+    {
+      add_edit(t,
+               EDIT_REMOVE,
+               (unsigned int)rand() % (length - edit_length + 1),
+               edit_length,
+               NULL);
+      length -= edit_length;
+    }
+  }
+}
+
+// large pastes & cuts
+void make_paste_trace(trace* t,
+                      unsigned int length,
+                      const unsigned int operations,
+                      const char* paste)
+{
+  for(unsigned int i = 0; i < operations; i++)
+  {
+    unsigned int edit_length =
+      1024 + (unsigned int)rand() % (PASTE_LENGTH - 1024);
+    if(rand() % 3 != 0 || length < edit_length)
+    {
+      add_edit(t,
+               EDIT_INSERT,
+               (unsigned int)rand() % (length + 1),
+               edit_length,
+               text_of_length(paste, edit_length));
+      length += edit_length;
+    }
+    else
+    {
+      add_edit(t,
+               EDIT_REMOVE,
+               (unsigned int)rand() % (length - edit_length + 1),
+               edit_length,
+               NULL);
+      length -= edit_length;
+    }
+  }
+}
+
+/// Benchmark
+
+unsigned long hash_string(const char* string)
+{
+  // FNV-1a
+  unsigned long hash = 2166136261u;
+  for(const char* c = string; *c; c++)
+  {
+    hash = (hash ^ (unsigned char)*c) * 16777619u;
+  }
+  return hash;
+}
+
+// returns hash of the final text, 0 on failure
+unsigned long run(const engine* en,
+                  const trace* t,
+                  const char* document,
+                  const unsigned int document_length,
+                  const unsigned int lookups)
+{
+  void* e = en->from_string(document);
+  if(!e)
+  {
+    printf("Cannot create %s!\n", en->name);
+    return 0;
+  }
+
+  unsigned int length = document_length;
+  double start = now_seconds();
+  for(unsigned int i = 0; i < t->count; i++)
+  {
+    const edit* ed = &t->edits[i];
+    if(ed->type == EDIT_INSERT)
+    {
+      en->insert(e, ed->position, ed->text, ed->length);
+      length += ed->length;
+    }
+    else
+    {
+      en->remove(e, ed->position, ed->length);
+      length -= ed->length;
+    }
+  }
+  double edit_seconds = now_seconds() - start;
+
+  // lookups & materializing on the edited text
+  unsigned long checksum = 0;
+  unsigned int seed = 12345;
+  start = now_seconds();
+  for(unsigned int i = 0; i < lookups; i++)
+  {
+    seed = seed * 1103515245u + 12345u;
+    checksum += (unsigned char)en->get_char_at(e, seed % length);
+  }
+  double lookup_seconds = now_seconds() - start;
+
+  start = now_seconds();
+  char* text = en->to_string(e);
+  double to_string_seconds = now_seconds() - start;
+  unsigned long hash = text ? hash_string(text) : 0;
+  free(text);
+
+  printf("%-12s %-12s %12.0f %14.0f %10.2f %14zu %10lu\n",
+         t->name,
+         en->name,
+         t->count / edit_seconds,
+         lookups / lookup_seconds,
+         to_string_seconds * 1e3,
+         en->memory(e),
+         checksum);
+
+  en->free(e);
+  return hash;
+}
+
+int main(int argc, char** argv)
+{
+  unsigned int document_length =
+    argc > 1 ? (unsigned int)strtoul(argv[1], NULL, 10) : 1024u * 1024u;
+  unsigned int operations =
+    argc > 2 ? (unsigned int)strtoul(argv[2], NULL, 10) : 20000;
+
+  const engine engines[] = {{"piece_table",
+                             piece_table_engine_from_string,
+                             piece_table_engine_insert,
+                             piece_table_engine_remove,
+                             piece_table_engine_get_char_at,
+                             piece_table_engine_to_string,
+                             piece_table_engine_memory,
+                             piece_table_engine_free},
+                            {"gap_buffer",
+                             gap_buffer_from_string,
+                             gap_buffer_insert,
+                             gap_buffer_remove,
+                             gap_buffer_get_char_at,
+                             gap_buffer_to_string,
+                             gap_buffer_memory,
+                             gap_buffer_free},
+                            {"rope",
+                             rope_from_string,
+                             rope_insert,
+                             rope_remove,
+                             rope_get_char_at,
+                             rope_to_string,
+                             rope_memory,
+                             rope_free}};
+  const unsigned int engines_count = sizeof(engines) / sizeof(engines[0]);
+
+  char* document = (char*)malloc(document_length + 1);
+  char* paste = (char*)malloc(PASTE_LENGTH + 1);
+  trace traces[3] = {{"typing", NULL, 0},
+                     {"random_edit", NULL, 0},
+                     {"paste", NULL, 0}};
+  bool allocated = document && paste;
+  for(unsigned int i = 0; i < 3; i++)
+  {
+    traces[i].edits = (edit*)malloc(sizeof(edit) * (operations + 1));
+    allocated = allocated && traces[i].edits;
+  }
+  if(!allocated)
+  {
+    printf("Unable to allocate memory!\n");
+    return 1;
+  }
+  for(unsigned int i = 0; i < document_length; i++)
+  {
+    document[i] = i % 64 == 63 ? '\n' : 'a' + i % 26;
+  }
+  document[document_length] = '\0';
+  for(unsigned int i = 0; i < PASTE_LENGTH; i++)
+  {
+    paste[i] = 'A' + i % 26;
+  }
+  paste[PASTE_LENGTH] = '\0';
+  char keys[26][2];
+  for(unsigned int i = 0; i < 26; i++)
+  {
+    keys[i][0] = (char)('a' + i);
+    keys[i][1] = '\0';
+  }
+
+  srand(42);
+  make_typing_trace(&traces[0], document_length, operations, keys);
+  make_random_trace(&traces[1], document_length, operations, paste);
+  unsigned int pastes = operations / 100 ? operations / 100 : 1;
+  make_paste_trace(&traces[2], document_length, pastes, paste);
+
+  printf("%-12s %-12s %12s %14s %10s %14s %10s\n",
+         "trace",
+         "engine",
+         "edits/s",
+         "lookups/s",
+         "text ms",
+         "memory bytes",
+         "checksum");
+  int result = 0;
+  for(unsigned int i = 0; i < 3; i++)
+  {
+    unsigned long expected = 0;
+    for(unsigned int j = 0; j < engines_count; j++)
+    {
+      unsigned long hash =
+        run(&engines[j], &traces[i], document, document_length, operations);
+      expected = j == 0 ? hash : expected;
+      if(hash == 0 || hash != expected)
+      {
+        printf("%s differs from %s on %s!\n",
+               engines[j].name,
+               engines[0].name,
+               traces[i].name);
+        result = 1;
+      }
+    }
+    printf("\n");
+  }
+
+  for(unsigned int i = 0; i < 3; i++)
+  {
+    free(traces[i].edits);
+  }
+  free(document);
+  free(paste);
+
+  return result;
+}
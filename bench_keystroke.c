@@ -0,0 +1,230 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "piece-table.h"
+
+#ifdef _WIN32
+#  include <windows.h>
+#else
+#  include <time.h>
+#endif
+
+// Simulates typing at a cursor in a large fragmented document, mixing
+// piece_table_insert(), micro insert sessions & backspaces, and reports
+// latency percentiles per keystroke to guard the interactive path.
+//   gcc -O2 bench_keystroke.c piece_table.c -o bench_keystroke -lpthread
+//   ./bench_keystroke [document_bytes] [keystrokes] [fragments]
+// A keystroke is timed with every call it makes, starting or stopping
+// a micro insert session included.
+
+// Keystrokes slower than a frame at 60 Hz are stalls
+#define FRAME_SECONDS (1.0 / 60.0)
+
+typedef enum keystroke_kind
+{
+  KEYSTROKE_INSERT,
+  KEYSTROKE_MICRO_INSERT,
+  KEYSTROKE_BACKSPACE,
+  KEYSTROKE_ALL,
+  KEYSTROKE_KINDS
+} keystroke_kind;
+
+typedef struct latencies
+{
+  double* seconds;
+  unsigned int count;
+} latencies;
+
+double now_seconds()
+{
+#ifdef _WIN32
+  LARGE_INTEGER frequency, counter;
+  QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&counter);
+  return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+#endif
+}
+
+int compare_doubles(const void* a, const void* b)
+{
+  double da = *(const double*)a, db = *(const double*)b;
+  return (da > db) - (da < db);
+}
+
+double percentile(const latencies* l, const double p)
+{
+  unsigned int i = (unsigned int)(p * (l->count - 1));
+  return l->seconds[i];
+}
+
+void record(latencies* l, const keystroke_kind kind, const double start)
+{
+  double elapsed = now_seconds() - start;
+  l[kind].seconds[l[kind].count++] = elapsed;
+  l[KEYSTROKE_ALL].seconds[l[KEYSTROKE_ALL].count++] = elapsed;
+}
+
+void report(const char* kind, latencies* l)
+{
+  if(l->count == 0)
+  {
+    return;
+  }
+
+  unsigned int stalls = 0;
+  for(unsigned int i = 0; i < l->count; i++)
+  {
+    stalls += l->seconds[i] > FRAME_SECONDS;
+  }
+
+  qsort(l->seconds, l->count, sizeof(double), compare_doubles);
+  printf("%-14s %10u %9.2f %9.2f %9.2f %10.2f %7u\n",
+         kind,
+         l->count,
+         percentile(l, 0.5) * 1e6,
+         percentile(l, 0.99) * 1e6,
+         percentile(l, 0.999) * 1e6,
+         l->seconds[l->count - 1] * 1e6,
+         stalls);
+}
+
+int main(int argc, char** argv)
+{
+  unsigned int document_length =
+    argc > 1 ? (unsigned int)strtoul(argv[1], NULL, 10) : 16u * 1024u * 1024u;
+  unsigned int keystrokes =
+    argc > 2 ? (unsigned int)strtoul(argv[2], NULL, 10) : 200000;
+  unsigned int fragments =
+    argc > 3 ? (unsigned int)strtoul(argv[3], NULL, 10) : 20000;
+
+  char* document = (char*)malloc(document_length + 1);
+  bool allocated = document != NULL;
+  latencies l[KEYSTROKE_KINDS];
+  for(unsigned int i = 0; i < KEYSTROKE_KINDS; i++)
+  {
+    l[i].seconds = (double*)malloc(sizeof(double) * (keystrokes + 1));
+    l[i].count = 0;
+    allocated = allocated && l[i].seconds;
+  }
+  if(!allocated)
+  {
+    printf("Unable to allocate memory!\n");
+    return 1;
+  }
+  for(unsigned int i = 0; i < document_length; i++)
+  {
+    document[i] = i % 64 == 63 ? '\n' : 'a' + i % 26;
+  }
+  document[document_length] = '\0';
+
+  piece_table* pt = piece_table_from_string(document);
+  free(document);
+  if(!pt)
+  {
+    printf("Cannot create piece_table!\n");
+    return 1;
+  }
+
+  // fragmenting the document with scattered edits
+  srand(42);
+  unsigned int length = document_length;
+  for(unsigned int i = 0; i < fragments; i++)
+  {
+    piece_table_insert(pt, (unsigned int)rand() % (length + 1), "xy");
+    length += 2;
+  }
+
+  // words typed at a cursor in the middle, half of them in micro insert
+  // sessions, with typos fixed by backspaces and a jump now and then
+  unsigned int cursor = length / 2;
+  unsigned int typed = 0;
+  while(typed < keystrokes)
+  {
+    if(rand() % 20 == 0)
+    {
+      cursor = (unsigned int)rand() % (length + 1);
+    }
+
+    unsigned int word_length = 3 + (unsigned int)rand() % 7;
+    bool micro = rand() % 2 == 0;
+    for(unsigned int i = 0; i < word_length && typed < keystrokes; i++)
+    {
+      char key[2] = {(char)('a' + rand() % 26), '\0'};
+      if(i == word_length - 1)
+      {
+        key[0] = rand() % 12 == 0 ? '\n' : ' ';
+      }
+
+      double start = now_seconds();
+      if(micro)
+      {
+        if(i == 0)
+        {
+          piece_table_start_micro_inserts(pt, cursor);
+        }
+        piece_table_micro_insert(pt, key);
+        if(i == word_length - 1 || typed + 1 == keystrokes)
+        {
+          piece_table_stop_micro_inserts(pt);
+        }
+      }
+      else
+      {
+        piece_table_insert(pt, cursor, key);
+      }
+      record(l, micro ? KEYSTROKE_MICRO_INSERT : KEYSTROKE_INSERT, start);
+      cursor++;
+      length++;
+      typed++;
+    }
+
+    unsigned int backspaces = rand() % 5 == 0 ? 1 + rand() % 3 : 0;
+    for(unsigned int i = 0; i < backspaces && cursor > 0 && typed < keystrokes;
+        i++)
+    {
+      double start = now_seconds();
+      piece_table_remove(pt, cursor - 1, 1);
+      record(l, KEYSTROKE_BACKSPACE, start);
+      cursor--;
+      length--;
+      typed++;
+    }
+  }
+
+  piece_table_memory_usage usage;
+  piece_table_memory_stats(pt, &usage);
+  printf("document: %u bytes, %zu pieces, library: %zu bytes\n",
+         length,
+         usage.pieces_count,
+         usage.total_bytes);
+  if(piece_table_get_length(pt) != (int)length)
+  {
+    printf("Length mismatch: %d != %u!\n", piece_table_get_length(pt), length);
+    return 1;
+  }
+
+  printf("%-14s %10s %9s %9s %9s %10s %7s\n",
+         "keystroke",
+         "count",
+         "p50 us",
+         "p99 us",
+         "p99.9 us",
+         "max us",
+         "stalls");
+  report("insert", &l[KEYSTROKE_INSERT]);
+  report("micro_insert", &l[KEYSTROKE_MICRO_INSERT]);
+  report("backspace", &l[KEYSTROKE_BACKSPACE]);
+  report("all", &l[KEYSTROKE_ALL]);
+
+  piece_table_free(pt);
+  for(unsigned int i = 0; i < KEYSTROKE_KINDS; i++)
+  {
+    free(l[i].seconds);
+  }
+
+  return 0;
+}
@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "piece-table.h"
+
+// Measures lookup throughput on a fragmented document.
+// Build twice to compare the packed piece index against walking the pieces:
+//   gcc -O2 bench_lookup.c piece_table.c -o bench_lookup
+//   gcc -O2 -DPIECE_TABLE_NO_PIECE_INDEX bench_lookup.c piece_table.c
+//     -o bench_lookup_list
+
+double elapsed_seconds(clock_t start)
+{
+  return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+int main(int argc, char** argv)
+{
+  unsigned int document_length = 1 << 20;
+  unsigned int inserts = argc > 1 ? (unsigned int)atoi(argv[1]) : 20000;
+  unsigned int lookups = argc > 2 ? (unsigned int)atoi(argv[2]) : 50000;
+
+  char* original = (char*)malloc(document_length + 1);
+  if(!original)
+  {
+    printf("Unable to allocate document!\n");
+    return 1;
+  }
+  for(unsigned int i = 0; i < document_length; i++)
+  {
+    original[i] = i % 64 == 63 ? '\n' : 'a' + i % 26;
+  }
+  original[document_length] = '\0';
+
+  piece_table* pt = piece_table_from_string(original);
+  free(original);
+  if(!pt)
+  {
+    printf("Cannot create piece_table!\n");
+    return 1;
+  }
+
+  // fragmenting the document with scattered inserts
+  srand(42);
+  unsigned int length = document_length;
+  for(unsigned int i = 0; i < inserts; i++)
+  {
+    if(!piece_table_insert(pt, (unsigned int)rand() % (length + 1), "xy"))
+    {
+      printf("Unable to insert!\n");
+      return 1;
+    }
+    length += 2;
+  }
+
+  piece_table_memory_usage usage;
+  piece_table_memory_stats(pt, &usage);
+  printf("document: %u bytes, %zu pieces\n", length, usage.pieces_count);
+
+  // random lookups, first one pays for building the index if enabled
+  unsigned long checksum = 0;
+  clock_t start = clock();
+  for(unsigned int i = 0; i < lookups; i++)
+  {
+    checksum += (unsigned char)piece_table_get_char_at(
+      pt, (unsigned int)rand() % length);
+  }
+  double seconds = elapsed_seconds(start);
+  printf("get_char_at: %u lookups in %.3fs, %.0f lookups/s\n",
+         lookups,
+         seconds,
+         lookups / seconds);
+
+  // small slices spread over the document
+  start = clock();
+  for(unsigned int i = 0; i < lookups / 10; i++)
+  {
+    char* slice =
+      piece_table_get_slice(pt, (unsigned int)rand() % (length - 80), 80);
+    checksum += (unsigned char)slice[0];
+    free(slice);
+  }
+  seconds = elapsed_seconds(start);
+  printf("get_slice: %u slices in %.3fs, %.0f slices/s\n",
+         lookups / 10,
+         seconds,
+         lookups / 10 / seconds);
+
+  piece_table_memory_stats(pt, &usage);
+  printf("piece index: %zu bytes, pieces: %zu bytes\n",
+         usage.piece_index_bytes,
+         usage.pieces_bytes);
+  printf("checksum: %lu\n", checksum);
+
+  piece_table_free(pt);
+
+  return 0;
+}
@@ -2,6 +2,12 @@
 #define PIECE_TABLE_H
 
 #include <stdbool.h>
+#include <stddef.h>
+
+// Longest text a piece table holds, as positions are unsigned int and
+// piece_table_get_length() returns int. Loading a larger file, or inserting
+// a string or file past it, fails with errno set to EFBIG.
+#define PIECE_TABLE_MAX_LENGTH 0x7fffffffu
 
 #ifdef __cplusplus
 extern "C"
@@ -10,15 +16,187 @@ extern "C"
 
   typedef struct piece_table piece_table;
 
+  // Immutable snapshot of the text of a piece table
+  typedef struct piece_table_view piece_table_view;
+
+  // Immutable, reference counted text shared by piece tables
+  typedef struct piece_table_source piece_table_source;
+
+  // Allocator used by a piece table for its buffers, pieces & undo records
+  typedef struct piece_table_allocator
+  {
+    void* (*alloc)(size_t size, void* user_data);
+    void* (*realloc)(void* pointer, size_t size, void* user_data);
+    void (*free)(void* pointer, void* user_data);
+    void* user_data;
+  } piece_table_allocator;
+
+  // Called as text is indexed, with bytes indexed so far out of total bytes
+  typedef void (*piece_table_progress)(size_t done_bytes,
+                                       size_t total_bytes,
+                                       void* user_data);
+
+  // Called once a file opened with piece_table_from_file_async() is loaded,
+  // from the loader thread. It may call piece_table_wait_loaded() or
+  // piece_table_free() on table, which don't join the loader from there.
+  // Progress callbacks of the loader must call neither, nor index lines.
+  typedef void (*piece_table_loaded)(piece_table* table,
+                                     bool success,
+                                     void* user_data);
+
+  // Called once a save started by piece_table_save_async() is done
+  typedef void (*piece_table_saved)(bool success,
+                                    double elapsed_seconds,
+                                    void* user_data);
+
+  // Receives text written by piece_table_dump(), not null terminated
+  typedef void (*piece_table_sink)(const char* text,
+                                   size_t length,
+                                   void* user_data);
+
+  // Expected access pattern of buffers, given to the kernel as advice
+  typedef enum piece_table_access
+  {
+    PIECE_TABLE_ACCESS_NORMAL,
+    // e.g. saving
+    PIECE_TABLE_ACCESS_SEQUENTIAL,
+    // e.g. lookups from random positions
+    PIECE_TABLE_ACCESS_RANDOM,
+    // e.g. searching soon
+    PIECE_TABLE_ACCESS_WILLNEED
+  } piece_table_access;
+
+  typedef struct piece_table_memory_usage
+  {
+    size_t original_buffer_bytes;
+    size_t add_buffer_used_bytes;
+    size_t add_buffer_capacity_bytes;
+    // add buffer bytes not referenced by any piece
+    size_t add_buffer_wasted_bytes;
+    // inserted files & sources, and buffers of other tables
+    size_t sources_count;
+    size_t sources_bytes;
+    size_t pieces_count;
+    size_t pieces_bytes;
+    // packed pieces cached for lookups
+    size_t piece_index_bytes;
+    // newlines indexed by piece_table_index_lines()
+    size_t line_index_bytes;
+    size_t undo_records_count;
+    size_t undo_records_bytes;
+    size_t redo_records_count;
+    size_t redo_records_bytes;
+    size_t total_bytes;
+  } piece_table_memory_usage;
+
+  // Operation counters, counted only when built with PIECE_TABLE_STATS
+  typedef struct piece_table_stats
+  {
+    // position lookups & pieces walked or probed by them
+    size_t lookups;
+    size_t pieces_visited;
+    size_t splits;
+    size_t pieces_allocated;
+    size_t pieces_freed;
+    // add buffer growths & text they copied
+    size_t add_buffer_reallocations;
+    size_t add_buffer_bytes_copied;
+    size_t add_buffer_bytes_appended;
+    size_t undo_records;
+  } piece_table_stats;
+
+  // Public functions reported to tracers
+  typedef enum piece_table_call
+  {
+    PIECE_TABLE_CALL_INSERT,
+    PIECE_TABLE_CALL_INSERT_FILE,
+    PIECE_TABLE_CALL_INSERT_SOURCE,
+    PIECE_TABLE_CALL_START_MICRO_INSERTS,
+    PIECE_TABLE_CALL_MICRO_INSERT,
+    PIECE_TABLE_CALL_STOP_MICRO_INSERTS,
+    PIECE_TABLE_CALL_REMOVE,
+    PIECE_TABLE_CALL_REPLACE,
+    PIECE_TABLE_CALL_UNDO,
+    PIECE_TABLE_CALL_REDO,
+    PIECE_TABLE_CALL_MEMSAFE_REMOVE,
+    PIECE_TABLE_CALL_MEMSAFE_UNDO,
+    PIECE_TABLE_CALL_MEMSAFE_REDO,
+    PIECE_TABLE_CALL_GET_CHAR_AT,
+    PIECE_TABLE_CALL_GET_LINE,
+    PIECE_TABLE_CALL_GET_SLICE,
+    PIECE_TABLE_CALL_INDEX_LINES,
+    PIECE_TABLE_CALL_WAIT_LOADED,
+    PIECE_TABLE_CALL_TO_STRING,
+    PIECE_TABLE_CALL_TO_STRING_PARALLEL,
+    PIECE_TABLE_CALL_CLONE,
+    PIECE_TABLE_CALL_SPLIT_AT,
+    PIECE_TABLE_CALL_CONCAT,
+    PIECE_TABLE_CALL_FREEZE,
+    PIECE_TABLE_CALL_COMPACT,
+    PIECE_TABLE_CALL_SNAPSHOT,
+    PIECE_TABLE_CALL_SAVE,
+    PIECE_TABLE_CALL_SAVE_ASYNC
+  } piece_table_call;
+
+  // Traced call of a public function, timestamps are nanoseconds of
+  // a monotonic clock
+  typedef struct piece_table_trace_event
+  {
+    piece_table_call call;
+    // name of the function, e.g. "piece_table_insert"
+    const char* name;
+    // arguments of the call, e.g. line for piece_table_get_line() or
+    // length of inserted string, 0 when the call has none
+    unsigned int position;
+    unsigned int length;
+    unsigned long long begin_nanoseconds;
+    // set for end callbacks only
+    unsigned long long end_nanoseconds;
+    bool success;
+  } piece_table_trace_event;
+
+  // Called on the calling thread before & after traced calls, outside of
+  // locks of the piece table, so time waiting for them is part of the call
+  typedef struct piece_table_tracer
+  {
+    void (*begin)(const piece_table* table,
+                  const piece_table_trace_event* event,
+                  void* user_data);
+    void (*end)(const piece_table* table,
+                const piece_table_trace_event* event,
+                void* user_data);
+    void* user_data;
+  } piece_table_tracer;
+
   // Piece Table API
   piece_table* piece_table_new();
 
+  piece_table* piece_table_new_with_allocator(
+    const piece_table_allocator* allocator);
+
   piece_table* piece_table_from_string(const char* string);
 
+  piece_table* piece_table_from_string_with_allocator(
+    const char* string,
+    const piece_table_allocator* allocator);
+
+  piece_table* piece_table_from_file(const char* path);
+
+  piece_table* piece_table_from_file_async(const char* path,
+                                           const unsigned int threads,
+                                           piece_table_progress progress,
+                                           piece_table_loaded loaded,
+                                           void* user_data);
+  bool piece_table_wait_loaded(piece_table* table);
+
   bool piece_table_insert(piece_table* table,
                           const unsigned int position,
                           const char* string);
 
+  bool piece_table_insert_file(piece_table* table,
+                               const unsigned int position,
+                               const char* path);
+
   bool piece_table_start_micro_inserts(piece_table* table,
                                        const unsigned int position);
   bool piece_table_micro_insert(piece_table* table, const char* string);
@@ -49,6 +227,11 @@ extern "C"
 
   char* piece_table_get_line(const piece_table* table, const unsigned int line);
 
+  bool piece_table_index_lines(const piece_table* table,
+                               const unsigned int threads,
+                               piece_table_progress progress,
+                               void* user_data);
+
   char* piece_table_get_slice(const piece_table* table,
                               const unsigned int position,
                               const unsigned int length);
@@ -57,10 +240,80 @@ extern "C"
 
   char* piece_table_to_string(const piece_table* table);
 
+  char* piece_table_to_string_parallel(const piece_table* table,
+                                       const unsigned int threads);
+
+  piece_table* piece_table_clone(const piece_table* table);
+
+  bool piece_table_split_at(const piece_table* table,
+                            const unsigned int position,
+                            piece_table** left,
+                            piece_table** right);
+  piece_table* piece_table_concat(const piece_table* a, const piece_table* b);
+
+  bool piece_table_freeze(piece_table* table);
+
+  bool piece_table_compact(piece_table* table);
+
+  // Thread Safety
+  bool piece_table_enable_thread_safety(piece_table* table);
+
+  // Buffer Memory
+  bool piece_table_use_huge_pages(piece_table* table, const bool enable);
+  bool piece_table_advise(const piece_table* table,
+                          const piece_table_access access);
+
+  // Snapshots
+  piece_table_view* piece_table_snapshot(const piece_table* table);
+  char piece_table_view_get_char_at(const piece_table_view* view,
+                                    const unsigned int position);
+  char* piece_table_view_get_slice(const piece_table_view* view,
+                                   const unsigned int position,
+                                   const unsigned int length);
+  int piece_table_view_get_length(const piece_table_view* view);
+  char* piece_table_view_to_string(const piece_table_view* view);
+  char* piece_table_view_to_string_parallel(const piece_table_view* view,
+                                            const unsigned int threads);
+  bool piece_table_view_release(piece_table_view* view);
+
+  // Saving
+  bool piece_table_save(const piece_table* table, const char* path);
+  bool piece_table_save_async(const piece_table* table,
+                              const char* path,
+                              piece_table_saved saved,
+                              void* user_data);
+  bool piece_table_view_save(const piece_table_view* view, const char* path);
+
+  // Shared Sources
+  piece_table_source* piece_table_source_from_string(const char* string);
+  piece_table_source* piece_table_source_from_file(const char* path);
+  piece_table* piece_table_from_source(piece_table_source* source);
+  bool piece_table_insert_source(piece_table* table,
+                                 const unsigned int position,
+                                 piece_table_source* source);
+  bool piece_table_source_release(piece_table_source* source);
+
+  // Memory Accounting
+  bool piece_table_memory_stats(const piece_table* table,
+                                piece_table_memory_usage* stats);
+
+  // Tracing
+  bool piece_table_set_tracer(piece_table* table,
+                              const piece_table_tracer* tracer);
+
+  // Operation Counters
+  bool piece_table_get_stats(const piece_table* table,
+                             piece_table_stats* stats);
+  bool piece_table_reset_stats(piece_table* table);
+
   bool piece_table_free(piece_table* table);
 
   // Loggers
   bool piece_table_log(piece_table* table);
+  bool piece_table_dump(const piece_table* table,
+                        const unsigned int max_pieces,
+                        piece_table_sink sink,
+                        void* user_data);
 
 #ifdef __cplusplus
 }
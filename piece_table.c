@@ -1,14 +1,128 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+// for writer preferring rwlocks on glibc
+#  define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "piece-table.h"
 
+#ifdef _WIN32
+#  include <io.h>
+#  include <windows.h>
+#else
+#  include <pthread.h>
+#  include <time.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#  define PIECE_TABLE_HAS_MMAP
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
+#ifdef _MSC_VER
+#  define atomic_load_pointer(pointer) \
+    InterlockedCompareExchangePointer((PVOID volatile*)(pointer), NULL, NULL)
+#  define atomic_store_pointer(pointer, value) \
+    InterlockedExchangePointer((PVOID volatile*)(pointer), (value))
+#  define atomic_load_count(count) \
+    InterlockedCompareExchange((LONG volatile*)(count), 0, 0)
+#  define atomic_increment(count) InterlockedIncrement((LONG volatile*)(count))
+#  define atomic_decrement(count) InterlockedDecrement((LONG volatile*)(count))
+#  define atomic_store_count(count, value) \
+    InterlockedExchange((LONG volatile*)(count), (LONG)(value))
+#  define atomic_compare_exchange_pointer(pointer, expected, desired) \
+    (InterlockedCompareExchangePointer((PVOID volatile*)(pointer),         \
+                                       (desired),                         \
+                                       (expected)) == (expected))
+#  define atomic_compare_exchange_count(count, expected, desired) \
+    (InterlockedCompareExchange((LONG volatile*)(count),                  \
+                                (LONG)(desired),                         \
+                                (LONG)(expected)) == (LONG)(expected))
+#  define atomic_add_size(size, amount) \
+    InterlockedExchangeAddSizeT((size), (amount))
+#  define atomic_load_size(size) InterlockedExchangeAddSizeT((size), 0)
+#  define atomic_store_size(size, value) \
+    InterlockedExchangePointer((PVOID volatile*)(size), (PVOID)(value))
+#else
+#  define atomic_load_pointer(pointer) \
+    __atomic_load_n((pointer), __ATOMIC_ACQUIRE)
+#  define atomic_store_pointer(pointer, value) \
+    __atomic_store_n((pointer), (value), __ATOMIC_RELEASE)
+#  define atomic_load_count(count) __atomic_load_n((count), __ATOMIC_ACQUIRE)
+#  define atomic_increment(count) \
+    __atomic_add_fetch((count), 1, __ATOMIC_RELAXED)
+#  define atomic_decrement(count) \
+    __atomic_sub_fetch((count), 1, __ATOMIC_ACQ_REL)
+#  define atomic_store_count(count, value) \
+    __atomic_store_n((count), (value), __ATOMIC_RELEASE)
+#  define atomic_compare_exchange_pointer(pointer, expected, desired) \
+    __sync_bool_compare_and_swap((pointer), (expected), (desired))
+#  define atomic_compare_exchange_count(count, expected, desired) \
+    __sync_bool_compare_and_swap((count), (expected), (desired))
+#  define atomic_add_size(size, amount) \
+    __atomic_add_fetch((size), (amount), __ATOMIC_RELAXED)
+#  define atomic_load_size(size) __atomic_load_n((size), __ATOMIC_RELAXED)
+#  define atomic_store_size(size, value) \
+    __atomic_store_n((size), (value), __ATOMIC_RELAXED)
+#endif
+
+// Operation counters are compiled in only with PIECE_TABLE_STATS,
+// otherwise counting costs nothing, not even evaluating the amount.
+// Readers count too, so counters are updated atomically.
+#ifdef PIECE_TABLE_STATS
+#  define count_stat(table, counter, amount) \
+    atomic_add_size(&((piece_table*)(table))->stats.counter, (size_t)(amount))
+#else
+#  define count_stat(table, counter, amount) \
+    ((void)sizeof(table), (void)sizeof(amount))
+#endif
+
+// Buffers at least this large are backed by huge pages when enabled
+#define HUGE_PAGE_SIZE (2u * 1024u * 1024u)
+
+// Ranges copied by each thread of a parallel copy are at least this large
+#define PARALLEL_COPY_MIN_BYTES (1u << 20)
+
+// Lookups walk the pieces until this many happened since the last
+// mutation, then the piece index is built. Building costs about as much as
+// a few walks, so edits interleaved with reads, as while typing, never
+// rebuild it only to drop it on the next edit.
+#define PIECE_INDEX_MIN_LOOKUPS 4
+
+// Source buffers are indexed for lines in chunks of this size
+#define LINE_INDEX_CHUNK_SIZE (1u << 20)
+
+// Dumps are handed to the sink in pieces of at most this size
+#define DUMP_BUFFER_SIZE 1024
+
+// Piece lengths are counted in power of two buckets by dumps,
+// one for empty pieces & one for each bit of length
+#define DUMP_HISTOGRAM_BUCKETS 33
+
+// Indexes of source buffers every piece table has,
+// buffers inserted from files are indexed after these
 typedef enum buffer_type
 {
   ORIGINAL,
   ADD
 } buffer_type;
 
+// Where the memory of a buffer comes from, decides how it is released
+typedef enum buffer_memory
+{
+  BUFFER_MEMORY_ALLOCATOR,
+  BUFFER_MEMORY_MAPPED_FILE,
+  BUFFER_MEMORY_MAPPED_PAGES
+} buffer_memory;
+
 typedef enum operation_type
 {
   INSERT,
@@ -18,13 +132,109 @@ typedef enum operation_type
 
 typedef struct piece
 {
-  buffer_type buffer;
+  // index of source buffer
+  unsigned int buffer;
   unsigned int start_position;
   unsigned int length;
 
   struct piece* next;
 } piece;
 
+// Piece packed for lookups, without the link to next piece: 12 bytes
+// against 24 of a list node. Buffer tag used to be folded into the top bit
+// of start position, pieces of inserted files & sources need a full
+// buffer index since, so it has its own field.
+typedef struct packed_piece
+{
+  unsigned int buffer;
+  unsigned int start_position;
+  unsigned int length;
+} packed_piece;
+
+// State of a chunk of a line index
+typedef enum line_chunk_state
+{
+  LINE_CHUNK_PENDING,
+  LINE_CHUNK_INDEXED,
+  LINE_CHUNK_FAILED
+} line_chunk_state;
+
+// Positions of newlines within one chunk of a source buffer
+typedef struct line_chunk
+{
+  unsigned int* newlines;
+  unsigned int count;
+  unsigned int state;
+} line_chunk;
+
+// Newlines of an immutable source buffer. Chunks are claimed & indexed by
+// threads in any order, and published as a prefix: first_newlines[i] is
+// the number of newlines before chunk i, valid for i <= indexed_chunks.
+// Arrays are allocated once, so readers use the published prefix without
+// locks while later chunks are still being indexed.
+typedef struct line_index
+{
+  unsigned int chunks_count;
+  line_chunk* chunks;
+  unsigned int* first_newlines;
+  unsigned int indexed_chunks;
+  unsigned int next_chunk;
+  // length of buffer when the index was created
+  unsigned int length;
+  // set while a thread builds the index, others wait on built for it
+  unsigned int building;
+#ifdef _WIN32
+  SRWLOCK building_lock;
+  CONDITION_VARIABLE built;
+#else
+  pthread_mutex_t building_lock;
+  pthread_cond_t built;
+#endif
+} line_index;
+
+// Reference counted buffer shared by piece tables, their clones and
+// snapshots. Text before length is never changed once written, so a table
+// can keep appending past it while others read what they reference.
+// Length is the end of text appended by any table sharing the buffer,
+// a table appends in place only while its own end is still the buffer's end.
+// Buffer keeps the allocator it was allocated with, as it can outlive
+// the piece table. Sources handed to callers are just text buffers.
+typedef struct piece_table_source
+{
+  char* data;
+  unsigned int length;
+  // size of allocation or mapping
+  unsigned int capacity;
+  buffer_memory memory;
+  unsigned int references;
+  piece_table_allocator allocator;
+  // set once by piece_table_index_lines(), never for add buffers
+  line_index* lines;
+} text_buffer;
+
+// Read-only array of packed pieces, built lazily from the pieces list
+// and dropped on every mutation. Pieces are addressed by index and
+// ends[i] is the text position right after pieces[i], kept in an array of
+// its own so lookups are a binary search touching only 4 bytes per probe.
+// Lookups right after a mutation walk the pieces instead, see
+// PIECE_INDEX_MIN_LOOKUPS.
+// Index references buffers its pieces point into and is reference
+// counted itself, snapshots handed to readers are just piece indexes.
+typedef struct piece_table_view
+{
+  unsigned int count;
+  unsigned int length;
+  packed_piece* pieces;
+  unsigned int* ends;
+
+  text_buffer** sources;
+  unsigned int sources_count;
+  // end of add buffer text of the table when index was built
+  unsigned int add_buffer_length;
+  unsigned int references;
+  piece_table_allocator allocator;
+} piece_index;
+
 typedef struct operation
 {
   operation_type type;
@@ -33,6 +243,11 @@ typedef struct operation
   piece* start_piece;
   piece* end_piece;
   piece* next_piece;
+  // pieces a remove linked in place of start_piece..end_piece,
+  // chained up to next_piece
+  piece* replacement_piece;
+  // add buffer bytes a remove took out of text, or an insert put in
+  unsigned int add_length;
 
   struct operation* next;
 } operation;
@@ -48,16 +263,96 @@ typedef struct memsafe_operation
   unsigned int start_position;
   unsigned int length;
   char* string;
+  // inserted source buffers aren't copied, the record retains them instead
+  text_buffer* source;
+  unsigned int source_start;
 
   struct memsafe_operation* next;
 } memsafe_operation;
 
+// Range of add buffer referenced by some piece,
+// used while compacting the add buffer
+typedef struct add_buffer_range
+{
+  unsigned int start_position;
+  unsigned int end_position;
+  unsigned int new_start_position;
+} add_buffer_range;
+
+// Traced public call, the tracer is copied under the lock when the call
+// begins so piece_table_set_tracer() may run while calls are traced
+typedef struct trace_call
+{
+  piece_table_trace_event event;
+  piece_table_tracer tracer;
+} trace_call;
+
+// Locks of a thread safe piece table: readers share rwlock, writers own it,
+// index_lock serializes readers building the piece index
+typedef struct table_lock
+{
+#ifdef _WIN32
+  SRWLOCK rwlock;
+  SRWLOCK index_lock;
+#else
+  pthread_rwlock_t rwlock;
+  pthread_mutex_t index_lock;
+#endif
+} table_lock;
+
+// Background thread loading original buffer of a piece table opened with
+// piece_table_from_file_async(). It references the buffer, never the table
+// apart from handing it to the loaded callback.
+typedef struct file_loader
+{
+  // held while the thread is created, so the thread itself reads
+  // its id only once it is set
+#ifdef _WIN32
+  SRWLOCK thread_lock;
+  HANDLE thread;
+#else
+  pthread_mutex_t thread_lock;
+  pthread_t thread;
+#endif
+  piece_table* table;
+  text_buffer* buffer;
+  unsigned int threads;
+  piece_table_progress progress;
+  piece_table_loaded loaded;
+  void* user_data;
+  // set when the table is freed before loading finished
+  unsigned int cancelled;
+  bool result;
+} file_loader;
+
 struct piece_table
 {
-  char* original_buffer;
-  char* add_buffer;
+  piece_table_allocator allocator;
+  table_lock* lock;
+  file_loader* loader;
+  // set by piece_table_set_tracer(), tracing is read atomically
+  // so calls without a tracer don't take the lock to check it
+  piece_table_tracer tracer;
+  unsigned int tracing;
+
+  // buffers pieces point into, indexed by buffer of piece
+  text_buffer** sources;
+  unsigned int sources_count;
+  unsigned int sources_capacity;
+  // end of add buffer text appended by this table
+  unsigned int add_buffer_length;
+  bool huge_pages;
 
   piece* pieces_head;
+  // length of text, kept by inserts & removes, forgotten by other changes
+  unsigned int text_length;
+  bool text_length_known;
+  piece_index* index;
+  // lookups since the last mutation, counted while there is no index
+  unsigned int lookups_since_mutation;
+  // pieces of a clone stay in the index shared with its source
+  // until the clone is first changed
+  piece_index* cow_index;
 
   // depreciated
   operation* undo_stack_top;
@@ -69,39 +364,706 @@ struct piece_table
 
   piece* piece_with_micro_inserts;
   operation* undo_with_micro_inserts;
+
+  // memory accounting
+  unsigned int pieces_count;
+  unsigned int undo_records_count;
+  unsigned int undo_records_bytes;
+  unsigned int redo_records_count;
+  unsigned int redo_records_bytes;
+  // add buffer bytes only undo & redo records reference,
+  // and bytes nothing references any more
+  unsigned int add_buffer_kept_length;
+  unsigned int add_buffer_wasted_length;
+
+#ifdef PIECE_TABLE_STATS
+  piece_table_stats stats;
+#endif
 };
 
+/// Allocator API
+void* default_alloc(size_t size, void* user_data);
+void* default_realloc(void* pointer, size_t size, void* user_data);
+void default_free(void* pointer, void* user_data);
+
+/// @brief Allocates zeroed memory using allocator of piece table.
+/// @param table Pointer to piece table.
+/// @param size Size of memory in bytes.
+/// @return Returns NULL if unable to allocate memory.
+void* table_alloc(const piece_table* table, const size_t size);
+
+/// @brief Reallocates memory using allocator of piece table.
+/// @param table Pointer to piece table.
+/// @param pointer Memory allocated by allocator of piece table or NULL.
+/// @param size New size of memory in bytes.
+/// @return Returns NULL if unable to allocate memory.
+void* table_realloc(const piece_table* table,
+                    void* pointer,
+                    const size_t size);
+
+/// @brief Frees memory using allocator of piece table.
+/// @param table Pointer to piece table.
+/// @param pointer Memory allocated by allocator of piece table or NULL.
+void table_free(const piece_table* table, void* pointer);
+
+/// @brief Duplicates string using allocator of piece table.
+/// @param table Pointer to piece table.
+/// @param string String to duplicate.
+/// @return Returns NULL if unable to allocate memory.
+char* table_strdup(const piece_table* table, const char* string);
+
+/// Buffer Memory API
+
+/// @brief Maps anonymous pages for a buffer, preferring huge pages.
+/// @param size Size of buffer in bytes, multiple of HUGE_PAGE_SIZE.
+/// @return Returns NULL if pages can't be mapped.
+char* map_pages(const size_t size);
+
+/// @brief Creates a new empty text buffer, referenced once.
+/// @param allocator Allocator of buffer.
+/// @return Returns NULL if unable to allocate memory.
+text_buffer* text_buffer_new(const piece_table_allocator* allocator);
+
+/// @brief Copies string into a new text buffer.
+/// @param allocator Allocator of buffer.
+/// @param string String to copy.
+/// @return Returns NULL if unable to allocate memory.
+text_buffer* text_buffer_from_string(const piece_table_allocator* allocator,
+                                     const char* string);
+
+/// @brief Adds a reference to text buffer.
+/// @param buffer Text buffer.
+void text_buffer_retain(text_buffer* buffer);
+
+/// @brief Drops a reference to text buffer, freeing it with the last one.
+/// @param buffer Text buffer, can be NULL.
+void text_buffer_release(text_buffer* buffer);
+
+/// @brief Tells if text buffer is referenced by more than its table.
+/// @param buffer Text buffer.
+/// @return Returns true if some snapshot or clone references the buffer.
+bool text_buffer_is_shared(text_buffer* buffer);
+
+/// @brief Reserves room for appending right after end of text of a table.
+/// @param buffer Text buffer.
+/// @param end End of text appended by the table.
+/// @param length Length of text to append.
+/// @return Returns false if there's no room or another table appended past end.
+bool text_buffer_reserve(text_buffer* buffer,
+                         const unsigned int end,
+                         const unsigned int length);
+
+/// @brief Applies access advice to a range of memory.
+/// @param buffer Start of range.
+/// @param size Size of range in bytes.
+/// @param access Expected access pattern.
+/// @return Returns false if advice can't be applied.
+bool advise_range(const char* buffer,
+                  const size_t size,
+                  const piece_table_access access);
+
+/// Source Buffers API
+
+/// @brief Adds source buffer to piece table, taking over a reference to it.
+/// @param table Pointer to piece table.
+/// @param buffer Text buffer.
+/// @param source Pointer to index of new source.
+/// @return Returns false if unable to allocate memory.
+bool table_add_source(piece_table* table,
+                      text_buffer* buffer,
+                      unsigned int* source);
+
+/// @brief Finds source buffer of piece table, sharing it if not found.
+/// @param table Pointer to piece table.
+/// @param buffer Text buffer.
+/// @param source Pointer to index of source.
+/// @return Returns false if unable to allocate memory.
+bool table_find_source(piece_table* table,
+                       text_buffer* buffer,
+                       unsigned int* source);
+
+/// @brief Replaces source buffers of piece table with ones of piece index.
+/// @param table Pointer to piece table.
+/// @param index Piece index.
+/// @return Returns false if unable to allocate memory.
+bool table_share_sources(piece_table* table, const piece_index* index);
+
+/// @brief Drops references to every source buffer of piece table.
+/// @param table Pointer to piece table.
+void table_release_sources(piece_table* table);
+
+/// @brief Makes text buffer the original buffer of an empty piece table.
+/// @param table Pointer to piece table.
+/// @param buffer Text buffer, piece table takes over a reference to it.
+/// @return Returns false if unable to allocate memory.
+bool table_set_original(piece_table* table, text_buffer* buffer);
+
+/// @brief Inserts whole text buffer as a single piece, retaining it as a
+/// source of the piece table.
+/// @param table Pointer to piece table.
+/// @param position Position to insert at.
+/// @param buffer Text buffer.
+/// @return Returns false if position is out of bounds, text would get longer
+/// than PIECE_TABLE_MAX_LENGTH (errno is EFBIG) or unable to allocate memory.
+bool table_insert_source(piece_table* table,
+                         const unsigned int position,
+                         text_buffer* buffer);
+
+/// @brief Loads file into a new text buffer, mapping it when possible.
+/// @param allocator Allocator of buffer.
+/// @param path Path of file.
+/// @return Returns NULL if file can't be read, is longer than
+/// PIECE_TABLE_MAX_LENGTH (errno is EFBIG) or unable to allocate memory.
+text_buffer* text_buffer_from_file(const piece_table_allocator* allocator,
+                                   const char* path);
+
+/// Locking API
+
+/// @brief Acquires lock of piece table for reading, if it is thread safe.
+/// @param table Pointer to piece table.
+void table_read_lock(const piece_table* table);
+
+/// @brief Releases read lock of piece table, if it is thread safe.
+/// @param table Pointer to piece table.
+void table_read_unlock(const piece_table* table);
+
+/// @brief Acquires lock of piece table for writing, if it is thread safe.
+/// @param table Pointer to piece table.
+void table_write_lock(const piece_table* table);
+
+/// @brief Releases write lock of piece table, if it is thread safe.
+/// @param table Pointer to piece table.
+void table_write_unlock(const piece_table* table);
+
+/// @brief Makes piece table thread safe by creating its locks.
+/// @param table Pointer to piece table.
+/// @return Returns false if unable to create locks.
+bool table_lock_new(piece_table* table);
+
+/// @brief Destroys locks of piece table.
+/// @param table Pointer to piece table.
+void table_lock_free(piece_table* table);
+
+/// @brief Serializes readers filling lazily built caches of piece table.
+/// @param table Pointer to piece table.
+void table_cache_lock(const piece_table* table);
+
+/// @brief Releases lock taken by table_cache_lock().
+/// @param table Pointer to piece table.
+void table_cache_unlock(const piece_table* table);
+
+/// Unlocked Piece Table API
+/// public functions lock the piece table and call these
+bool piece_table_insert_unlocked(piece_table* table,
+                                 const unsigned int position,
+                                 const char* string);
+bool piece_table_insert_file_unlocked(piece_table* table,
+                                      const unsigned int position,
+                                      const char* path);
+bool piece_table_start_micro_inserts_unlocked(piece_table* table,
+                                              const unsigned int position);
+bool piece_table_micro_insert_unlocked(piece_table* table, const char* string);
+bool piece_table_stop_micro_inserts_unlocked(piece_table* table);
+bool piece_table_remove_unlocked(piece_table* table,
+                                 const unsigned int position,
+                                 const unsigned int length);
+bool piece_table_replace_unlocked(piece_table* table,
+                                  const unsigned int position,
+                                  const unsigned int length,
+                                  const char* string);
+bool piece_table_undo_unlocked(piece_table* table);
+bool piece_table_redo_unlocked(piece_table* table);
+bool piece_table_memsafe_remove_unlocked(piece_table* table,
+                                         const unsigned int position,
+                                         const unsigned int length);
+bool piece_table_memsafe_undo_unlocked(piece_table* table);
+bool piece_table_memsafe_redo_unlocked(piece_table* table);
+char piece_table_get_char_at_unlocked(const piece_table* table,
+                                      const unsigned int position);
+char* piece_table_get_line_unlocked(const piece_table* table,
+                                    const unsigned int line);
+char* piece_table_get_slice_unlocked(const piece_table* table,
+                                     const unsigned int position,
+                                     const unsigned int length);
+int piece_table_get_length_unlocked(const piece_table* table);
+char* piece_table_to_string_unlocked(const piece_table* table);
+piece_table* piece_table_clone_unlocked(const piece_table* table);
+bool piece_table_freeze_unlocked(piece_table* table);
+bool piece_table_compact_unlocked(piece_table* table);
+bool piece_table_use_huge_pages_unlocked(piece_table* table, const bool enable);
+bool piece_table_advise_unlocked(const piece_table* table,
+                                 const piece_table_access access);
+bool piece_table_memory_stats_unlocked(const piece_table* table,
+                                       piece_table_memory_usage* stats);
+bool piece_table_set_tracer_unlocked(piece_table* table,
+                                     const piece_table_tracer* tracer);
+bool piece_table_get_stats_unlocked(const piece_table* table,
+                                    piece_table_stats* stats);
+bool piece_table_reset_stats_unlocked(piece_table* table);
+bool piece_table_log_unlocked(piece_table* table);
+
 /// Piece API
-piece* piece_new(const buffer_type buffer,
+piece* piece_new(piece_table* table,
+                 const unsigned int buffer,
                  const unsigned int start_position,
                  const unsigned int length);
-bool piece_free(piece* p);
+bool piece_free(piece_table* table, piece* p);
+
+/// Piece Index API
+
+/// @brief Packs pieces of piece table into a new piece index.
+/// @param table Pointer to piece table.
+/// @return Returns NULL if unable to allocate memory or piece can't be packed.
+piece_index* piece_index_new(piece_table* table);
+
+/// @brief Drops a reference to piece index, freeing it with the last one.
+/// @param index Piece index, can be NULL.
+/// @return Returns false if index passed is NULL.
+bool piece_index_release(piece_index* index);
+
+/// @brief Finds the piece containing text position.
+/// @param index Pointer to piece index.
+/// @param position Text position, must be less than length of index.
+/// @return Returns index of the piece in piece index.
+unsigned int piece_index_find(const piece_index* index,
+                              const unsigned int position);
+
+/// @brief Gives number of pieces probed by piece_index_find().
+/// @param index Pointer to piece index.
+/// @return Returns depth of binary search over pieces of index.
+unsigned int piece_index_search_steps(const piece_index* index);
+
+/// @brief Gives piece index of piece table for a lookup, building it once
+/// enough lookups happened since the last mutation.
+/// @param table Pointer to piece table.
+/// @return Returns NULL if pieces should be walked instead, piece index is
+/// disabled or can't be built.
+const piece_index* get_piece_index(const piece_table* table);
+
+/// @brief Gives piece index of piece table, building it if needed.
+/// @param table Pointer to piece table.
+/// @return Returns NULL if unable to allocate memory.
+piece_index* build_piece_index(const piece_table* table);
+
+/// @brief Drops piece index of piece table, must be called before mutations.
+/// @param table Pointer to piece table.
+/// @return Returns false if pieces shared by a clone can't be copied.
+bool invalidate_piece_index(piece_table* table);
+
+/// @brief Gives length of text, counting it only if no change kept it.
+/// @param table Pointer to piece table.
+/// @return Returns length of text of piece table.
+unsigned int table_text_length(piece_table* table);
+
+/// @brief Gives a new reference to piece index of piece table.
+/// @param table Pointer to piece table.
+/// @return Returns NULL if unable to allocate memory or piece can't be packed.
+piece_index* retain_piece_index(const piece_table* table);
+
+/// @brief Copies pieces of a clone out of the index shared with its source.
+/// @param table Pointer to piece table.
+/// @return Returns false if unable to allocate memory.
+bool materialize_pieces(piece_table* table);
+
+/// @brief Gives pieces list of piece table, copying shared pieces if needed.
+/// @param table Pointer to piece table.
+/// @return Returns first piece of piece table.
+piece* get_pieces(const piece_table* table);
+
+/// @brief Gives text of packed piece.
+/// @param index Piece index containing the packed piece.
+/// @param p Packed piece.
+/// @return Returns pointer to first character of packed piece.
+const char* packed_piece_text(const piece_index* index, const packed_piece p);
+
+/// @brief Gives character at text position using piece index.
+/// @param index Pointer to piece index.
+/// @param position Text position.
+/// @return Returns '\0' if position is out of bounds.
+char piece_index_get_char_at(const piece_index* index,
+                             const unsigned int position);
+
+/// @brief Copies slice of text using piece index.
+/// @param index Pointer to piece index.
+/// @param position Starting position of slice.
+/// @param length Length of slice.
+/// @return Returns NULL if slice is out of bounds or unable to allocate memory.
+char* piece_index_get_slice(const piece_index* index,
+                            const unsigned int position,
+                            const unsigned int length);
+
+/// @brief Copies range of text of piece index, without terminating it.
+/// @param index Pointer to piece index.
+/// @param position Starting position of range.
+/// @param length Length of range, must be within text of index.
+/// @param destination Memory to copy the range to.
+void piece_index_copy(const piece_index* index,
+                      const unsigned int position,
+                      const unsigned int length,
+                      char* destination);
+
+/// Parallel Copy API
+
+// Range of text of a piece index copied by one thread
+typedef struct copy_range
+{
+  const piece_index* index;
+  unsigned int position;
+  unsigned int length;
+  char* destination;
+} copy_range;
+
+/// @brief Thread entry copying a range of text.
+/// @param argument Pointer to copy range.
+/// @return Returns 0.
+#ifdef _WIN32
+DWORD WINAPI copy_range_run(LPVOID argument);
+#else
+void* copy_range_run(void* argument);
+#endif
+
+/// @brief Gives number of processors online.
+/// @return Returns 1 if it can't be told.
+unsigned int processor_count();
+
+/// @brief Copies whole text of piece index, splitting it into ranges copied
+/// by threads. Output offsets of ranges are found from the prefix sums of
+/// piece lengths, so threads write to disjoint memory.
+/// @param index Pointer to piece index.
+/// @param threads Number of threads, 0 for one per processor.
+/// @return Returns NULL if unable to allocate memory.
+char* piece_index_to_string_parallel(const piece_index* index,
+                                     unsigned int threads);
+
+/// Line Index API
+
+// Source buffer being indexed for lines by threads
+typedef struct line_index_job
+{
+  text_buffer* buffer;
+  line_index* index;
+  const unsigned int* cancelled;
+} line_index_job;
+
+/// @brief Gives line index of source buffer, creating it if needed.
+/// @param buffer Source buffer, must not be appended to.
+/// @return Returns NULL if unable to allocate memory.
+line_index* line_index_get(text_buffer* buffer);
+
+/// @brief Frees line index of source buffer.
+/// @param buffer Source buffer.
+void line_index_free(text_buffer* buffer);
+
+/// @brief Records newlines of one chunk of source buffer.
+/// @param job Source buffer & its line index.
+/// @param chunk Index of chunk.
+void line_index_chunk(const line_index_job* job, const unsigned int chunk);
+
+/// @brief Thread entry indexing chunks of source buffer until none is left.
+/// @param argument Pointer to line index job.
+/// @return Returns 0.
+#ifdef _WIN32
+DWORD WINAPI line_index_run(LPVOID argument);
+#else
+void* line_index_run(void* argument);
+#endif
+
+/// @brief Stitches chunks indexed so far onto the published prefix.
+/// @param index Pointer to line index.
+/// @return Returns number of chunks published.
+unsigned int line_index_publish(line_index* index);
+
+/// @brief Indexes newlines of source buffer using threads.
+/// @param buffer Source buffer.
+/// @param threads Number of threads, including the calling one.
+/// @param progress Progress callback, can be NULL.
+/// @param done_bytes Bytes of sources indexed before this one.
+/// @param total_bytes Bytes of all sources being indexed.
+/// @param user_data User data passed to progress callback.
+/// @param cancelled Flag stopping threads once set, can be NULL.
+/// @return Returns false if unable to allocate memory or cancelled,
+/// indexing resumes from the published prefix when built again. Waits for
+/// another thread building the index first, resuming it if that build
+/// stopped early.
+bool line_index_build(text_buffer* buffer,
+                      const unsigned int threads,
+                      piece_table_progress progress,
+                      const size_t done_bytes,
+                      const size_t total_bytes,
+                      void* user_data,
+                      const unsigned int* cancelled);
+
+/// @brief Makes calling thread the one building line index, waiting for
+/// any other thread building it to finish.
+/// @param index Pointer to line index.
+/// @return Returns false if index is complete, so there is nothing to build.
+bool line_index_begin_build(line_index* index);
+
+/// @brief Ends build started by line_index_begin_build(), waking threads
+/// waiting for it.
+/// @param index Pointer to line index.
+void line_index_end_build(line_index* index);
+
+/// @brief Gives memory used by line index.
+/// @param index Pointer to line index.
+/// @return Returns size in bytes of the index & newlines published so far.
+size_t line_index_bytes(const line_index* index);
+
+/// @brief Counts newlines of line index before a position.
+/// @param index Pointer to line index.
+/// @param position Position within the published prefix of the index.
+/// @return Returns number of newlines before position.
+unsigned int line_index_newlines_before(const line_index* index,
+                                        const unsigned int position);
+
+/// @brief Counts newlines in a range of source buffer, using the indexed
+/// prefix of its line index and scanning the rest.
+/// @param buffer Source buffer.
+/// @param start Start of range.
+/// @param end End of range.
+/// @return Returns number of newlines in range.
+unsigned int source_count_newlines(const text_buffer* buffer,
+                                   unsigned int start,
+                                   const unsigned int end);
+
+/// @brief Finds a newline in a range of source buffer.
+/// @param buffer Source buffer.
+/// @param start Start of range.
+/// @param end End of range.
+/// @param n Which newline of range to find, starting from 1.
+/// @return Returns position of newline, or end if range has less newlines.
+unsigned int source_find_newline(const text_buffer* buffer,
+                                 unsigned int start,
+                                 const unsigned int end,
+                                 unsigned int n);
+
+/// File Loader API
+
+/// @brief Thread entry loading & indexing lines of the buffer of a loader.
+/// @param argument Pointer to file loader.
+/// @return Returns 0.
+#ifdef _WIN32
+DWORD WINAPI file_loader_run(LPVOID argument);
+#else
+void* file_loader_run(void* argument);
+#endif
+
+/// @brief Starts loading original buffer of piece table in a background
+/// thread.
+/// @param table Pointer to piece table.
+/// @param threads Number of threads indexing lines, 0 for one per processor.
+/// @param progress Progress callback, can be NULL.
+/// @param loaded Completion callback, can be NULL.
+/// @param user_data User data passed to callbacks.
+/// @return Returns false if unable to allocate memory or start the thread,
+/// callbacks are never called then.
+bool file_loader_start(piece_table* table,
+                       const unsigned int threads,
+                       piece_table_progress progress,
+                       piece_table_loaded loaded,
+                       void* user_data);
+
+/// @brief Waits for loader of piece table to finish and frees it. Called
+/// from the loaded callback, the loader is done & detached instead.
+/// @param table Pointer to piece table.
+/// @param cancel Whether to stop loading instead of letting it finish.
+/// @return Returns false if loading failed or was cancelled.
+bool file_loader_join(piece_table* table, const bool cancel);
+
+/// Save API
+
+// Snapshot being saved by a background thread
+typedef struct save_job
+{
+  piece_index* index;
+  char* path;
+  piece_table_saved saved;
+  void* user_data;
+  // allocator of the table, which may be freed before the job
+  piece_table_allocator allocator;
+} save_job;
+
+/// @brief Gives time of a monotonic clock.
+/// @return Returns seconds since an arbitrary point.
+double monotonic_seconds();
+
+/// @brief Writes text of piece index to file, straight from its buffers.
+/// @param index Pointer to piece index.
+/// @param file File opened for writing.
+/// @return Returns false if writing fails.
+bool piece_index_write(const piece_index* index, FILE* file);
+
+/// @brief Saves text of piece index to a uniquely named temporary file
+/// next to path, flushed to disk, then renames it over path. Tables mapping
+/// the old file keep reading it, as it is replaced instead of being
+/// overwritten. A symlink at path is followed on POSIX systems, so the file
+/// it points to is replaced instead.
+/// @param index Pointer to piece index.
+/// @param path Path of file.
+/// @return Returns false if file can't be written.
+bool piece_index_save(const piece_index* index, const char* path);
+
+/// @brief Reads file mode creation mask of the process.
+/// @return Returns the mask, 0 on Windows.
+unsigned int process_umask();
+
+/// @brief Saves text of piece index over the file at path, as
+/// piece_index_save() does once symlinks are resolved. A replaced file keeps
+/// its mode, and its owner & group where the caller may set them, a new one
+/// gets the mode open() would give it.
+/// @param index Pointer to piece index.
+/// @param path Path of file, not a symlink.
+/// @return Returns false if file can't be written.
+bool piece_index_replace_file(const piece_index* index, const char* path);
+
+/// @brief Thread entry saving snapshot of a save job & freeing the job.
+/// @param argument Pointer to save job.
+/// @return Returns 0.
+#ifdef _WIN32
+DWORD WINAPI save_job_run(LPVOID argument);
+#else
+void* save_job_run(void* argument);
+#endif
+
+/// Tracing API
+
+/// @brief Gives time of a monotonic clock.
+/// @return Returns nanoseconds since an arbitrary point.
+unsigned long long monotonic_nanoseconds();
+
+/// @brief Copies tracer of piece table into traced call under its lock,
+/// so the call ends with the tracer it began with.
+/// @param table Pointer to piece table, can be NULL.
+/// @param trace Traced call.
+/// @return Returns whether the call is traced.
+bool trace_take_tracer(const piece_table* table, trace_call* trace);
+
+/// @brief Fills event of a traced call & reports its beginning.
+/// @param table Pointer to piece table.
+/// @param trace Traced call holding the tracer.
+/// @param call Public function called.
+/// @param position Position or line the function was given, or 0.
+/// @param length Length the function was given, or 0.
+void trace_report_begin(const piece_table* table,
+                        trace_call* trace,
+                        const piece_table_call call,
+                        const unsigned int position,
+                        const unsigned int length);
+
+/// @brief Reports beginning of a public call to tracer of piece table.
+/// @param table Pointer to piece table, can be NULL.
+/// @param trace Traced call, filled for trace_end().
+/// @param call Public function called.
+/// @param position Position or line the function was given, or 0.
+/// @param length Length the function was given, or 0.
+void trace_begin(const piece_table* table,
+                 trace_call* trace,
+                 const piece_table_call call,
+                 const unsigned int position,
+                 const unsigned int length);
+
+/// @brief Reports beginning of a public call given a string, its length
+/// is counted only when the call is traced.
+/// @param table Pointer to piece table, can be NULL.
+/// @param trace Traced call, filled for trace_end().
+/// @param call Public function called.
+/// @param position Position the function was given, or 0.
+/// @param string String the function was given, can be NULL.
+void trace_begin_string(const piece_table* table,
+                        trace_call* trace,
+                        const piece_table_call call,
+                        const unsigned int position,
+                        const char* string);
+
+/// @brief Reports end of a public call to tracer it began with.
+/// @param table Pointer to piece table, can be NULL.
+/// @param trace Traced call filled by trace_begin().
+/// @param success Whether the call succeeded.
+void trace_end(const piece_table* table,
+               trace_call* trace,
+               const bool success);
+
+/// Dump API
+
+// Formats a dump in a fixed buffer, flushed to the sink when full
+typedef struct dump_writer
+{
+  piece_table_sink sink;
+  void* user_data;
+  char buffer[DUMP_BUFFER_SIZE];
+  size_t length;
+} dump_writer;
+
+/// @brief Formats text into buffer of dump writer, flushing it if needed.
+/// @param writer Pointer to dump writer.
+/// @param format printf format, formatting less than DUMP_BUFFER_SIZE bytes.
+void dump_printf(dump_writer* writer, const char* format, ...);
+
+/// @brief Hands text in buffer of dump writer to its sink.
+/// @param writer Pointer to dump writer.
+void dump_flush(dump_writer* writer);
+
+/// @brief Gives name of source buffer a piece points into.
+/// @param buffer Index of source buffer.
+/// @return Returns "original", "add" or "source".
+const char* buffer_name(const unsigned int buffer);
+
+/// Split & Concat Helpers
+
+/// @brief Creates an empty piece table sharing buffers of piece index.
+/// @param index Piece index, whose allocator the table uses.
+/// @return Returns NULL if unable to allocate memory.
+piece_table* piece_table_from_piece_index(const piece_index* index);
+
+/// @brief Appends pieces covering a range of text of piece index to table.
+/// Pieces point into buffers shared with the index, without copying text.
+/// @param table Pointer to piece table.
+/// @param tail Pointer to last piece of table, updated as pieces are added.
+/// @param index Piece index.
+/// @param position Starting position of range.
+/// @param length Length of range, must be within text of index.
+/// @return Returns false if unable to allocate memory.
+bool append_piece_index_range(piece_table* table,
+                              piece** tail,
+                              const piece_index* index,
+                              const unsigned int position,
+                              const unsigned int length);
+
+/// @brief Gives an empty piece to a piece table without pieces.
+/// @param table Pointer to piece table.
+/// @return Returns false if unable to allocate memory.
+bool ensure_piece(piece_table* table);
 
 /// Operation API
-operation* operation_new(const operation_type type,
+operation* operation_new(piece_table* table,
+                         const operation_type type,
                          piece* prev_piece,
                          piece* start_piece,
                          piece* end_piece,
                          piece* next_piece);
-bool operation_free(operation* op);
+bool operation_free(piece_table* table, operation* op);
 
 /// MemSafe Operation API
 
 /// @brief Creates a new memsafe operation.
+/// @param table Pointer to piece table owning the operation.
 /// @param type Type of operation done.
 /// @param start_position Start position of the operation.
 /// @param length Length of string or replaced portion in operation.
 /// @param string String inserted or replaced string in operation
-/// @return Returns new memsafe operation with given parameters.
-memsafe_operation* memsafe_operation_new(const operation_type type,
+/// @return Returns new memsafe operation with given parameters, without a
+/// source buffer.
+memsafe_operation* memsafe_operation_new(piece_table* table,
+                                         const operation_type type,
                                          const unsigned int start_position,
                                          const unsigned int length,
                                          const char* string);
 
 /// @brief Frees memory of memsafe operation.
+/// @param table Pointer to piece table owning the operation.
 /// @param op Memsafe operation to free.
 /// @return Returns false if operation passed is NULL.
-bool memsafe_operation_free(memsafe_operation* op);
+bool memsafe_operation_free(piece_table* table, memsafe_operation* op);
 
 /// MemSafe Operations Helpers
 
@@ -113,9 +1075,11 @@ bool push_memsafe_operation_on_stack(memsafe_operation** stack_top,
                                      memsafe_operation* op);
 
 /// @brief Pops memsafe operation from memsafe operation stack.
+/// @param table Pointer to piece table owning the stack.
 /// @param stack_top MemSafe operation stack top.
 /// @return Returns false if stack is empty.
-bool pop_memsafe_operation_from_stack(memsafe_operation** stack_top);
+bool pop_memsafe_operation_from_stack(piece_table* table,
+                                      memsafe_operation** stack_top);
 
 /// @brief Moves top memsafe operation from undo to redo stack of piece table.
 /// @param table Pointer to piece table.
@@ -127,986 +1091,4539 @@ bool move_memsafe_operation_from_undo_to_redo_stack(piece_table* table);
 /// @return Returns false if something goes wrong.
 bool move_memsafe_operation_from_redo_to_undo_stack(piece_table* table);
 
+/// @brief Pushes memsafe operation on undo stack of piece table.
+/// @param table Pointer to piece table.
+/// @param op MemSafe operation.
+/// @return Returns false if something goes wrong.
+bool record_memsafe_operation(piece_table* table, memsafe_operation* op);
+
+/// @brief Gives memory used by memsafe operation, including its string.
+/// @param op MemSafe operation.
+/// @return Returns size of operation in bytes.
+unsigned int memsafe_operation_size(const memsafe_operation* op);
+
 /// @brief Frees memsafe operation stack recursively.
+/// @param table Pointer to piece table owning the stack.
 /// @param op MemSafe operation stack top.
+/// @param undone Whether the stack is the redo stack, for memory accounting.
 /// @return Returns false if something goes wrong.
-bool recursively_free_memsafe_operation_stack(memsafe_operation* op);
+bool recursively_free_memsafe_operation_stack(piece_table* table,
+                                              memsafe_operation* op,
+                                              const bool undone);
 
 /// Helpers
-bool recursively_free_pieces(piece* p);
+bool recursively_free_pieces(piece_table* table, piece* p);
 bool insert_piece_after(piece* p, piece* after);
-bool split_piece_at(piece* p, const unsigned int offset);
-bool remove_slice_between_pieces(piece* starting_piece, piece* ending_piece);
+bool split_piece_at(piece_table* table, piece* p, const unsigned int offset);
+
+/// @brief Links piece into piece table at offset of piece found for a
+/// position, splitting that piece when offset falls inside it.
+/// @param table Pointer to piece table.
+/// @param p Piece found for the position.
+/// @param offset Offset of position in p.
+/// @param new_p Piece to link, left to caller on failure.
+/// @return Returns false if unable to allocate memory.
+bool insert_piece_at(piece_table* table,
+                     piece* p,
+                     const unsigned int offset,
+                     piece* new_p);
+
+/// @brief Removes slice of piece table, as memsafe remove does.
+/// @param table Pointer to piece table.
+/// @param position Start position of slice.
+/// @param length Length of slice.
+/// @param record Whether to record REMOVE operation onto memsafe undo stack,
+/// undoing an insert doesn't.
+/// @return Returns false if slice is out of bounds or unable to allocate
+/// memory.
+bool memsafe_remove_slice(piece_table* table,
+                          const unsigned int position,
+                          const unsigned int length,
+                          const bool record);
+
+/// @brief Inserts text of memsafe INSERT operation again, from its string or
+/// from its source buffer.
+/// @param table Pointer to piece table.
+/// @param op MemSafe INSERT operation.
+/// @return Returns false if position is out of bounds or unable to allocate
+/// memory.
+bool memsafe_redo_insert(piece_table* table, const memsafe_operation* op);
+
+bool remove_slice_between_pieces(piece_table* table,
+                                 piece* starting_piece,
+                                 piece* ending_piece);
 bool remove_piece_from_table(piece_table* table, piece* p);
 const char* operation_to_string(const operation_type type);
 bool push_operation_on_stack(operation** stack_top, operation* op);
+bool record_operation(piece_table* table, operation* op);
 bool pop_operation_from_stack(operation** stack_top);
 bool move_operation_from_undo_to_redo_stack(piece_table* table);
 bool move_operation_from_redo_to_undo_stack(piece_table* table);
-bool recursively_free_operation_stack(operation* op);
+bool recursively_free_operation_stack(piece_table* table, operation* op);
+/// @brief Frees depreciated operation stack along with pieces it owns.
+/// @param table Pointer to piece table owning the stack.
+/// @param op Operation stack top.
+/// @param undone Whether the stack is the redo stack, whose operations
+/// own different pieces than applied ones.
+/// @return Returns false if something goes wrong.
+bool free_operation_stack(piece_table* table,
+                          operation* op,
+                          const bool undone);
+bool append_to_add_buffer(piece_table* table,
+                          const char* string,
+                          const unsigned int length);
+/// @brief Counts add buffer bytes of text from offset of starting piece
+/// up to offset of ending piece.
+/// @param starting_piece Piece the range starts in.
+/// @param starting_offset Offset of range start in starting piece.
+/// @param ending_piece Piece the range ends in.
+/// @param ending_offset Offset of range end in ending piece.
+/// @return Returns count of add buffer bytes in range.
+unsigned int add_buffer_bytes_between(const piece* starting_piece,
+                                      const unsigned int starting_offset,
+                                      const piece* ending_piece,
+                                      const unsigned int ending_offset);
+
+/// Add Buffer Compaction Helpers
+
+/// @brief Appends piece to dynamic array of pieces if it belongs to add buffer.
+/// @param table Pointer to piece table owning the array.
+/// @param pieces Pointer to dynamic array of pieces.
+/// @param count Pointer to count of pieces in array.
+/// @param capacity Pointer to capacity of array.
+/// @param p Piece to append.
+/// @return Returns false if unable to allocate memory.
+bool collect_add_piece(const piece_table* table,
+                       piece*** pieces,
+                       unsigned int* count,
+                       unsigned int* capacity,
+                       piece* p);
+
+/// @brief Collects add buffer pieces referenced by operations of stack.
+/// @param table Pointer to piece table owning the array.
+/// @param op Depreciated operation stack top.
+/// @param pieces Pointer to dynamic array of pieces.
+/// @param count Pointer to count of pieces in array.
+/// @param capacity Pointer to capacity of array.
+/// @return Returns false if unable to allocate memory.
+bool collect_add_pieces_from_operations(const piece_table* table,
+                                        operation* op,
+                                        piece*** pieces,
+                                        unsigned int* count,
+                                        unsigned int* capacity);
+
+/// @brief Collects every piece still referencing add buffer, live pieces
+/// and pieces retained by depreciated undo & redo operations, each once.
+/// @param table Pointer to piece table.
+/// @param pieces Pointer to array of pieces, to be freed by caller.
+/// @param count Pointer to count of pieces in array.
+/// @return Returns false if unable to allocate memory.
+bool collect_add_pieces(const piece_table* table,
+                        piece*** pieces,
+                        unsigned int* count);
+
+/// @brief Sorts ranges of add buffer & merges overlapping ones in place,
+/// setting where each merged range starts once live ranges are packed.
+/// @param ranges Array of ranges.
+/// @param count Count of ranges in array.
+/// @param ranges_count Pointer to count of merged ranges.
+/// @return Returns length of add buffer text covered by ranges.
+unsigned int merge_add_buffer_ranges(add_buffer_range* ranges,
+                                     const unsigned int count,
+                                     unsigned int* ranges_count);
+int compare_piece_pointers(const void* a, const void* b);
+int compare_add_buffer_ranges(const void* a, const void* b);
+
+/// Allocator API Implementation
+void* default_alloc(size_t size, void* user_data)
+{
+  (void)user_data;
+  return malloc(size);
+}
 
-/// Piece API Implementation
-piece* piece_new(const buffer_type buffer,
-                 const unsigned int start_position,
-                 const unsigned int length)
+void* default_realloc(void* pointer, size_t size, void* user_data)
 {
-  piece* p = (piece*)calloc(1, sizeof(piece));
-  if(!p)
+  (void)user_data;
+  return realloc(pointer, size);
+}
+
+void default_free(void* pointer, void* user_data)
+{
+  (void)user_data;
+  free(pointer);
+}
+
+void* table_alloc(const piece_table* table, const size_t size)
+{
+  void* pointer = table->allocator.alloc(size, table->allocator.user_data);
+  if(!pointer)
   {
     return NULL;
   }
 
-  p->buffer = buffer;
-  p->start_position = start_position;
-  p->length = length;
-  p->next = NULL;
+  memset(pointer, 0, size);
+  return pointer;
+}
 
-  return p;
+void* table_realloc(const piece_table* table,
+                    void* pointer,
+                    const size_t size)
+{
+  return table->allocator.realloc(pointer, size, table->allocator.user_data);
 }
 
-bool piece_free(piece* p)
+void table_free(const piece_table* table, void* pointer)
 {
-  if(!p)
+  if(!pointer)
   {
-    return false;
+    return;
   }
 
-  free(p);
-  return true;
+  table->allocator.free(pointer, table->allocator.user_data);
 }
 
-/// Operation API Implementation
-operation* operation_new(const operation_type type,
-                         piece* prev_piece,
-                         piece* start_piece,
-                         piece* end_piece,
-                         piece* next_piece)
+char* table_strdup(const piece_table* table, const char* string)
 {
-  operation* op = (operation*)calloc(1, sizeof(operation));
-  if(!op)
+  size_t length = strlen(string);
+  char* duplicate = (char*)table->allocator.alloc(length + 1,
+                                                  table->allocator.user_data);
+  if(!duplicate)
   {
     return NULL;
   }
 
-  op->type = type;
-  op->prev_piece = prev_piece;
-  op->start_piece = start_piece;
-  op->end_piece = end_piece;
-  op->next_piece = next_piece;
-  op->next = NULL;
+  memcpy(duplicate, string, length + 1);
+  return duplicate;
+}
 
-  return op;
+/// Buffer Memory API Implementation
+char* map_pages(const size_t size)
+{
+#ifdef PIECE_TABLE_HAS_MMAP
+  void* pages = MAP_FAILED;
+#  ifdef MAP_HUGETLB
+  // explicit huge pages only succeed if the system reserved some
+  pages = mmap(NULL,
+               size,
+               PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+               -1,
+               0);
+#  endif
+  if(pages == MAP_FAILED)
+  {
+    pages = mmap(
+      NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(pages == MAP_FAILED)
+    {
+      return NULL;
+    }
+#  ifdef MADV_HUGEPAGE
+    // falling back to transparent huge pages
+    madvise(pages, size, MADV_HUGEPAGE);
+#  endif
+  }
+
+  return (char*)pages;
+#else
+  (void)size;
+  return NULL;
+#endif
 }
 
-bool operation_free(operation* op)
+text_buffer* text_buffer_new(const piece_table_allocator* allocator)
 {
-  if(!op)
+  text_buffer* buffer =
+    (text_buffer*)allocator->alloc(sizeof(text_buffer), allocator->user_data);
+  if(!buffer)
   {
-    return false;
+    return NULL;
   }
 
-  // Memory leaks from virtually removed pieces
-  // some pieces are freed beforehand in recursively_free_pieces()
-  // so freeing pieces here may result in double-free
-  // as undo, redo operations are containing weak-pointers to actual pieces
-  // TODO: New branch for memsafe undo & redo operations
-  if(op->prev_piece)
+  buffer->data = NULL;
+  buffer->length = 0;
+  buffer->capacity = 0;
+  buffer->memory = BUFFER_MEMORY_ALLOCATOR;
+  buffer->references = 1;
+  buffer->allocator = *allocator;
+  buffer->lines = NULL;
+
+  return buffer;
+}
+
+text_buffer* text_buffer_from_string(const piece_table_allocator* allocator,
+                                     const char* string)
+{
+  text_buffer* buffer = text_buffer_new(allocator);
+  if(!buffer)
   {
-    piece_free(op->prev_piece);
+    return NULL;
   }
-  if(op->next_piece)
+
+  size_t length = strlen(string);
+  buffer->data = (char*)allocator->alloc(length + 1, allocator->user_data);
+  if(!buffer->data)
   {
-    piece_free(op->next_piece);
+    text_buffer_release(buffer);
+    return NULL;
   }
-  if(op->start_piece)
+  memcpy(buffer->data, string, length + 1);
+  buffer->length = (unsigned int)length;
+  buffer->capacity = (unsigned int)length + 1;
+
+  return buffer;
+}
+
+void text_buffer_retain(text_buffer* buffer)
+{
+  atomic_increment(&buffer->references);
+}
+
+void text_buffer_release(text_buffer* buffer)
+{
+  if(!buffer || atomic_decrement(&buffer->references) != 0)
   {
-    if(op->start_piece == op->end_piece)
+    return;
+  }
+
+  if(buffer->data)
+  {
+    if(buffer->memory == BUFFER_MEMORY_ALLOCATOR)
     {
-      piece_free(op->start_piece);
+      buffer->allocator.free(buffer->data, buffer->allocator.user_data);
     }
+#ifdef PIECE_TABLE_HAS_MMAP
     else
     {
-      op->end_piece->next = NULL;
-      if(!recursively_free_pieces(op->start_piece))
-      {
-        return false;
-      }
+      munmap(buffer->data, buffer->capacity);
     }
-    op->start_piece = NULL;
-    op->end_piece = NULL;
+#endif
   }
 
-  free(op);
-  return true;
+  line_index_free(buffer);
+
+  buffer->allocator.free(buffer, buffer->allocator.user_data);
 }
 
-/// MemSafe Operation API Implementation
-memsafe_operation* memsafe_operation_new(const operation_type type,
-                                         const unsigned int start_position,
-                                         const unsigned int length,
-                                         const char* string)
+bool text_buffer_is_shared(text_buffer* buffer)
 {
-  memsafe_operation* op =
-    (memsafe_operation*)calloc(1, sizeof(memsafe_operation));
-  if(!op)
+  return atomic_load_count(&buffer->references) > 1;
+}
+
+bool text_buffer_reserve(text_buffer* buffer,
+                         const unsigned int end,
+                         const unsigned int length)
+{
+  // end + length may not fit
+  if(end > buffer->capacity || length > buffer->capacity - end)
   {
-    return NULL;
+    return false;
   }
 
-  op->type = type;
-  op->start_position = start_position;
-  op->length = length;
-  if(!string)
+  return atomic_compare_exchange_count(&buffer->length, end, end + length);
+}
+
+bool advise_range(const char* buffer,
+                  const size_t size,
+                  const piece_table_access access)
+{
+#ifdef PIECE_TABLE_HAS_MMAP
+  if(!buffer || size == 0)
   {
-    op->string = NULL;
+    return true;
   }
-  else
+
+  // advice works on whole pages
+  size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  size_t start = (size_t)buffer & ~(page_size - 1);
+  size_t end = (size_t)buffer + size;
+
+  int advice = POSIX_MADV_NORMAL;
+  switch(access)
   {
-    op->string = strdup(string);
-    if(!op->string)
+  case PIECE_TABLE_ACCESS_SEQUENTIAL:
+    advice = POSIX_MADV_SEQUENTIAL;
+    break;
+  case PIECE_TABLE_ACCESS_RANDOM:
+    advice = POSIX_MADV_RANDOM;
+    break;
+  case PIECE_TABLE_ACCESS_WILLNEED:
+    advice = POSIX_MADV_WILLNEED;
+    break;
+  default:
+    break;
+  }
+
+  return posix_madvise((void*)start, end - start, advice) == 0;
+#else
+  (void)buffer;
+  (void)size;
+  (void)access;
+  return false;
+#endif
+}
+
+/// Source Buffers API Implementation
+bool table_add_source(piece_table* table,
+                      text_buffer* buffer,
+                      unsigned int* source)
+{
+  if(table->sources_count == table->sources_capacity)
+  {
+    unsigned int capacity =
+      table->sources_capacity ? table->sources_capacity * 2 : 4;
+    text_buffer** sources = (text_buffer**)table_realloc(
+      table, table->sources, sizeof(text_buffer*) * capacity);
+    if(!sources)
     {
-      free(op);
-      return NULL;
+      return false;
     }
+    table->sources = sources;
+    table->sources_capacity = capacity;
   }
-  op->next = NULL;
 
-  return op;
+  *source = table->sources_count;
+  table->sources[table->sources_count++] = buffer;
+
+  return true;
 }
 
-bool memsafe_operation_free(memsafe_operation* op)
+bool table_find_source(piece_table* table,
+                       text_buffer* buffer,
+                       unsigned int* source)
 {
-  if(!op)
+  for(unsigned int i = 0; i < table->sources_count; i++)
   {
-    return false;
+    if(table->sources[i] == buffer)
+    {
+      *source = i;
+      return true;
+    }
   }
 
-  if(op->string)
+  // shared buffer is only read, so it may be any other table's add buffer
+  if(!table_add_source(table, buffer, source))
   {
-    free(op->string);
+    return false;
   }
+  text_buffer_retain(buffer);
 
-  free(op);
   return true;
 }
 
-/// MemSafe Operations Helpers API Implementation
-bool push_memsafe_operation_on_stack(memsafe_operation** stack_top,
-                                     memsafe_operation* op)
+bool table_share_sources(piece_table* table, const piece_index* index)
 {
-  if(!stack_top)
+  text_buffer** sources = (text_buffer**)table_alloc(
+    table, sizeof(text_buffer*) * index->sources_count);
+  if(!sources)
   {
     return false;
   }
-
-  if(!*stack_top)
+  for(unsigned int i = 0; i < index->sources_count; i++)
   {
-    *stack_top = op;
-    op->next = NULL;
-    return true;
+    sources[i] = index->sources[i];
+    text_buffer_retain(sources[i]);
   }
 
-  op->next = *stack_top;
-  *stack_top = op;
+  table_release_sources(table);
+  table->sources = sources;
+  table->sources_count = index->sources_count;
+  table->sources_capacity = index->sources_count;
 
   return true;
 }
 
-bool pop_memsafe_operation_from_stack(memsafe_operation** stack_top)
+void table_release_sources(piece_table* table)
 {
-  if(!stack_top)
+  for(unsigned int i = 0; i < table->sources_count; i++)
   {
-    return false;
+    text_buffer_release(table->sources[i]);
   }
+  table_free(table, table->sources);
+  table->sources = NULL;
+  table->sources_count = 0;
+  table->sources_capacity = 0;
+}
 
-  if(!*stack_top)
+text_buffer* text_buffer_from_file(const piece_table_allocator* allocator,
+                                   const char* path)
+{
+  text_buffer* buffer = text_buffer_new(allocator);
+  if(!buffer)
   {
-    return false;
+    return NULL;
   }
 
-  if((*stack_top)->next == NULL)
+#ifdef PIECE_TABLE_HAS_MMAP
+  int file = open(path, O_RDONLY);
+  if(file < 0)
   {
-    memsafe_operation_free(*stack_top);
-    *stack_top = NULL;
+    text_buffer_release(buffer);
+    return NULL;
   }
 
-  memsafe_operation* temp = (*stack_top)->next;
-  memsafe_operation_free(*stack_top);
-  *stack_top = temp;
-
-  return true;
-}
-
-bool move_memsafe_operation_from_undo_to_redo_stack(piece_table* table)
-{
-  if(!table)
+  struct stat file_stat;
+  if(fstat(file, &file_stat) != 0)
   {
-    return false;
+    close(file);
+    text_buffer_release(buffer);
+    return NULL;
   }
-
-  if(!table->memsafe_undo_stack_top)
+  if(file_stat.st_size > (off_t)PIECE_TABLE_MAX_LENGTH)
   {
-    return false;
+    close(file);
+    text_buffer_release(buffer);
+    errno = EFBIG;
+    return NULL;
   }
 
-  memsafe_operation* op = table->memsafe_undo_stack_top;
-  table->memsafe_undo_stack_top = op->next;
-
-  if(!table->memsafe_redo_stack_top)
+  if(file_stat.st_size > 0)
   {
-    table->memsafe_redo_stack_top = op;
-    op->next = NULL;
-    return true;
+    // source buffers are never written, so the file is mapped read-only
+    // and pages are loaded lazily by the kernel
+    void* mapping =
+      mmap(NULL, (size_t)file_stat.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    close(file);
+    if(mapping == MAP_FAILED)
+    {
+      text_buffer_release(buffer);
+      return NULL;
+    }
+    buffer->data = (char*)mapping;
+    buffer->length = (unsigned int)file_stat.st_size;
+    buffer->capacity = (unsigned int)file_stat.st_size;
+    buffer->memory = BUFFER_MEMORY_MAPPED_FILE;
   }
-
-  op->next = table->memsafe_redo_stack_top;
-  table->memsafe_redo_stack_top = op;
-
-  return true;
-}
-
-bool move_memsafe_operation_from_redo_to_undo_stack(piece_table* table)
-{
-  if(!table)
+  else
   {
-    return false;
+    close(file);
   }
-
-  if(!table->memsafe_redo_stack_top)
+#else
+  FILE* file = fopen(path, "rb");
+  if(!file)
   {
-    return false;
+    text_buffer_release(buffer);
+    return NULL;
   }
 
-  memsafe_operation* op = table->memsafe_redo_stack_top;
-  table->memsafe_redo_stack_top = op->next;
-
-  if(!table->memsafe_undo_stack_top)
+  fseek(file, 0, SEEK_END);
+  long file_length = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  if(file_length < 0)
   {
-    table->memsafe_undo_stack_top = op;
-    op->next = NULL;
-    return true;
+    fclose(file);
+    text_buffer_release(buffer);
+    return NULL;
+  }
+  if((unsigned long)file_length > PIECE_TABLE_MAX_LENGTH)
+  {
+    fclose(file);
+    text_buffer_release(buffer);
+    errno = EFBIG;
+    return NULL;
   }
 
-  op->next = table->memsafe_undo_stack_top;
-  table->memsafe_undo_stack_top = op;
-
-  return true;
-}
-
-bool recursively_free_memsafe_operation_stack(memsafe_operation* op)
-{
-  if(!op)
+  buffer->data = (char*)allocator->alloc(sizeof(char) * (file_length + 1),
+                                        allocator->user_data);
+  if(!buffer->data ||
+     fread(buffer->data, 1, file_length, file) != (size_t)file_length)
   {
-    return false;
+    fclose(file);
+    text_buffer_release(buffer);
+    return NULL;
   }
+  fclose(file);
+  buffer->length = (unsigned int)file_length;
+  buffer->capacity = (unsigned int)file_length + 1;
+#endif
 
-  if(op->next)
+  if(!buffer->data)
   {
-    if(!recursively_free_memsafe_operation_stack(op->next))
+    buffer->data = (char*)allocator->alloc(1, allocator->user_data);
+    if(!buffer->data)
     {
-      return false;
+      text_buffer_release(buffer);
+      return NULL;
     }
+    buffer->data[0] = '\0';
+    buffer->capacity = 1;
   }
 
-  memsafe_operation_free(op);
+  return buffer;
+}
 
-  return true;
+bool table_set_original(piece_table* table, text_buffer* buffer)
+{
+  text_buffer_release(table->sources[ORIGINAL]);
+  table->sources[ORIGINAL] = buffer;
+  table->text_length_known = false;
+
+  table->pieces_head = piece_new(table, ORIGINAL, 0, buffer->length);
+  return table->pieces_head != NULL;
 }
 
-/// Helpers Implementation
-bool recursively_free_pieces(piece* p)
+bool table_insert_source(piece_table* table,
+                         const unsigned int position,
+                         text_buffer* buffer)
 {
-  if(!p)
+  if(!invalidate_piece_index(table))
   {
     return false;
   }
 
-  if(p->next)
+  unsigned int remaining_offset = position;
+  unsigned int pieces_visited = 1;
+  piece* p = table->pieces_head;
+  while(p)
   {
-    if(!recursively_free_pieces(p->next))
+    if(remaining_offset <= p->length)
     {
-      return false;
+      break;
     }
+    remaining_offset -= p->length;
+    p = p->next;
+    pieces_visited++;
   }
-
-  free(p);
-
-  return true;
-}
-
-bool insert_piece_after(piece* p, piece* after)
-{
-  if(!after)
-  {
-    return false;
-  }
+  count_stat(table, lookups, 1);
+  count_stat(table, pieces_visited, pieces_visited);
 
   if(!p)
   {
+    // position out of bounds
     return false;
   }
 
-  p->next = after->next;
-  after->next = p;
-
-  return true;
-}
-
-bool split_piece_at(piece* p, const unsigned int offset)
-{
-  if(!p)
+  if(buffer->length == 0)
   {
-    return false;
+    return true;
   }
 
-  if(offset == 0)
+  unsigned int length = position - remaining_offset;
+  for(piece* rest = p; rest; rest = rest->next)
   {
-    return false;
+    length += rest->length;
   }
-
-  if(!insert_piece_after(piece_new(p->buffer, offset, p->length - offset), p))
+  if(length > PIECE_TABLE_MAX_LENGTH ||
+     buffer->length > PIECE_TABLE_MAX_LENGTH - length)
   {
+    errno = EFBIG;
     return false;
   }
-  p->length = offset;
-
-  return true;
-}
 
-bool remove_slice_between_pieces(piece* starting_piece, piece* ending_piece)
-{
-  if(!starting_piece)
+  // the same source inserted twice is kept once
+  unsigned int source = 0;
+  if(!table_find_source(table, buffer, &source))
   {
     return false;
   }
 
-  if(!ending_piece)
+  piece* new_p = piece_new(table, source, 0, buffer->length);
+  if(!new_p)
   {
     return false;
   }
 
-  piece* p = starting_piece;
-  while(p->next != ending_piece)
+  // redo inserts the same slice of the source again
+  memsafe_operation* msop =
+    memsafe_operation_new(table, INSERT, position, buffer->length, NULL);
+  if(!msop)
   {
-    p = p->next;
+    piece_free(table, new_p);
+    return false;
   }
-  p->next = NULL;
-  p = starting_piece->next;
-  starting_piece->next = ending_piece;
+  text_buffer_retain(buffer);
+  msop->source = buffer;
+  msop->source_start = 0;
 
-  if(!recursively_free_pieces(p))
+  if(!insert_piece_at(table, p, remaining_offset, new_p))
   {
+    piece_free(table, new_p);
+    memsafe_operation_free(table, msop);
     return false;
   }
 
-  return true;
+  return record_memsafe_operation(table, msop);
 }
 
-bool remove_piece_from_table(piece_table* table, piece* p)
+/// Locking API Implementation
+void table_read_lock(const piece_table* table)
 {
-  if(!table)
+  if(!table || !table->lock)
   {
-    return false;
+    return;
   }
 
-  if(!p)
-  {
-    return false;
-  }
+#ifdef _WIN32
+  AcquireSRWLockShared(&table->lock->rwlock);
+#else
+  pthread_rwlock_rdlock(&table->lock->rwlock);
+#endif
+}
 
-  piece* temp = table->pieces_head;
-  if(temp == p)
+void table_read_unlock(const piece_table* table)
+{
+  if(!table || !table->lock)
   {
-    // deleting the head
-    table->pieces_head = temp->next;
-    piece_free(temp);
-    return true;
+    return;
   }
 
-  while(temp->next != p)
+#ifdef _WIN32
+  ReleaseSRWLockShared(&table->lock->rwlock);
+#else
+  pthread_rwlock_unlock(&table->lock->rwlock);
+#endif
+}
+
+void table_write_lock(const piece_table* table)
+{
+  if(!table || !table->lock)
   {
-    temp = temp->next;
+    return;
   }
-  temp->next = p->next;
-  piece_free(p);
 
-  return true;
+#ifdef _WIN32
+  AcquireSRWLockExclusive(&table->lock->rwlock);
+#else
+  pthread_rwlock_wrlock(&table->lock->rwlock);
+#endif
 }
 
-const char* operation_to_string(const operation_type type)
+void table_write_unlock(const piece_table* table)
 {
-  switch(type)
+  if(!table || !table->lock)
   {
-  case INSERT:
-    return "INSERT";
-  case REMOVE:
-    return "REMOVE";
-  case REPLACE:
-    return "REPLACE";
-  default:
-    break;
+    return;
   }
 
-  return NULL;
+#ifdef _WIN32
+  ReleaseSRWLockExclusive(&table->lock->rwlock);
+#else
+  pthread_rwlock_unlock(&table->lock->rwlock);
+#endif
 }
 
-bool push_operation_on_stack(operation** stack_top, operation* op)
+bool table_lock_new(piece_table* table)
 {
-
-  if(!op)
+  table_lock* lock = (table_lock*)table_alloc(table, sizeof(table_lock));
+  if(!lock)
   {
     return false;
   }
 
-  if(!*stack_top)
+#ifdef _WIN32
+  InitializeSRWLock(&lock->rwlock);
+  InitializeSRWLock(&lock->index_lock);
+#else
+  pthread_rwlockattr_t attributes;
+  pthread_rwlockattr_init(&attributes);
+#  ifdef __GLIBC__
+  // a steady stream of readers must not starve the writer
+  pthread_rwlockattr_setkind_np(&attributes,
+                                PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#  endif
+  int error = pthread_rwlock_init(&lock->rwlock, &attributes);
+  pthread_rwlockattr_destroy(&attributes);
+  if(error != 0)
+  {
+    table_free(table, lock);
+    return false;
+  }
+  if(pthread_mutex_init(&lock->index_lock, NULL) != 0)
   {
-    *stack_top = op;
-    return true;
+    pthread_rwlock_destroy(&lock->rwlock);
+    table_free(table, lock);
+    return false;
   }
+#endif
 
-  op->next = *stack_top;
-  *stack_top = op;
-
+  table->lock = lock;
   return true;
 }
 
-bool pop_operation_from_stack(operation** stack_top)
+void table_lock_free(piece_table* table)
 {
-  if(!*stack_top)
+  if(!table->lock)
   {
-    return false;
+    return;
   }
 
-  operation* temp = *stack_top;
+#ifndef _WIN32
+  pthread_rwlock_destroy(&table->lock->rwlock);
+  pthread_mutex_destroy(&table->lock->index_lock);
+#endif
+  table_free(table, table->lock);
+  table->lock = NULL;
+}
 
-  if(temp->next)
-  {
-    *stack_top = temp->next;
-  }
-  else
+void table_cache_lock(const piece_table* table)
+{
+  if(!table->lock)
   {
-    *stack_top = NULL;
+    return;
   }
 
-  // in operation is freed, operation on redo stack will
-  // point to NULL, resulting in segmentation fault
-  // operation_free(temp);
-
-  return true;
+#ifdef _WIN32
+  AcquireSRWLockExclusive(&table->lock->index_lock);
+#else
+  pthread_mutex_lock(&table->lock->index_lock);
+#endif
 }
 
-bool move_operation_from_undo_to_redo_stack(piece_table* table)
+void table_cache_unlock(const piece_table* table)
 {
-  if(!table)
+  if(!table->lock)
   {
-    return false;
+    return;
   }
 
-  if(!table->undo_stack_top)
+#ifdef _WIN32
+  ReleaseSRWLockExclusive(&table->lock->index_lock);
+#else
+  pthread_mutex_unlock(&table->lock->index_lock);
+#endif
+}
+
+/// Piece API Implementation
+piece* piece_new(piece_table* table,
+                 const unsigned int buffer,
+                 const unsigned int start_position,
+                 const unsigned int length)
+{
+  piece* p = (piece*)table_alloc(table, sizeof(piece));
+  if(!p)
   {
-    return false;
+    return NULL;
   }
 
-  operation* op = table->undo_stack_top;
-  table->undo_stack_top = op->next;
+  p->buffer = buffer;
+  p->start_position = start_position;
+  p->length = length;
+  p->next = NULL;
 
-  if(!table->redo_stack_top)
+  table->pieces_count++;
+  count_stat(table, pieces_allocated, 1);
+
+  return p;
+}
+
+bool piece_free(piece_table* table, piece* p)
+{
+  if(!p)
   {
-    table->redo_stack_top = op;
-    op->next = NULL;
-    return true;
+    return false;
   }
 
-  op->next = table->redo_stack_top;
-  table->redo_stack_top = op;
+  table->pieces_count--;
+  count_stat(table, pieces_freed, 1);
 
+  table_free(table, p);
   return true;
 }
 
-bool move_operation_from_redo_to_undo_stack(piece_table* table)
+/// Piece Index API Implementation
+piece_index* piece_index_new(piece_table* table)
 {
-  if(!table)
+  if(table->cow_index)
   {
-    return false;
+    // pieces of a clone are still the shared index
+    atomic_increment(&table->cow_index->references);
+    return table->cow_index;
   }
 
-  if(!table->redo_stack_top)
+  unsigned int count = 0;
+  piece* p = table->pieces_head;
+  while(p)
   {
-    return false;
+    count++;
+    p = p->next;
   }
 
-  operation* op = table->redo_stack_top;
-  table->redo_stack_top = op->next;
-
-  if(!table->undo_stack_top)
+  piece_index* index = (piece_index*)table_alloc(table, sizeof(piece_index));
+  if(!index)
   {
-    table->undo_stack_top = op;
-    op->next = NULL;
-    return true;
+    return NULL;
   }
 
-  op->next = table->undo_stack_top;
-  table->undo_stack_top = op;
-
-  return true;
-}
+  index->references = 1;
+  index->allocator = table->allocator;
+  index->add_buffer_length = table->add_buffer_length;
 
-bool recursively_free_operation_stack(operation* op)
-{
-  if(!op)
+  index->pieces =
+    (packed_piece*)table_alloc(table, sizeof(packed_piece) * (count + 1));
+  index->ends =
+    (unsigned int*)table_alloc(table, sizeof(unsigned int) * (count + 1));
+  index->sources =
+    (text_buffer**)table_alloc(table, sizeof(text_buffer*) * table->sources_count);
+  if(!index->pieces || !index->ends || !index->sources)
   {
-    return false;
+    piece_index_release(index);
+    return NULL;
+  }
+  for(unsigned int i = 0; i < table->sources_count; i++)
+  {
+    index->sources[i] = table->sources[i];
+    text_buffer_retain(index->sources[i]);
   }
+  index->sources_count = table->sources_count;
 
-  if(op->next)
+  unsigned int length = 0;
+  p = table->pieces_head;
+  while(p)
   {
-    if(!recursively_free_operation_stack(op->next))
+    if(p->length == 0)
     {
-      return false;
+      // empty pieces can never contain a position
+      p = p->next;
+      continue;
     }
-  }
 
-  operation_free(op);
+    packed_piece* packed = &index->pieces[index->count];
+    packed->buffer = p->buffer;
+    packed->start_position = p->start_position;
+    packed->length = p->length;
+    length += p->length;
+    index->ends[index->count] = length;
+    index->count++;
+    p = p->next;
+  }
+  index->length = length;
 
-  return true;
+  return index;
 }
 
-/// Piece Table API Implementation
+bool piece_index_release(piece_index* index)
+{
+  if(!index)
+  {
+    return false;
+  }
+
+  if(atomic_decrement(&index->references) != 0)
+  {
+    return true;
+  }
+
+  for(unsigned int i = 0; i < index->sources_count; i++)
+  {
+    text_buffer_release(index->sources[i]);
+  }
+  if(index->sources)
+  {
+    index->allocator.free(index->sources, index->allocator.user_data);
+  }
+  if(index->pieces)
+  {
+    index->allocator.free(index->pieces, index->allocator.user_data);
+  }
+  if(index->ends)
+  {
+    index->allocator.free(index->ends, index->allocator.user_data);
+  }
+  index->allocator.free(index, index->allocator.user_data);
+
+  return true;
+}
+
+unsigned int piece_index_find(const piece_index* index,
+                              const unsigned int position)
+{
+  unsigned int low = 0, high = index->count - 1;
+  while(low < high)
+  {
+    unsigned int middle = low + (high - low) / 2;
+    if(index->ends[middle] <= position)
+    {
+      low = middle + 1;
+    }
+    else
+    {
+      high = middle;
+    }
+  }
+
+  return low;
+}
+
+unsigned int piece_index_search_steps(const piece_index* index)
+{
+  unsigned int steps = 1;
+  for(unsigned int count = index->count; count > 1; count = (count + 1) / 2)
+  {
+    steps++;
+  }
+
+  return steps;
+}
+
+const piece_index* get_piece_index(const piece_table* table)
+{
+#ifdef PIECE_TABLE_NO_PIECE_INDEX
+  (void)table;
+  return NULL;
+#else
+  piece_index* index = atomic_load_pointer(&table->index);
+  if(index)
+  {
+    return index;
+  }
+
+  // index of an unchanged clone is shared, so it costs nothing
+  piece_table* mutable_table = (piece_table*)table;
+  if(!atomic_load_pointer(&table->cow_index) &&
+     atomic_increment(&mutable_table->lookups_since_mutation) <=
+       PIECE_INDEX_MIN_LOOKUPS)
+  {
+    return NULL;
+  }
+
+  return build_piece_index(table);
+#endif
+}
+
+piece_index* build_piece_index(const piece_table* table)
+{
+  piece_index* index = atomic_load_pointer(&table->index);
+  if(index)
+  {
+    return index;
+  }
+
+  // index is a cache, building it doesn't change the text,
+  // but concurrent readers must not build it twice
+  piece_table* mutable_table = (piece_table*)table;
+  table_cache_lock(table);
+  index = table->index;
+  if(!index)
+  {
+    index = piece_index_new(mutable_table);
+    atomic_store_pointer(&mutable_table->index, index);
+  }
+  table_cache_unlock(table);
+
+  return index;
+}
+
+bool invalidate_piece_index(piece_table* table)
+{
+  // clone takes its own pieces before changing them
+  if(!materialize_pieces(table))
+  {
+    return false;
+  }
+
+  table->lookups_since_mutation = 0;
+  table->text_length_known = false;
+  if(!table->index)
+  {
+    return true;
+  }
+
+  // snapshots & clones may still reference the index
+  piece_index_release(table->index);
+  table->index = NULL;
+
+  return true;
+}
+
+unsigned int table_text_length(piece_table* table)
+{
+  if(!table->text_length_known)
+  {
+    table->text_length = piece_table_get_length_unlocked(table);
+    table->text_length_known = true;
+  }
+
+  return table->text_length;
+}
+
+piece_index* retain_piece_index(const piece_table* table)
+{
+#ifdef PIECE_TABLE_NO_PIECE_INDEX
+  // cached index is disabled, caller gets an index of its own
+  return piece_index_new((piece_table*)table);
+#else
+  // retained index serves many reads, so it is cached right away
+  piece_index* index = build_piece_index(table);
+  if(!index)
+  {
+    return NULL;
+  }
+
+  atomic_increment(&index->references);
+  return index;
+#endif
+}
+
+bool materialize_pieces(piece_table* table)
+{
+  piece_index* index = table->cow_index;
+  if(!index)
+  {
+    return true;
+  }
+
+  piece* head = NULL;
+  piece* tail = NULL;
+  for(unsigned int i = 0; i < index->count; i++)
+  {
+    packed_piece packed = index->pieces[i];
+    piece* p = piece_new(
+      table, packed.buffer, packed.start_position, packed.length);
+    if(!p)
+    {
+      if(head)
+      {
+        recursively_free_pieces(table, head);
+      }
+      return false;
+    }
+
+    if(tail)
+    {
+      tail->next = p;
+    }
+    else
+    {
+      head = p;
+    }
+    tail = p;
+  }
+
+  table->pieces_head = head;
+  atomic_store_pointer(&table->cow_index, NULL);
+  piece_index_release(index);
+
+  return true;
+}
+
+piece* get_pieces(const piece_table* table)
+{
+  if(!atomic_load_pointer(&table->cow_index))
+  {
+    return table->pieces_head;
+  }
+
+  // copying shared pieces doesn't change the text,
+  // but concurrent readers must not copy them twice
+  table_cache_lock(table);
+  materialize_pieces((piece_table*)table);
+  table_cache_unlock(table);
+
+  return table->pieces_head;
+}
+
+const char* packed_piece_text(const piece_index* index, const packed_piece p)
+{
+  return index->sources[p.buffer]->data + p.start_position;
+}
+
+char piece_index_get_char_at(const piece_index* index,
+                             const unsigned int position)
+{
+  if(position >= index->length)
+  {
+    // position out of bounds
+    return '\0';
+  }
+
+  unsigned int i = piece_index_find(index, position);
+  unsigned int piece_start = index->ends[i] - index->pieces[i].length;
+  return packed_piece_text(index, index->pieces[i])[position - piece_start];
+}
+
+char* piece_index_get_slice(const piece_index* index,
+                            const unsigned int position,
+                            const unsigned int length)
+{
+  if(position > index->length || length > index->length - position)
+  {
+    // starting position or length out of bounds
+    return NULL;
+  }
+
+  char* slice = (char*)calloc(length + 1, sizeof(char));
+  if(!slice)
+  {
+    return NULL;
+  }
+
+  piece_index_copy(index, position, length, slice);
+  slice[length] = '\0';
+  return slice;
+}
+
+void piece_index_copy(const piece_index* index,
+                      const unsigned int position,
+                      const unsigned int length,
+                      char* destination)
+{
+  unsigned int copied_length = 0;
+  unsigned int i = length ? piece_index_find(index, position) : 0;
+  unsigned int piece_offset =
+    length ? position - (index->ends[i] - index->pieces[i].length) : 0;
+  while(copied_length < length)
+  {
+    unsigned int copy_length = index->pieces[i].length - piece_offset;
+    if(copy_length > length - copied_length)
+    {
+      copy_length = length - copied_length;
+    }
+    memcpy(destination + copied_length,
+           packed_piece_text(index, index->pieces[i]) + piece_offset,
+           copy_length);
+    copied_length += copy_length;
+    piece_offset = 0;
+    i++;
+  }
+}
+
+/// Parallel Copy Implementation
+#ifdef _WIN32
+DWORD WINAPI copy_range_run(LPVOID argument)
+#else
+void* copy_range_run(void* argument)
+#endif
+{
+  copy_range* range = (copy_range*)argument;
+  piece_index_copy(
+    range->index, range->position, range->length, range->destination);
+  return 0;
+}
+
+unsigned int processor_count()
+{
+#ifdef _WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors ? (unsigned int)info.dwNumberOfProcessors
+                                   : 1;
+#elif defined(_SC_NPROCESSORS_ONLN)
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+  return count > 0 ? (unsigned int)count : 1;
+#else
+  return 1;
+#endif
+}
+
+char* piece_index_to_string_parallel(const piece_index* index,
+                                     unsigned int threads)
+{
+  // not zeroed, every byte is written by one of the threads
+  char* string = (char*)malloc(index->length + 1);
+  if(!string)
+  {
+    return NULL;
+  }
+  string[index->length] = '\0';
+
+  if(threads == 0)
+  {
+    threads = processor_count();
+  }
+  unsigned int max_threads = index->length / PARALLEL_COPY_MIN_BYTES;
+  if(threads > max_threads)
+  {
+    threads = max_threads;
+  }
+  if(threads <= 1)
+  {
+    piece_index_copy(index, 0, index->length, string);
+    return string;
+  }
+
+  // bookkeeping goes through the allocator of the table,
+  // only the returned string is allocated with malloc
+  const piece_table_allocator* allocator = &index->allocator;
+  copy_range* ranges = (copy_range*)allocator->alloc(
+    sizeof(copy_range) * threads, allocator->user_data);
+#ifdef _WIN32
+  HANDLE* handles = (HANDLE*)allocator->alloc(sizeof(HANDLE) * threads,
+                                              allocator->user_data);
+#else
+  pthread_t* handles = (pthread_t*)allocator->alloc(
+    sizeof(pthread_t) * threads, allocator->user_data);
+#endif
+  bool* started =
+    (bool*)allocator->alloc(sizeof(bool) * threads, allocator->user_data);
+  if(!ranges || !handles || !started)
+  {
+    if(ranges)
+    {
+      allocator->free(ranges, allocator->user_data);
+    }
+    if(handles)
+    {
+      allocator->free(handles, allocator->user_data);
+    }
+    if(started)
+    {
+      allocator->free(started, allocator->user_data);
+    }
+    piece_index_copy(index, 0, index->length, string);
+    return string;
+  }
+
+  unsigned int range_length = index->length / threads;
+  for(unsigned int i = 0; i < threads; i++)
+  {
+    ranges[i].index = index;
+    ranges[i].position = i * range_length;
+    ranges[i].length =
+      i + 1 == threads ? index->length - ranges[i].position : range_length;
+    ranges[i].destination = string + ranges[i].position;
+  }
+
+  // calling thread copies the first range itself,
+  // ranges whose thread can't be started are copied by it as well
+  started[0] = false;
+  for(unsigned int i = 1; i < threads; i++)
+  {
+#ifdef _WIN32
+    handles[i] = CreateThread(NULL, 0, copy_range_run, &ranges[i], 0, NULL);
+    started[i] = handles[i] != NULL;
+#else
+    started[i] =
+      pthread_create(&handles[i], NULL, copy_range_run, &ranges[i]) == 0;
+#endif
+  }
+
+  for(unsigned int i = 0; i < threads; i++)
+  {
+    if(started[i])
+    {
+      continue;
+    }
+    copy_range_run(&ranges[i]);
+  }
+
+  for(unsigned int i = 1; i < threads; i++)
+  {
+    if(!started[i])
+    {
+      continue;
+    }
+#ifdef _WIN32
+    WaitForSingleObject(handles[i], INFINITE);
+    CloseHandle(handles[i]);
+#else
+    pthread_join(handles[i], NULL);
+#endif
+  }
+
+  allocator->free(started, allocator->user_data);
+  allocator->free(handles, allocator->user_data);
+  allocator->free(ranges, allocator->user_data);
+
+  return string;
+}
+
+/// Line Index Implementation
+line_index* line_index_get(text_buffer* buffer)
+{
+  line_index* index = (line_index*)atomic_load_pointer(&buffer->lines);
+  if(index)
+  {
+    return index;
+  }
+
+  const piece_table_allocator* allocator = &buffer->allocator;
+  index =
+    (line_index*)allocator->alloc(sizeof(line_index), allocator->user_data);
+  if(!index)
+  {
+    return NULL;
+  }
+
+  index->length = buffer->length;
+  index->chunks_count = index->length / LINE_INDEX_CHUNK_SIZE +
+                        (index->length % LINE_INDEX_CHUNK_SIZE != 0);
+  index->chunks = (line_chunk*)allocator->alloc(
+    sizeof(line_chunk) * (index->chunks_count + 1), allocator->user_data);
+  index->first_newlines = (unsigned int*)allocator->alloc(
+    sizeof(unsigned int) * (index->chunks_count + 1), allocator->user_data);
+  if(!index->chunks || !index->first_newlines)
+  {
+    if(index->chunks)
+    {
+      allocator->free(index->chunks, allocator->user_data);
+    }
+    if(index->first_newlines)
+    {
+      allocator->free(index->first_newlines, allocator->user_data);
+    }
+    allocator->free(index, allocator->user_data);
+    return NULL;
+  }
+
+  for(unsigned int i = 0; i < index->chunks_count; i++)
+  {
+    index->chunks[i].newlines = NULL;
+    index->chunks[i].count = 0;
+    index->chunks[i].state = LINE_CHUNK_PENDING;
+  }
+  index->first_newlines[0] = 0;
+  index->indexed_chunks = 0;
+  index->next_chunk = 0;
+  index->building = 0;
+#ifdef _WIN32
+  InitializeSRWLock(&index->building_lock);
+  InitializeConditionVariable(&index->built);
+#else
+  if(pthread_mutex_init(&index->building_lock, NULL) != 0)
+  {
+    allocator->free(index->chunks, allocator->user_data);
+    allocator->free(index->first_newlines, allocator->user_data);
+    allocator->free(index, allocator->user_data);
+    return NULL;
+  }
+  if(pthread_cond_init(&index->built, NULL) != 0)
+  {
+    pthread_mutex_destroy(&index->building_lock);
+    allocator->free(index->chunks, allocator->user_data);
+    allocator->free(index->first_newlines, allocator->user_data);
+    allocator->free(index, allocator->user_data);
+    return NULL;
+  }
+#endif
+
+  // tables sharing the buffer may race to create its index
+  if(!atomic_compare_exchange_pointer(
+       &buffer->lines, (line_index*)NULL, index))
+  {
+#ifndef _WIN32
+    pthread_mutex_destroy(&index->building_lock);
+    pthread_cond_destroy(&index->built);
+#endif
+    allocator->free(index->chunks, allocator->user_data);
+    allocator->free(index->first_newlines, allocator->user_data);
+    allocator->free(index, allocator->user_data);
+    return (line_index*)atomic_load_pointer(&buffer->lines);
+  }
+
+  return index;
+}
+
+void line_index_free(text_buffer* buffer)
+{
+  line_index* index = buffer->lines;
+  if(!index)
+  {
+    return;
+  }
+
+  const piece_table_allocator* allocator = &buffer->allocator;
+  for(unsigned int i = 0; i < index->chunks_count; i++)
+  {
+    if(index->chunks[i].newlines)
+    {
+      allocator->free(index->chunks[i].newlines, allocator->user_data);
+    }
+  }
+#ifndef _WIN32
+  pthread_mutex_destroy(&index->building_lock);
+  pthread_cond_destroy(&index->built);
+#endif
+  allocator->free(index->chunks, allocator->user_data);
+  allocator->free(index->first_newlines, allocator->user_data);
+  allocator->free(index, allocator->user_data);
+  buffer->lines = NULL;
+}
+
+void line_index_chunk(const line_index_job* job, const unsigned int chunk)
+{
+  const piece_table_allocator* allocator = &job->buffer->allocator;
+  line_chunk* c = &job->index->chunks[chunk];
+  unsigned int start = chunk * LINE_INDEX_CHUNK_SIZE;
+  unsigned int end = job->index->length - start > LINE_INDEX_CHUNK_SIZE
+                       ? start + LINE_INDEX_CHUNK_SIZE
+                       : job->index->length;
+
+  // counting first so newlines get an exact allocation,
+  // the chunk is still in cache for recording them
+  const char* data = job->buffer->data;
+  const char* cursor = data + start;
+  unsigned int count = 0;
+  while(cursor < data + end &&
+        (cursor = (const char*)memchr(cursor, '\n', data + end - cursor)))
+  {
+    count++;
+    cursor++;
+  }
+  if(count > 0)
+  {
+    c->newlines = (unsigned int*)allocator->alloc(sizeof(unsigned int) * count,
+                                                  allocator->user_data);
+    if(!c->newlines)
+    {
+      atomic_store_count(&c->state, LINE_CHUNK_FAILED);
+      return;
+    }
+  }
+
+  cursor = data + start;
+  for(unsigned int i = 0; i < count; i++)
+  {
+    cursor = (const char*)memchr(cursor, '\n', data + end - cursor);
+    c->newlines[i] = (unsigned int)(cursor - data);
+    cursor++;
+  }
+  c->count = count;
+
+  atomic_store_count(&c->state, LINE_CHUNK_INDEXED);
+}
+
+#ifdef _WIN32
+DWORD WINAPI line_index_run(LPVOID argument)
+#else
+void* line_index_run(void* argument)
+#endif
+{
+  line_index_job* job = (line_index_job*)argument;
+  while(!job->cancelled || !atomic_load_count(job->cancelled))
+  {
+    unsigned int chunk = atomic_increment(&job->index->next_chunk) - 1;
+    if(chunk >= job->index->chunks_count)
+    {
+      break;
+    }
+    if(atomic_load_count(&job->index->chunks[chunk].state) ==
+       LINE_CHUNK_INDEXED)
+    {
+      continue;
+    }
+    line_index_chunk(job, chunk);
+  }
+  return 0;
+}
+
+unsigned int line_index_publish(line_index* index)
+{
+  // only the building thread publishes, readers see the new prefix
+  // once indexed_chunks is stored
+  unsigned int published = index->indexed_chunks;
+  while(published < index->chunks_count &&
+        atomic_load_count(&index->chunks[published].state) ==
+          LINE_CHUNK_INDEXED)
+  {
+    index->first_newlines[published + 1] =
+      index->first_newlines[published] + index->chunks[published].count;
+    published++;
+  }
+  atomic_store_count(&index->indexed_chunks, published);
+
+  return published;
+}
+
+bool line_index_build(text_buffer* buffer,
+                      const unsigned int threads,
+                      piece_table_progress progress,
+                      const size_t done_bytes,
+                      const size_t total_bytes,
+                      void* user_data,
+                      const unsigned int* cancelled)
+{
+  line_index* index = line_index_get(buffer);
+  if(!index)
+  {
+    return false;
+  }
+
+  // another table sharing the buffer may be indexing it,
+  // whatever it left unindexed is built here
+  if(!line_index_begin_build(index))
+  {
+    return true;
+  }
+
+  // chunks that failed before are retried
+  unsigned int published = index->indexed_chunks;
+  for(unsigned int i = published; i < index->chunks_count; i++)
+  {
+    if(index->chunks[i].state == LINE_CHUNK_FAILED)
+    {
+      index->chunks[i].state = LINE_CHUNK_PENDING;
+    }
+  }
+  index->next_chunk = published;
+
+  line_index_job job = {buffer, index, cancelled};
+  unsigned int workers = (threads ? threads : processor_count()) - 1;
+  if(workers > index->chunks_count - published)
+  {
+    workers = index->chunks_count - published;
+  }
+  const piece_table_allocator* allocator = &buffer->allocator;
+#ifdef _WIN32
+  HANDLE* handles =
+    workers ? (HANDLE*)allocator->alloc(sizeof(HANDLE) * workers,
+                                        allocator->user_data)
+            : NULL;
+#else
+  pthread_t* handles =
+    workers ? (pthread_t*)allocator->alloc(sizeof(pthread_t) * workers,
+                                           allocator->user_data)
+            : NULL;
+#endif
+  bool* started = workers ? (bool*)allocator->alloc(sizeof(bool) * workers,
+                                                    allocator->user_data)
+                          : NULL;
+  for(unsigned int i = 0; started && i < workers; i++)
+  {
+    started[i] = false;
+  }
+  for(unsigned int i = 0; handles && started && i < workers; i++)
+  {
+#ifdef _WIN32
+    handles[i] = CreateThread(NULL, 0, line_index_run, &job, 0, NULL);
+    started[i] = handles[i] != NULL;
+#else
+    started[i] = pthread_create(&handles[i], NULL, line_index_run, &job) == 0;
+#endif
+  }
+
+  // calling thread indexes chunks too, and publishes the prefix
+  // indexed so far after each of them
+  while(!cancelled || !atomic_load_count(cancelled))
+  {
+    unsigned int chunk = atomic_increment(&index->next_chunk) - 1;
+    if(chunk >= index->chunks_count)
+    {
+      break;
+    }
+    if(atomic_load_count(&index->chunks[chunk].state) != LINE_CHUNK_INDEXED)
+    {
+      line_index_chunk(&job, chunk);
+    }
+
+    published = line_index_publish(index);
+    if(progress)
+    {
+      size_t indexed_bytes = (size_t)published * LINE_INDEX_CHUNK_SIZE;
+      progress(done_bytes + (indexed_bytes < index->length ? indexed_bytes
+                                                            : index->length),
+               total_bytes,
+               user_data);
+    }
+  }
+
+  for(unsigned int i = 0; handles && started && i < workers; i++)
+  {
+    if(!started[i])
+    {
+      continue;
+    }
+#ifdef _WIN32
+    WaitForSingleObject(handles[i], INFINITE);
+    CloseHandle(handles[i]);
+#else
+    pthread_join(handles[i], NULL);
+#endif
+  }
+  if(started)
+  {
+    allocator->free(started, allocator->user_data);
+  }
+  if(handles)
+  {
+    allocator->free(handles, allocator->user_data);
+  }
+
+  published = line_index_publish(index);
+  if(progress)
+  {
+    size_t indexed_bytes = (size_t)published * LINE_INDEX_CHUNK_SIZE;
+    progress(done_bytes + (indexed_bytes < index->length ? indexed_bytes
+                                                          : index->length),
+             total_bytes,
+             user_data);
+  }
+
+  line_index_end_build(index);
+
+  return published == index->chunks_count;
+}
+
+bool line_index_begin_build(line_index* index)
+{
+#ifdef _WIN32
+  AcquireSRWLockExclusive(&index->building_lock);
+  while(index->building)
+  {
+    SleepConditionVariableSRW(
+      &index->built, &index->building_lock, INFINITE, 0);
+  }
+#else
+  pthread_mutex_lock(&index->building_lock);
+  while(index->building)
+  {
+    pthread_cond_wait(&index->built, &index->building_lock);
+  }
+#endif
+
+  bool complete = atomic_load_count(&index->indexed_chunks) ==
+                  index->chunks_count;
+  index->building = !complete;
+
+#ifdef _WIN32
+  ReleaseSRWLockExclusive(&index->building_lock);
+#else
+  pthread_mutex_unlock(&index->building_lock);
+#endif
+
+  return !complete;
+}
+
+void line_index_end_build(line_index* index)
+{
+#ifdef _WIN32
+  AcquireSRWLockExclusive(&index->building_lock);
+  index->building = 0;
+  ReleaseSRWLockExclusive(&index->building_lock);
+  WakeAllConditionVariable(&index->built);
+#else
+  pthread_mutex_lock(&index->building_lock);
+  index->building = 0;
+  pthread_cond_broadcast(&index->built);
+  pthread_mutex_unlock(&index->building_lock);
+#endif
+}
+
+size_t line_index_bytes(const line_index* index)
+{
+  unsigned int published = atomic_load_count(&index->indexed_chunks);
+  return sizeof(line_index) +
+         (sizeof(line_chunk) + sizeof(unsigned int)) *
+           (index->chunks_count + 1) +
+         sizeof(unsigned int) * index->first_newlines[published];
+}
+
+unsigned int line_index_newlines_before(const line_index* index,
+                                        const unsigned int position)
+{
+  unsigned int chunk = position / LINE_INDEX_CHUNK_SIZE;
+  if(chunk >= index->chunks_count || position % LINE_INDEX_CHUNK_SIZE == 0)
+  {
+    return index->first_newlines[chunk];
+  }
+
+  // lower bound of position among newlines of its chunk
+  const line_chunk* c = &index->chunks[chunk];
+  unsigned int low = 0, high = c->count;
+  while(low < high)
+  {
+    unsigned int middle = low + (high - low) / 2;
+    if(c->newlines[middle] < position)
+    {
+      low = middle + 1;
+    }
+    else
+    {
+      high = middle;
+    }
+  }
+
+  return index->first_newlines[chunk] + low;
+}
+
+unsigned int source_count_newlines(const text_buffer* buffer,
+                                   unsigned int start,
+                                   const unsigned int end)
+{
+  unsigned int count = 0;
+
+  const line_index* index =
+    (const line_index*)atomic_load_pointer(&buffer->lines);
+  if(index && start < end)
+  {
+    unsigned int published = atomic_load_count(&index->indexed_chunks);
+    unsigned int indexed_end = published == index->chunks_count
+                                 ? index->length
+                                 : published * LINE_INDEX_CHUNK_SIZE;
+    if(start < indexed_end)
+    {
+      unsigned int covered_end = end < indexed_end ? end : indexed_end;
+      count = line_index_newlines_before(index, covered_end) -
+              line_index_newlines_before(index, start);
+      start = covered_end;
+    }
+  }
+
+  // rest of range isn't indexed yet, memchr scans it a vector at a time
+  const char* cursor = buffer->data + start;
+  const char* range_end = buffer->data + end;
+  while(cursor < range_end &&
+        (cursor = (const char*)memchr(cursor, '\n', range_end - cursor)))
+  {
+    count++;
+    cursor++;
+  }
+
+  return count;
+}
+
+unsigned int source_find_newline(const text_buffer* buffer,
+                                 unsigned int start,
+                                 const unsigned int end,
+                                 unsigned int n)
+{
+  const line_index* index =
+    (const line_index*)atomic_load_pointer(&buffer->lines);
+  if(index && start < end)
+  {
+    unsigned int published = atomic_load_count(&index->indexed_chunks);
+    unsigned int indexed_end = published == index->chunks_count
+                                 ? index->length
+                                 : published * LINE_INDEX_CHUNK_SIZE;
+    if(start < indexed_end)
+    {
+      unsigned int covered_end = end < indexed_end ? end : indexed_end;
+      unsigned int first = line_index_newlines_before(index, start);
+      unsigned int count =
+        line_index_newlines_before(index, covered_end) - first;
+      if(n <= count)
+      {
+        // finding the chunk holding the newline by its rank
+        unsigned int rank = first + n - 1;
+        unsigned int low = 0, high = published;
+        while(high - low > 1)
+        {
+          unsigned int middle = low + (high - low) / 2;
+          if(index->first_newlines[middle] <= rank)
+          {
+            low = middle;
+          }
+          else
+          {
+            high = middle;
+          }
+        }
+        return index->chunks[low].newlines[rank - index->first_newlines[low]];
+      }
+      n -= count;
+      start = covered_end;
+    }
+  }
+
+  const char* cursor = buffer->data + start;
+  const char* range_end = buffer->data + end;
+  while(cursor < range_end &&
+        (cursor = (const char*)memchr(cursor, '\n', range_end - cursor)))
+  {
+    if(--n == 0)
+    {
+      return (unsigned int)(cursor - buffer->data);
+    }
+    cursor++;
+  }
+
+  return end;
+}
+
+/// File Loader Implementation
+#ifdef _WIN32
+DWORD WINAPI file_loader_run(LPVOID argument)
+#else
+void* file_loader_run(void* argument)
+#endif
+{
+  file_loader* loader = (file_loader*)argument;
+  text_buffer* buffer = loader->buffer;
+
+#ifdef PIECE_TABLE_HAS_MMAP
+  if(buffer->memory == BUFFER_MEMORY_MAPPED_FILE)
+  {
+    // kernel reads ahead while lines of the first chunks are indexed
+    advise_range(buffer->data, buffer->capacity, PIECE_TABLE_ACCESS_WILLNEED);
+  }
+#endif
+
+  // indexing lines reads every byte, faulting mapped pages in order
+  loader->result = line_index_build(buffer,
+                                    loader->threads,
+                                    loader->progress,
+                                    0,
+                                    buffer->length,
+                                    loader->user_data,
+                                    &loader->cancelled);
+  if(loader->loaded && !atomic_load_count(&loader->cancelled))
+  {
+    loader->loaded(loader->table, loader->result, loader->user_data);
+  }
+
+  return 0;
+}
+
+bool file_loader_start(piece_table* table,
+                       const unsigned int threads,
+                       piece_table_progress progress,
+                       piece_table_loaded loaded,
+                       void* user_data)
+{
+  file_loader* loader = (file_loader*)table_alloc(table, sizeof(file_loader));
+  if(!loader)
+  {
+    return false;
+  }
+
+  loader->table = table;
+  loader->buffer = table->sources[ORIGINAL];
+  text_buffer_retain(loader->buffer);
+  loader->threads = threads;
+  loader->progress = progress;
+  loader->loaded = loaded;
+  loader->user_data = user_data;
+  loader->cancelled = 0;
+  loader->result = false;
+
+  // loading in the calling thread instead would call loaded before the
+  // table is returned, where it may not be freed.
+  // The loaded callback may wait for or free the table, so the loader is
+  // on the table before the thread starts and nothing is touched after.
+  table->loader = loader;
+#ifdef _WIN32
+  InitializeSRWLock(&loader->thread_lock);
+  AcquireSRWLockExclusive(&loader->thread_lock);
+  loader->thread = CreateThread(NULL, 0, file_loader_run, loader, 0, NULL);
+  bool started = loader->thread != NULL;
+  ReleaseSRWLockExclusive(&loader->thread_lock);
+#else
+  int error = pthread_mutex_init(&loader->thread_lock, NULL);
+  bool started = error == 0;
+  if(started)
+  {
+    pthread_mutex_lock(&loader->thread_lock);
+    error = pthread_create(&loader->thread, NULL, file_loader_run, loader);
+    started = error == 0;
+    pthread_mutex_unlock(&loader->thread_lock);
+    if(!started)
+    {
+      pthread_mutex_destroy(&loader->thread_lock);
+    }
+  }
+  if(!started)
+  {
+    errno = error;
+  }
+#endif
+  if(!started)
+  {
+    table->loader = NULL;
+    text_buffer_release(loader->buffer);
+    table_free(table, loader);
+    return false;
+  }
+
+  return true;
+}
+
+bool file_loader_join(piece_table* table, const bool cancel)
+{
+  // loader is taken off the table under the lock and joined without it,
+  // as the loaded callback may use the table
+  table_write_lock(table);
+  file_loader* loader = table->loader;
+  table->loader = NULL;
+  table_write_unlock(table);
+  if(!loader)
+  {
+    return true;
+  }
+
+  if(cancel)
+  {
+    atomic_store_count(&loader->cancelled, 1);
+  }
+  // the loaded callback runs on the loader thread, which can't join itself,
+  // it no longer touches the loader once the callback is called
+#ifdef _WIN32
+  AcquireSRWLockShared(&loader->thread_lock);
+  HANDLE thread = loader->thread;
+  ReleaseSRWLockShared(&loader->thread_lock);
+  if(GetThreadId(thread) != GetCurrentThreadId())
+  {
+    WaitForSingleObject(thread, INFINITE);
+  }
+  CloseHandle(thread);
+#else
+  pthread_mutex_lock(&loader->thread_lock);
+  pthread_t thread = loader->thread;
+  pthread_mutex_unlock(&loader->thread_lock);
+  if(pthread_equal(thread, pthread_self()))
+  {
+    pthread_detach(thread);
+  }
+  else
+  {
+    pthread_join(thread, NULL);
+  }
+  pthread_mutex_destroy(&loader->thread_lock);
+#endif
+
+  bool result = loader->result;
+  text_buffer_release(loader->buffer);
+  table_free(table, loader);
+
+  return result;
+}
+
+/// Save Implementation
+double monotonic_seconds()
+{
+#ifdef _WIN32
+  LARGE_INTEGER frequency, counter;
+  QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&counter);
+  return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+#endif
+}
+
+bool piece_index_write(const piece_index* index, FILE* file)
+{
+  for(unsigned int i = 0; i < index->count; i++)
+  {
+    const packed_piece p = index->pieces[i];
+    if(p.length > 0 &&
+       fwrite(packed_piece_text(index, p), sizeof(char), p.length, file) !=
+         p.length)
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool piece_index_save(const piece_index* index, const char* path)
+{
+#ifndef _WIN32
+  // renaming over a symlink would replace the link with a regular file
+  char* resolved = realpath(path, NULL);
+  if(resolved)
+  {
+    bool saved = piece_index_replace_file(index, resolved);
+    free(resolved);
+    return saved;
+  }
+#endif
+
+  return piece_index_replace_file(index, path);
+}
+
+unsigned int process_umask()
+{
+#ifdef _WIN32
+  return 0;
+#else
+  // Linux reports the mask, elsewhere it can only be swapped
+  FILE* status = fopen("/proc/self/status", "r");
+  if(status)
+  {
+    char line[128];
+    unsigned int mask = 0;
+    bool found = false;
+    while(!found && fgets(line, sizeof(line), status))
+    {
+      found = sscanf(line, "Umask: %o", &mask) == 1;
+    }
+    fclose(status);
+    if(found)
+    {
+      return mask;
+    }
+  }
+
+  // files other threads create while it is cleared get no mask
+  mode_t mask = umask(0);
+  umask(mask);
+  return (unsigned int)mask;
+#endif
+}
+
+bool piece_index_replace_file(const piece_index* index, const char* path)
+{
+  // hidden temporary file in the directory of path,
+  // so it is renamed within one file system
+  const char* name = strrchr(path, '/');
+#ifdef _WIN32
+  const char* backslash = strrchr(path, '\\');
+  if(!name || (backslash && backslash > name))
+  {
+    name = backslash;
+  }
+#endif
+  size_t directory_length = name ? (size_t)(name - path) + 1 : 0;
+  name = name ? name + 1 : path;
+  size_t name_length = strlen(name);
+  size_t temporary_size = directory_length + name_length + sizeof("..XXXXXX");
+  const piece_table_allocator* allocator = &index->allocator;
+  char* temporary_path =
+    (char*)allocator->alloc(temporary_size, allocator->user_data);
+  if(!temporary_path)
+  {
+    return false;
+  }
+  memcpy(temporary_path, path, directory_length);
+  temporary_path[directory_length] = '.';
+  memcpy(temporary_path + directory_length + 1, name, name_length);
+  memcpy(temporary_path + directory_length + 1 + name_length,
+         ".XXXXXX",
+         sizeof(".XXXXXX"));
+
+#ifdef _WIN32
+  FILE* file = _mktemp_s(temporary_path, temporary_size) == 0
+                 ? fopen(temporary_path, "wb")
+                 : NULL;
+  if(!file)
+  {
+    allocator->free(temporary_path, allocator->user_data);
+    return false;
+  }
+
+  bool written = piece_index_write(index, file) && fflush(file) == 0 &&
+                 _commit(_fileno(file)) == 0;
+  written = fclose(file) == 0 && written;
+  written = written && MoveFileExA(temporary_path,
+                                   path,
+                                   MOVEFILE_REPLACE_EXISTING |
+                                     MOVEFILE_WRITE_THROUGH) != 0;
+  if(!written)
+  {
+    remove(temporary_path);
+  }
+#else
+  int descriptor = mkstemp(temporary_path);
+  if(descriptor < 0)
+  {
+    allocator->free(temporary_path, allocator->user_data);
+    return false;
+  }
+
+  // mkstemp creates files readable by their owner only,
+  // a replaced file keeps its own mode instead
+  // and a new one gets the mode open() would give it
+  struct stat original;
+  bool written = true;
+  if(stat(path, &original) == 0)
+  {
+    // ownership goes first, as changing it may clear set-id bits of the mode;
+    // only root may give the file away, others may still keep its group
+    if(fchown(descriptor, original.st_uid, original.st_gid) != 0 &&
+       fchown(descriptor, (uid_t)-1, original.st_gid) != 0)
+    {
+      // file stays owned by the caller
+    }
+    written = fchmod(descriptor, original.st_mode & 07777) == 0;
+  }
+  else if(errno == ENOENT)
+  {
+    written = fchmod(descriptor, 0666 & ~process_umask()) == 0;
+  }
+  FILE* file = fdopen(descriptor, "wb");
+  if(!file)
+  {
+    close(descriptor);
+    remove(temporary_path);
+    allocator->free(temporary_path, allocator->user_data);
+    return false;
+  }
+
+  // text reaches the disk before the rename, so a crash leaves either
+  // the old file or the new one
+  written = written && piece_index_write(index, file) && fflush(file) == 0 &&
+            fsync(descriptor) == 0;
+  written = fclose(file) == 0 && written;
+  if(!written || rename(temporary_path, path) != 0)
+  {
+    remove(temporary_path);
+    allocator->free(temporary_path, allocator->user_data);
+    return false;
+  }
+
+  // rename itself is durable once the directory is synced
+  temporary_path[directory_length] = '\0';
+  int directory = open(directory_length ? temporary_path : ".", O_RDONLY);
+  if(directory >= 0)
+  {
+    written = fsync(directory) == 0;
+    close(directory);
+  }
+#endif
+
+  allocator->free(temporary_path, allocator->user_data);
+  return written;
+}
+
+#ifdef _WIN32
+DWORD WINAPI save_job_run(LPVOID argument)
+#else
+void* save_job_run(void* argument)
+#endif
+{
+  save_job* job = (save_job*)argument;
+
+  double start = monotonic_seconds();
+  bool result = piece_index_save(job->index, job->path);
+  double elapsed = monotonic_seconds() - start;
+
+  piece_index_release(job->index);
+  if(job->saved)
+  {
+    job->saved(result, elapsed, job->user_data);
+  }
+  const piece_table_allocator allocator = job->allocator;
+  allocator.free(job->path, allocator.user_data);
+  allocator.free(job, allocator.user_data);
+
+  return 0;
+}
+
+/// Tracing Implementation
+unsigned long long monotonic_nanoseconds()
+{
+#ifdef _WIN32
+  LARGE_INTEGER frequency, counter;
+  QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&counter);
+  // split, so counter * 1e9 doesn't overflow
+  unsigned long long seconds = counter.QuadPart / frequency.QuadPart;
+  unsigned long long ticks = counter.QuadPart % frequency.QuadPart;
+  return seconds * 1000000000ull +
+         ticks * 1000000000ull / (unsigned long long)frequency.QuadPart;
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (unsigned long long)now.tv_sec * 1000000000ull +
+         (unsigned long long)now.tv_nsec;
+#endif
+}
+
+bool trace_take_tracer(const piece_table* table, trace_call* trace)
+{
+  trace->event.name = NULL;
+  if(!table || !atomic_load_count(&table->tracing))
+  {
+    return false;
+  }
+
+  // tracer may have been removed since the flag was read
+  table_read_lock(table);
+  bool tracing = table->tracing != 0;
+  trace->tracer = table->tracer;
+  table_read_unlock(table);
+
+  return tracing;
+}
+
+void trace_report_begin(const piece_table* table,
+                        trace_call* trace,
+                        const piece_table_call call,
+                        const unsigned int position,
+                        const unsigned int length)
+{
+  // indexed by piece_table_call
+  static const char* names[] = {"piece_table_insert",
+                                "piece_table_insert_file",
+                                "piece_table_insert_source",
+                                "piece_table_start_micro_inserts",
+                                "piece_table_micro_insert",
+                                "piece_table_stop_micro_inserts",
+                                "piece_table_remove",
+                                "piece_table_replace",
+                                "piece_table_undo",
+                                "piece_table_redo",
+                                "piece_table_memsafe_remove",
+                                "piece_table_memsafe_undo",
+                                "piece_table_memsafe_redo",
+                                "piece_table_get_char_at",
+                                "piece_table_get_line",
+                                "piece_table_get_slice",
+                                "piece_table_index_lines",
+                                "piece_table_wait_loaded",
+                                "piece_table_to_string",
+                                "piece_table_to_string_parallel",
+                                "piece_table_clone",
+                                "piece_table_split_at",
+                                "piece_table_concat",
+                                "piece_table_freeze",
+                                "piece_table_compact",
+                                "piece_table_snapshot",
+                                "piece_table_save",
+                                "piece_table_save_async"};
+
+  trace->event.call = call;
+  trace->event.name = names[call];
+  trace->event.position = position;
+  trace->event.length = length;
+  trace->event.end_nanoseconds = 0;
+  trace->event.success = false;
+  trace->event.begin_nanoseconds = monotonic_nanoseconds();
+  if(trace->tracer.begin)
+  {
+    trace->tracer.begin(table, &trace->event, trace->tracer.user_data);
+  }
+}
+
+void trace_begin(const piece_table* table,
+                 trace_call* trace,
+                 const piece_table_call call,
+                 const unsigned int position,
+                 const unsigned int length)
+{
+  if(trace_take_tracer(table, trace))
+  {
+    trace_report_begin(table, trace, call, position, length);
+  }
+}
+
+void trace_begin_string(const piece_table* table,
+                        trace_call* trace,
+                        const piece_table_call call,
+                        const unsigned int position,
+                        const char* string)
+{
+  if(trace_take_tracer(table, trace))
+  {
+    trace_report_begin(
+      table, trace, call, position, string ? strlen(string) : 0);
+  }
+}
+
+void trace_end(const piece_table* table,
+               trace_call* trace,
+               const bool success)
+{
+  if(!trace->event.name || !trace->tracer.end)
+  {
+    return;
+  }
+
+  trace->event.end_nanoseconds = monotonic_nanoseconds();
+  trace->event.success = success;
+  trace->tracer.end(table, &trace->event, trace->tracer.user_data);
+}
+
+/// Split & Concat Helpers Implementation
+piece_table* piece_table_from_piece_index(const piece_index* index)
+{
+  piece_table* table = piece_table_new_with_allocator(&index->allocator);
+  if(!table)
+  {
+    return NULL;
+  }
+
+  if(!table_share_sources(table, index))
+  {
+    piece_table_free(table);
+    return NULL;
+  }
+  table->add_buffer_length = index->add_buffer_length;
+  // wasted until pieces are appended
+  table->add_buffer_wasted_length = index->add_buffer_length;
+
+  return table;
+}
+
+bool append_piece_index_range(piece_table* table,
+                              piece** tail,
+                              const piece_index* index,
+                              const unsigned int position,
+                              const unsigned int length)
+{
+  if(length == 0)
+  {
+    return true;
+  }
+
+  unsigned int i = piece_index_find(index, position);
+  unsigned int piece_offset =
+    position - (index->ends[i] - index->pieces[i].length);
+  unsigned int appended_length = 0;
+  while(appended_length < length)
+  {
+    packed_piece packed = index->pieces[i];
+    unsigned int piece_length = packed.length - piece_offset;
+    if(piece_length > length - appended_length)
+    {
+      piece_length = length - appended_length;
+    }
+
+    // buffers the table doesn't have yet are shared as new sources
+    unsigned int buffer = 0;
+    if(!table_find_source(table, index->sources[packed.buffer], &buffer))
+    {
+      return false;
+    }
+
+    piece* p = piece_new(
+      table, buffer, packed.start_position + piece_offset, piece_length);
+    if(!p)
+    {
+      return false;
+    }
+    unsigned int piece_end =
+      packed.start_position + piece_offset + piece_length;
+    if(buffer == ADD && piece_end > table->add_buffer_length)
+    {
+      // another table appended to the shared add buffer past this one,
+      // appends must not overwrite what the piece points to
+      table->add_buffer_wasted_length += piece_end - table->add_buffer_length;
+      table->add_buffer_length = piece_end;
+    }
+    if(buffer == ADD)
+    {
+      // text of a table concatenated with itself shares add buffer bytes
+      table->add_buffer_wasted_length -=
+        piece_length < table->add_buffer_wasted_length
+          ? piece_length
+          : table->add_buffer_wasted_length;
+    }
+    if(*tail)
+    {
+      (*tail)->next = p;
+    }
+    else
+    {
+      table->pieces_head = p;
+    }
+    *tail = p;
+
+    appended_length += piece_length;
+    piece_offset = 0;
+    i++;
+  }
+
+  return true;
+}
+
+bool ensure_piece(piece_table* table)
+{
+  if(table->pieces_head)
+  {
+    return true;
+  }
+
+  // same as a table created from an empty string
+  table->pieces_head = piece_new(table, ORIGINAL, 0, 0);
+  return table->pieces_head != NULL;
+}
+
+/// Operation API Implementation
+operation* operation_new(piece_table* table,
+                         const operation_type type,
+                         piece* prev_piece,
+                         piece* start_piece,
+                         piece* end_piece,
+                         piece* next_piece)
+{
+  operation* op = (operation*)table_alloc(table, sizeof(operation));
+  if(!op)
+  {
+    return NULL;
+  }
+
+  op->type = type;
+  op->prev_piece = prev_piece;
+  op->start_piece = start_piece;
+  op->end_piece = end_piece;
+  op->next_piece = next_piece;
+  op->replacement_piece = NULL;
+  op->add_length = 0;
+  op->next = NULL;
+  count_stat(table, undo_records, 1);
+
+  return op;
+}
+
+bool operation_free(piece_table* table, operation* op)
+{
+  if(!op)
+  {
+    return false;
+  }
+
+  // Memory leaks from virtually removed pieces
+  // some pieces are freed beforehand in recursively_free_pieces()
+  // so freeing pieces here may result in double-free
+  // as undo, redo operations are containing weak-pointers to actual pieces
+  // TODO: New branch for memsafe undo & redo operations
+  if(op->prev_piece)
+  {
+    piece_free(table, op->prev_piece);
+  }
+  if(op->next_piece)
+  {
+    piece_free(table, op->next_piece);
+  }
+  if(op->start_piece)
+  {
+    if(op->start_piece == op->end_piece)
+    {
+      piece_free(table, op->start_piece);
+    }
+    else
+    {
+      op->end_piece->next = NULL;
+      if(!recursively_free_pieces(table, op->start_piece))
+      {
+        return false;
+      }
+    }
+    op->start_piece = NULL;
+    op->end_piece = NULL;
+  }
+
+  table_free(table, op);
+  return true;
+}
+
+/// MemSafe Operation API Implementation
+memsafe_operation* memsafe_operation_new(piece_table* table,
+                                         const operation_type type,
+                                         const unsigned int start_position,
+                                         const unsigned int length,
+                                         const char* string)
+{
+  memsafe_operation* op =
+    (memsafe_operation*)table_alloc(table, sizeof(memsafe_operation));
+  if(!op)
+  {
+    return NULL;
+  }
+
+  op->type = type;
+  op->start_position = start_position;
+  op->length = length;
+  if(!string)
+  {
+    op->string = NULL;
+  }
+  else
+  {
+    op->string = table_strdup(table, string);
+    if(!op->string)
+    {
+      table_free(table, op);
+      return NULL;
+    }
+  }
+  op->source = NULL;
+  op->source_start = 0;
+  op->next = NULL;
+  count_stat(table, undo_records, 1);
+
+  return op;
+}
+
+bool memsafe_operation_free(piece_table* table, memsafe_operation* op)
+{
+  if(!op)
+  {
+    return false;
+  }
+
+  if(op->string)
+  {
+    table_free(table, op->string);
+  }
+  text_buffer_release(op->source);
+
+  table_free(table, op);
+  return true;
+}
+
+/// MemSafe Operations Helpers API Implementation
+bool push_memsafe_operation_on_stack(memsafe_operation** stack_top,
+                                     memsafe_operation* op)
+{
+  if(!stack_top)
+  {
+    return false;
+  }
+
+  if(!*stack_top)
+  {
+    *stack_top = op;
+    op->next = NULL;
+    return true;
+  }
+
+  op->next = *stack_top;
+  *stack_top = op;
+
+  return true;
+}
+
+bool record_memsafe_operation(piece_table* table, memsafe_operation* op)
+{
+  if(!table)
+  {
+    return false;
+  }
+
+  if(!push_memsafe_operation_on_stack(&table->memsafe_undo_stack_top, op))
+  {
+    return false;
+  }
+  table->undo_records_count++;
+  table->undo_records_bytes += memsafe_operation_size(op);
+
+  return true;
+}
+
+unsigned int memsafe_operation_size(const memsafe_operation* op)
+{
+  if(!op)
+  {
+    return 0;
+  }
+
+  return sizeof(memsafe_operation) + (op->string ? strlen(op->string) + 1 : 0);
+}
+
+bool pop_memsafe_operation_from_stack(piece_table* table,
+                                      memsafe_operation** stack_top)
+{
+  if(!stack_top)
+  {
+    return false;
+  }
+
+  if(!*stack_top)
+  {
+    return false;
+  }
+
+  if((*stack_top)->next == NULL)
+  {
+    memsafe_operation_free(table, *stack_top);
+    *stack_top = NULL;
+  }
+
+  memsafe_operation* temp = (*stack_top)->next;
+  memsafe_operation_free(table, *stack_top);
+  *stack_top = temp;
+
+  return true;
+}
+
+bool move_memsafe_operation_from_undo_to_redo_stack(piece_table* table)
+{
+  if(!table)
+  {
+    return false;
+  }
+
+  if(!table->memsafe_undo_stack_top)
+  {
+    return false;
+  }
+
+  memsafe_operation* op = table->memsafe_undo_stack_top;
+  table->memsafe_undo_stack_top = op->next;
+
+  unsigned int op_size = memsafe_operation_size(op);
+  table->undo_records_count--;
+  table->undo_records_bytes -= op_size;
+  table->redo_records_count++;
+  table->redo_records_bytes += op_size;
+
+  if(!table->memsafe_redo_stack_top)
+  {
+    table->memsafe_redo_stack_top = op;
+    op->next = NULL;
+    return true;
+  }
+
+  op->next = table->memsafe_redo_stack_top;
+  table->memsafe_redo_stack_top = op;
+
+  return true;
+}
+
+bool move_memsafe_operation_from_redo_to_undo_stack(piece_table* table)
+{
+  if(!table)
+  {
+    return false;
+  }
+
+  if(!table->memsafe_redo_stack_top)
+  {
+    return false;
+  }
+
+  memsafe_operation* op = table->memsafe_redo_stack_top;
+  table->memsafe_redo_stack_top = op->next;
+
+  unsigned int op_size = memsafe_operation_size(op);
+  table->redo_records_count--;
+  table->redo_records_bytes -= op_size;
+  table->undo_records_count++;
+  table->undo_records_bytes += op_size;
+
+  if(!table->memsafe_undo_stack_top)
+  {
+    table->memsafe_undo_stack_top = op;
+    op->next = NULL;
+    return true;
+  }
+
+  op->next = table->memsafe_undo_stack_top;
+  table->memsafe_undo_stack_top = op;
+
+  return true;
+}
+
+bool recursively_free_memsafe_operation_stack(piece_table* table,
+                                              memsafe_operation* op,
+                                              const bool undone)
+{
+  if(!op)
+  {
+    return false;
+  }
+
+  if(op->next)
+  {
+    if(!recursively_free_memsafe_operation_stack(table, op->next, undone))
+    {
+      return false;
+    }
+  }
+
+  if(undone)
+  {
+    table->redo_records_count--;
+    table->redo_records_bytes -= memsafe_operation_size(op);
+  }
+  else
+  {
+    table->undo_records_count--;
+    table->undo_records_bytes -= memsafe_operation_size(op);
+  }
+  memsafe_operation_free(table, op);
+
+  return true;
+}
+
+/// Helpers Implementation
+bool recursively_free_pieces(piece_table* table, piece* p)
+{
+  if(!p)
+  {
+    return false;
+  }
+
+  if(p->next)
+  {
+    if(!recursively_free_pieces(table, p->next))
+    {
+      return false;
+    }
+  }
+
+  piece_free(table, p);
+
+  return true;
+}
+
+bool insert_piece_after(piece* p, piece* after)
+{
+  if(!after)
+  {
+    return false;
+  }
+
+  if(!p)
+  {
+    return false;
+  }
+
+  p->next = after->next;
+  after->next = p;
+
+  return true;
+}
+
+bool split_piece_at(piece_table* table, piece* p, const unsigned int offset)
+{
+  if(!p)
+  {
+    return false;
+  }
+
+  if(offset == 0)
+  {
+    return false;
+  }
+
+  if(!insert_piece_after(piece_new(table,
+                                   p->buffer,
+                                   p->start_position + offset,
+                                   p->length - offset),
+                         p))
+  {
+    return false;
+  }
+  p->length = offset;
+  count_stat(table, splits, 1);
+
+  return true;
+}
+
+bool insert_piece_at(piece_table* table,
+                     piece* p,
+                     const unsigned int offset,
+                     piece* new_p)
+{
+  if(offset == p->length)
+  {
+    return insert_piece_after(new_p, p);
+  }
+
+  if(offset == 0)
+  {
+    // only the first piece can be found at offset 0
+    new_p->next = p;
+    table->pieces_head = new_p;
+    return true;
+  }
+
+  if(!split_piece_at(table, p, offset))
+  {
+    return false;
+  }
+
+  return insert_piece_after(new_p, p);
+}
+
+bool remove_slice_between_pieces(piece_table* table,
+                                 piece* starting_piece,
+                                 piece* ending_piece)
+{
+  if(!starting_piece)
+  {
+    return false;
+  }
+
+  if(!ending_piece)
+  {
+    return false;
+  }
+
+  piece* p = starting_piece;
+  while(p->next != ending_piece)
+  {
+    p = p->next;
+  }
+  p->next = NULL;
+  p = starting_piece->next;
+  starting_piece->next = ending_piece;
+
+  if(!recursively_free_pieces(table, p))
+  {
+    return false;
+  }
+
+  return true;
+}
+
+bool remove_piece_from_table(piece_table* table, piece* p)
+{
+  if(!table)
+  {
+    return false;
+  }
+
+  if(!p)
+  {
+    return false;
+  }
+
+  piece* temp = table->pieces_head;
+  if(temp == p)
+  {
+    // deleting the head
+    table->pieces_head = temp->next;
+    piece_free(table, temp);
+    return true;
+  }
+
+  while(temp->next != p)
+  {
+    temp = temp->next;
+  }
+  temp->next = p->next;
+  piece_free(table, p);
+
+  return true;
+}
+
+const char* operation_to_string(const operation_type type)
+{
+  switch(type)
+  {
+  case INSERT:
+    return "INSERT";
+  case REMOVE:
+    return "REMOVE";
+  case REPLACE:
+    return "REPLACE";
+  default:
+    break;
+  }
+
+  return NULL;
+}
+
+bool push_operation_on_stack(operation** stack_top, operation* op)
+{
+
+  if(!op)
+  {
+    return false;
+  }
+
+  if(!*stack_top)
+  {
+    *stack_top = op;
+    return true;
+  }
+
+  op->next = *stack_top;
+  *stack_top = op;
+
+  return true;
+}
+
+bool record_operation(piece_table* table, operation* op)
+{
+  if(!table)
+  {
+    return false;
+  }
+
+  if(!push_operation_on_stack(&table->undo_stack_top, op))
+  {
+    return false;
+  }
+  table->undo_records_count++;
+  table->undo_records_bytes += sizeof(operation);
+
+  return true;
+}
+
+bool pop_operation_from_stack(operation** stack_top)
+{
+  if(!*stack_top)
+  {
+    return false;
+  }
+
+  operation* temp = *stack_top;
+
+  if(temp->next)
+  {
+    *stack_top = temp->next;
+  }
+  else
+  {
+    *stack_top = NULL;
+  }
+
+  // in operation is freed, operation on redo stack will
+  // point to NULL, resulting in segmentation fault
+  // operation_free(temp);
+
+  return true;
+}
+
+bool move_operation_from_undo_to_redo_stack(piece_table* table)
+{
+  if(!table)
+  {
+    return false;
+  }
+
+  if(!table->undo_stack_top)
+  {
+    return false;
+  }
+
+  operation* op = table->undo_stack_top;
+  table->undo_stack_top = op->next;
+
+  table->undo_records_count--;
+  table->undo_records_bytes -= sizeof(operation);
+  table->redo_records_count++;
+  table->redo_records_bytes += sizeof(operation);
+
+  if(!table->redo_stack_top)
+  {
+    table->redo_stack_top = op;
+    op->next = NULL;
+    return true;
+  }
+
+  op->next = table->redo_stack_top;
+  table->redo_stack_top = op;
+
+  return true;
+}
+
+bool move_operation_from_redo_to_undo_stack(piece_table* table)
+{
+  if(!table)
+  {
+    return false;
+  }
+
+  if(!table->redo_stack_top)
+  {
+    return false;
+  }
+
+  operation* op = table->redo_stack_top;
+  table->redo_stack_top = op->next;
+
+  table->redo_records_count--;
+  table->redo_records_bytes -= sizeof(operation);
+  table->undo_records_count++;
+  table->undo_records_bytes += sizeof(operation);
+
+  if(!table->undo_stack_top)
+  {
+    table->undo_stack_top = op;
+    op->next = NULL;
+    return true;
+  }
+
+  op->next = table->undo_stack_top;
+  table->undo_stack_top = op;
+
+  return true;
+}
+
+bool recursively_free_operation_stack(piece_table* table, operation* op)
+{
+  if(!op)
+  {
+    return false;
+  }
+
+  if(op->next)
+  {
+    if(!recursively_free_operation_stack(table, op->next))
+    {
+      return false;
+    }
+  }
+
+  operation_free(table, op);
+
+  return true;
+}
+
+bool free_operation_stack(piece_table* table,
+                          operation* op,
+                          const bool undone)
+{
+  if(!op)
+  {
+    return false;
+  }
+
+  // an operation owns the pieces it detached from the table:
+  // a remove its removed pieces, or its replacements once undone,
+  // an undone insert its inserted pieces,
+  // prev_piece & next_piece are linked by the table or another operation
+  while(op)
+  {
+    operation* next = op->next;
+    piece* p = NULL;
+    piece* end = NULL;
+    if(op->type == REMOVE && undone)
+    {
+      p = op->replacement_piece == op->next_piece ? NULL
+                                                  : op->replacement_piece;
+    }
+    else if(op->type == REMOVE || undone)
+    {
+      p = op->start_piece;
+      end = op->end_piece;
+    }
+    while(p)
+    {
+      piece* next_piece = p->next;
+      bool last = p == end || next_piece == op->next_piece;
+      piece_free(table, p);
+      p = last ? NULL : next_piece;
+    }
+
+    // text the operation took out is referenced by nothing else now
+    if(op->type == REMOVE ? !undone : undone)
+    {
+      table->add_buffer_kept_length -= op->add_length;
+      table->add_buffer_wasted_length += op->add_length;
+    }
+
+    if(undone)
+    {
+      table->redo_records_count--;
+      table->redo_records_bytes -= sizeof(operation);
+    }
+    else
+    {
+      table->undo_records_count--;
+      table->undo_records_bytes -= sizeof(operation);
+    }
+    table_free(table, op);
+    op = next;
+  }
+
+  return true;
+}
+
+unsigned int add_buffer_bytes_between(const piece* starting_piece,
+                                      const unsigned int starting_offset,
+                                      const piece* ending_piece,
+                                      const unsigned int ending_offset)
+{
+  if(starting_piece == ending_piece)
+  {
+    return starting_piece->buffer == ADD ? ending_offset - starting_offset : 0;
+  }
+
+  unsigned int length = starting_piece->buffer == ADD
+                          ? starting_piece->length - starting_offset
+                          : 0;
+  for(const piece* p = starting_piece->next; p != ending_piece; p = p->next)
+  {
+    if(p->buffer == ADD)
+    {
+      length += p->length;
+    }
+  }
+  if(ending_piece->buffer == ADD)
+  {
+    length += ending_offset;
+  }
+
+  return length;
+}
+
+bool append_to_add_buffer(piece_table* table,
+                          const char* string,
+                          const unsigned int length)
+{
+  if(!table)
+  {
+    return false;
+  }
+
+  if(!string)
+  {
+    return false;
+  }
+
+  text_buffer* buffer = table->sources[ADD];
+  unsigned int end = table->add_buffer_length;
+  if(length > UINT_MAX - end)
+  {
+    // positions in add buffer are unsigned int as well
+    errno = EFBIG;
+    return false;
+  }
+  if(!text_buffer_reserve(buffer, end, length))
+  {
+    // growing geometrically, so appends are amortized O(1)
+    unsigned int required_capacity = end + length;
+    unsigned int new_capacity = 64;
+    if(buffer->capacity > UINT_MAX / 2)
+    {
+      new_capacity = UINT_MAX;
+    }
+    else if(buffer->capacity)
+    {
+      new_capacity = buffer->capacity * 2;
+    }
+    if(new_capacity < required_capacity)
+    {
+      new_capacity = required_capacity;
+    }
+    // rounding up to whole huge pages must not wrap either
+    bool huge = table->huge_pages && new_capacity >= HUGE_PAGE_SIZE &&
+                new_capacity <= UINT_MAX - (HUGE_PAGE_SIZE - 1);
+    count_stat(table, add_buffer_reallocations, 1);
+    // realloc may move the text as well
+    count_stat(table, add_buffer_bytes_copied, end);
+
+    if(!huge && buffer->memory == BUFFER_MEMORY_ALLOCATOR &&
+       !text_buffer_is_shared(buffer))
+    {
+      // nothing else reads the buffer, so it can move
+      char* data =
+        (char*)table_realloc(table, buffer->data, sizeof(char) * new_capacity);
+      if(!data)
+      {
+        return false;
+      }
+      buffer->data = data;
+      buffer->capacity = new_capacity;
+    }
+    else
+    {
+      // copying own text into a new buffer,
+      // snapshots and clones keep reading the old one
+      text_buffer* grown = text_buffer_new(&table->allocator);
+      if(!grown)
+      {
+        return false;
+      }
+      if(huge)
+      {
+        // mapping whole huge pages
+        new_capacity =
+          (new_capacity + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+        grown->data = map_pages(new_capacity);
+        grown->memory = BUFFER_MEMORY_MAPPED_PAGES;
+      }
+      if(!grown->data)
+      {
+        grown->data = (char*)table_alloc(table, sizeof(char) * new_capacity);
+        grown->memory = BUFFER_MEMORY_ALLOCATOR;
+      }
+      if(!grown->data)
+      {
+        text_buffer_release(grown);
+        return false;
+      }
+      grown->capacity = new_capacity;
+      if(end)
+      {
+        memcpy(grown->data, buffer->data, end);
+      }
+
+      text_buffer_release(buffer);
+      table->sources[ADD] = buffer = grown;
+    }
+    buffer->length = end + length;
+  }
+  // text past end isn't referenced by anyone else, so appending is safe
+  memcpy(buffer->data + end, string, sizeof(char) * length);
+  table->add_buffer_length = end + length;
+  count_stat(table, add_buffer_bytes_appended, length);
+
+  return true;
+}
+
+/// Add Buffer Compaction Helpers Implementation
+bool collect_add_piece(const piece_table* table,
+                       piece*** pieces,
+                       unsigned int* count,
+                       unsigned int* capacity,
+                       piece* p)
+{
+  if(!p || p->buffer != ADD || p->length == 0)
+  {
+    return true;
+  }
+
+  if(*count == *capacity)
+  {
+    unsigned int new_capacity = *capacity ? *capacity * 2 : 64;
+    piece** temp =
+      (piece**)table_realloc(table, *pieces, sizeof(piece*) * new_capacity);
+    if(!temp)
+    {
+      return false;
+    }
+    *pieces = temp;
+    *capacity = new_capacity;
+  }
+
+  (*pieces)[(*count)++] = p;
+
+  return true;
+}
+
+bool collect_add_pieces_from_operations(const piece_table* table,
+                                        operation* op,
+                                        piece*** pieces,
+                                        unsigned int* count,
+                                        unsigned int* capacity)
+{
+  while(op)
+  {
+    if(!collect_add_piece(table, pieces, count, capacity, op->prev_piece) ||
+       !collect_add_piece(table, pieces, count, capacity, op->next_piece))
+    {
+      return false;
+    }
+
+    // start_piece..end_piece may be detached from the table
+    // so they are only reachable through this operation
+    piece* p = op->start_piece;
+    while(p)
+    {
+      if(!collect_add_piece(table, pieces, count, capacity, p))
+      {
+        return false;
+      }
+      if(p == op->end_piece)
+      {
+        break;
+      }
+      p = p->next;
+    }
+
+    for(p = op->replacement_piece; p && p != op->next_piece; p = p->next)
+    {
+      if(!collect_add_piece(table, pieces, count, capacity, p))
+      {
+        return false;
+      }
+    }
+
+    op = op->next;
+  }
+
+  return true;
+}
+
+bool collect_add_pieces(const piece_table* table,
+                        piece*** pieces,
+                        unsigned int* count)
+{
+  unsigned int capacity = 0;
+  *pieces = NULL;
+  *count = 0;
+
+  piece* p = table->pieces_head;
+  while(p)
+  {
+    if(!collect_add_piece(table, pieces, count, &capacity, p))
+    {
+      table_free(table, *pieces);
+      return false;
+    }
+    p = p->next;
+  }
+  if(!collect_add_pieces_from_operations(
+       table, table->undo_stack_top, pieces, count, &capacity) ||
+     !collect_add_pieces_from_operations(
+       table, table->redo_stack_top, pieces, count, &capacity))
+  {
+    table_free(table, *pieces);
+    return false;
+  }
+
+  if(*count == 0)
+  {
+    return true;
+  }
+
+  // same piece can be reachable from table and operations,
+  // it must be rewritten only once
+  qsort(*pieces, *count, sizeof(piece*), compare_piece_pointers);
+  unsigned int unique_count = 0;
+  for(unsigned int i = 0; i < *count; i++)
+  {
+    if(unique_count == 0 || (*pieces)[unique_count - 1] != (*pieces)[i])
+    {
+      (*pieces)[unique_count++] = (*pieces)[i];
+    }
+  }
+  *count = unique_count;
+
+  return true;
+}
+
+unsigned int merge_add_buffer_ranges(add_buffer_range* ranges,
+                                     const unsigned int count,
+                                     unsigned int* ranges_count)
+{
+  unsigned int merged_count = 0;
+  if(count == 0)
+  {
+    *ranges_count = 0;
+    return 0;
+  }
+
+  qsort(ranges, count, sizeof(add_buffer_range), compare_add_buffer_ranges);
+  unsigned int live_length = 0;
+  for(unsigned int i = 0; i < count; i++)
+  {
+    if(merged_count > 0 &&
+       ranges[i].start_position <= ranges[merged_count - 1].end_position)
+    {
+      add_buffer_range* last = &ranges[merged_count - 1];
+      if(ranges[i].end_position > last->end_position)
+      {
+        live_length += ranges[i].end_position - last->end_position;
+        last->end_position = ranges[i].end_position;
+      }
+      continue;
+    }
+    ranges[merged_count] = ranges[i];
+    ranges[merged_count].new_start_position = live_length;
+    live_length += ranges[i].end_position - ranges[i].start_position;
+    merged_count++;
+  }
+
+  *ranges_count = merged_count;
+  return live_length;
+}
+
+int compare_piece_pointers(const void* a, const void* b)
+{
+  const piece* pa = *(piece* const*)a;
+  const piece* pb = *(piece* const*)b;
+
+  return (pa > pb) - (pa < pb);
+}
+
+int compare_add_buffer_ranges(const void* a, const void* b)
+{
+  const add_buffer_range* ra = (const add_buffer_range*)a;
+  const add_buffer_range* rb = (const add_buffer_range*)b;
+
+  return (ra->start_position > rb->start_position) -
+         (ra->start_position < rb->start_position);
+}
+
+/// Piece Table API Implementation
 piece_table* piece_table_new()
 {
-  piece_table* table = (piece_table*)calloc(1, sizeof(piece_table));
+  return piece_table_new_with_allocator(NULL);
+}
+
+piece_table* piece_table_new_with_allocator(
+  const piece_table_allocator* allocator)
+{
+  piece_table_allocator table_allocator = {
+    default_alloc, default_realloc, default_free, NULL};
+  if(allocator)
+  {
+    if(!allocator->alloc || !allocator->realloc || !allocator->free)
+    {
+      return NULL;
+    }
+    table_allocator = *allocator;
+  }
+
+  piece_table* table = (piece_table*)table_allocator.alloc(
+    sizeof(piece_table), table_allocator.user_data);
+  if(!table)
+  {
+    return NULL;
+  }
+  memset(table, 0, sizeof(piece_table));
+
+  table->allocator = table_allocator;
+  table->lock = NULL;
+  table->loader = NULL;
+  table->sources = (text_buffer**)table_alloc(table, sizeof(text_buffer*) * 2);
+  if(!table->sources)
+  {
+    table_free(table, table);
+    return NULL;
+  }
+  table->sources_count = 2;
+  table->sources_capacity = 2;
+  table->sources[ORIGINAL] = text_buffer_new(&table->allocator);
+  table->sources[ADD] = text_buffer_new(&table->allocator);
+  if(!table->sources[ORIGINAL] || !table->sources[ADD])
+  {
+    table_release_sources(table);
+    table_free(table, table);
+    return NULL;
+  }
+  table->add_buffer_length = 0;
+  table->huge_pages = false;
+  table->pieces_head = NULL;
+  table->index = NULL;
+  table->lookups_since_mutation = 0;
+  table->cow_index = NULL;
+  // depreciated
+  table->undo_stack_top = NULL;
+  table->redo_stack_top = NULL;
+  // new operations
+  table->memsafe_undo_stack_top = NULL;
+  table->memsafe_redo_stack_top = NULL;
+  table->piece_with_micro_inserts = NULL;
+  table->undo_with_micro_inserts = NULL;
+  table->pieces_count = 0;
+  table->undo_records_count = 0;
+  table->undo_records_bytes = 0;
+  table->redo_records_count = 0;
+  table->redo_records_bytes = 0;
+
+  return table;
+}
+
+piece_table* piece_table_from_string(const char* string)
+{
+  return piece_table_from_string_with_allocator(string, NULL);
+}
+
+piece_table* piece_table_from_string_with_allocator(
+  const char* string,
+  const piece_table_allocator* allocator)
+{
+  if(!string)
+  {
+    return NULL;
+  }
+
+  piece_table* table = piece_table_new_with_allocator(allocator);
+  if(!table)
+  {
+    return NULL;
+  }
+
+  text_buffer* buffer = text_buffer_from_string(&table->allocator, string);
+  if(!buffer)
+  {
+    piece_table_free(table);
+    return NULL;
+  }
+  if(!table_set_original(table, buffer))
+  {
+    piece_table_free(table);
+    return NULL;
+  }
+
+  return table;
+}
+
+piece_table* piece_table_from_file(const char* path)
+{
+  if(!path)
+  {
+    return NULL;
+  }
+
+  piece_table* table = piece_table_new();
+  if(!table)
+  {
+    return NULL;
+  }
+
+  text_buffer* buffer = text_buffer_from_file(&table->allocator, path);
+  if(!buffer)
+  {
+    piece_table_free(table);
+    return NULL;
+  }
+  if(!table_set_original(table, buffer))
+  {
+    piece_table_free(table);
+    return NULL;
+  }
+
+  return table;
+}
+
+piece_table* piece_table_from_file_async(const char* path,
+                                         const unsigned int threads,
+                                         piece_table_progress progress,
+                                         piece_table_loaded loaded,
+                                         void* user_data)
+{
+  // mapping a file is O(1), pages are faulted in as text is read,
+  // so the table can be used right away while loading goes on
+  piece_table* table = piece_table_from_file(path);
+  if(!table)
+  {
+    return NULL;
+  }
+
+  if(!file_loader_start(table, threads, progress, loaded, user_data))
+  {
+    piece_table_free(table);
+    return NULL;
+  }
+
+  return table;
+}
+
+bool piece_table_insert_unlocked(piece_table* table,
+                                 const unsigned int position,
+                                 const char* string)
+{
+  if(!table)
+  {
+    return false;
+  }
+
+  // read before the index holding it is dropped
+  unsigned int length = table_text_length(table);
+
+  if(!invalidate_piece_index(table))
+  {
+    return false;
+  }
+
+  if(!string)
+  {
+    return false;
+  }
+
+  unsigned int remaining_offset = position;
+  unsigned int pieces_visited = 1;
+  piece* p = table->pieces_head;
+  while(p)
+  {
+    if(remaining_offset <= p->length)
+    {
+      break;
+    }
+    remaining_offset -= p->length;
+    p = p->next;
+    pieces_visited++;
+  }
+  count_stat(table, lookups, 1);
+  count_stat(table, pieces_visited, pieces_visited);
+
+  if(!p)
+  {
+    // position out of bounds
+    return false;
+  }
+
+  unsigned int string_length = strlen(string);
+  if(string_length > PIECE_TABLE_MAX_LENGTH - length)
+  {
+    errno = EFBIG;
+    return false;
+  }
+
+  // inserting memsafe operation
+  // as it is based on commad approach
+  // we don't care about how the pieces are mutated
+  // we just record the operation done
+  memsafe_operation* msop =
+    memsafe_operation_new(table, INSERT, position, 0, string);
+  if(msop)
+  {
+    record_memsafe_operation(table, msop);
+  }
+  else
+  {
+    printf("Unable to record INSERT operation onto undo stack");
+  }
+
+  unsigned int add_buffer_length = table->add_buffer_length;
+
+  if(!append_to_add_buffer(table, string, string_length))
+  {
+    return false;
+  }
+
+  // If we are inserting at end of any piece
+  if(remaining_offset == p->length)
+  {
+    // inserting at end
+    // just increase the length of the piece
+    // p->length += strlen(string);
+    // or insert a new piece (works best for undo & redo)
+    if(!insert_piece_after(
+         piece_new(table, ADD, add_buffer_length, string_length), p))
+    {
+      return false;
+    }
+
+    // inserting undo operation for this insert
+    // operation* op = operation_new(INSERT, p, p->next, p->next, p->next->next);
+    // if(op)
+    // {
+    //   push_operation_on_stack(&table->undo_stack_top, op);
+    // }
+    // else
+    // {
+    //   printf("Unable to record INSERT operation onto undo stack");
+    // }
+
+    table->text_length = length + string_length;
+    table->text_length_known = true;
+    return true;
+  }
+
+  if(remaining_offset == 0)
+  {
+    // insert new ADD buffer piece before current piece
+    piece* new_p = piece_new(table, ADD, add_buffer_length, string_length);
+    new_p->next = p;
+    if(p == table->pieces_head)
+    {
+      table->pieces_head = new_p;
+
+      // inserting undo operation for this insert
+      // operation* op = operation_new(INSERT, NULL, new_p, new_p, p);
+      // if(op)
+      // {
+      //   push_operation_on_stack(&table->undo_stack_top, op);
+      // }
+      // else
+      // {
+      //   printf("Unable to record INSERT operation onto undo stack");
+      // }
+
+      table->text_length = length + string_length;
+      table->text_length_known = true;
+      return true;
+    }
+    piece* temp = table->pieces_head;
+    while(temp->next != p)
+    {
+      temp = temp->next;
+    }
+    temp->next = new_p;
+
+    // inserting undo operation for this insert
+    // operation* op = operation_new(INSERT, temp, new_p, new_p, p);
+    // if(op)
+    // {
+    //   push_operation_on_stack(&table->undo_stack_top, op);
+    // }
+    // else
+    // {
+    //   printf("Unable to record INSERT operation onto undo stack");
+    // }
+
+    table->text_length = length + string_length;
+    table->text_length_known = true;
+    return true;
+  }
+
+  if(!split_piece_at(table, p, remaining_offset))
+  {
+    return false;
+  }
+  if(!insert_piece_after(
+       piece_new(table, ADD, add_buffer_length, string_length), p))
+  {
+    return false;
+  }
+
+  // inserting undo operation for this insert
+  // operation* op = operation_new(INSERT, p, p->next, p->next, p->next->next);
+  // if(op)
+  // {
+  //   push_operation_on_stack(&table->undo_stack_top, op);
+  // }
+  // else
+  // {
+  //   printf("Unable to record INSERT operation onto undo stack");
+  // }
+
+  table->text_length = length + string_length;
+  table->text_length_known = true;
+  return true;
+}
+
+bool piece_table_insert_file_unlocked(piece_table* table,
+                                      const unsigned int position,
+                                      const char* path)
+{
+  if(!table || !path)
+  {
+    return false;
+  }
+
+  // file becomes a source buffer of its own,
+  // so inserting it is a single piece however large it is
+  text_buffer* buffer = text_buffer_from_file(&table->allocator, path);
+  if(!buffer)
+  {
+    return false;
+  }
+
+  bool inserted = table_insert_source(table, position, buffer);
+  text_buffer_release(buffer);
+
+  return inserted;
+}
+
+bool piece_table_start_micro_inserts_unlocked(piece_table* table,
+                                              const unsigned int position)
+{
+  if(!table)
+  {
+    return false;
+  }
+
+  if(!invalidate_piece_index(table))
+  {
+    return false;
+  }
+
+  unsigned int remaining_offset = position;
+  unsigned int pieces_visited = 1;
+  piece* p = table->pieces_head;
+  while(p)
+  {
+    if(remaining_offset <= p->length)
+    {
+      break;
+    }
+    remaining_offset -= p->length;
+    p = p->next;
+    pieces_visited++;
+  }
+  count_stat(table, lookups, 1);
+  count_stat(table, pieces_visited, pieces_visited);
+
+  if(!p)
+  {
+    // position out of bounds
+    return false;
+  }
+
+  unsigned int add_buffer_length = table->add_buffer_length;
+
+  // If we are inserting at end of any piece
+  if(remaining_offset == p->length)
+  {
+    // inserting at end
+    // just increase the length of the piece
+    // p->length += strlen(string);
+    // or insert a new piece (works best for undo & redo)
+    if(!insert_piece_after(piece_new(table, ADD, add_buffer_length, 0), p))
+    {
+      return false;
+    }
+
+    // inserting undo operation for this insert
+    operation* op =
+      operation_new(table, INSERT, p, p->next, p->next, p->next->next);
+    if(op)
+    {
+      table->piece_with_micro_inserts = p->next;
+      table->undo_with_micro_inserts = op;
+      // push_operation_on_stack(&table->undo_stack_top, op);
+    }
+    else
+    {
+      printf("Unable to record INSERT operation onto undo stack");
+    }
+
+    return true;
+  }
+
+  if(remaining_offset == 0)
+  {
+    // insert new ADD buffer piece before current piece
+    piece* new_p = piece_new(table, ADD, add_buffer_length, 0);
+    new_p->next = p;
+    if(p == table->pieces_head)
+    {
+      table->pieces_head = new_p;
+
+      // inserting undo operation for this insert
+      operation* op = operation_new(table, INSERT, NULL, new_p, new_p, p);
+      if(op)
+      {
+        table->piece_with_micro_inserts = new_p;
+        table->undo_with_micro_inserts = op;
+        // push_operation_on_stack(&table->undo_stack_top, op);
+      }
+      else
+      {
+        printf("Unable to record INSERT operation onto undo stack");
+      }
+
+      return true;
+    }
+    piece* temp = table->pieces_head;
+    while(temp->next != p)
+    {
+      temp = temp->next;
+    }
+    temp->next = new_p;
+
+    // inserting undo operation for this insert
+    operation* op = operation_new(table, INSERT, temp, new_p, new_p, p);
+    if(op)
+    {
+      table->piece_with_micro_inserts = new_p;
+      table->undo_with_micro_inserts = op;
+      // push_operation_on_stack(&table->undo_stack_top, op);
+    }
+    else
+    {
+      printf("Unable to record INSERT operation onto undo stack");
+    }
+
+    return true;
+  }
+
+  if(!split_piece_at(table, p, remaining_offset))
+  {
+    return false;
+  }
+  if(!insert_piece_after(piece_new(table, ADD, add_buffer_length, 0), p))
+  {
+    return false;
+  }
+
+  // inserting undo operation for this insert
+  operation* op =
+    operation_new(table, INSERT, p, p->next, p->next, p->next->next);
+  if(op)
+  {
+    table->piece_with_micro_inserts = p->next;
+    table->undo_with_micro_inserts = op;
+    // push_operation_on_stack(&table->undo_stack_top, op);
+  }
+  else
+  {
+    printf("Unable to record INSERT operation onto undo stack");
+  }
+
+  return true;
+}
+
+bool piece_table_micro_insert_unlocked(piece_table* table, const char* string)
+{
+  if(!table)
+  {
+    return false;
+  }
+
+  // read before the index holding it is dropped
+  unsigned int length = table_text_length(table);
+
+  if(!invalidate_piece_index(table))
+  {
+    return false;
+  }
+
+  if(!string)
+  {
+    return false;
+  }
+
+  if(!table->piece_with_micro_inserts)
+  {
+    return false;
+  }
+
+  if(!table->undo_with_micro_inserts)
+  {
+    return false;
+  }
+
+  unsigned int string_length = strlen(string);
+  if(string_length > PIECE_TABLE_MAX_LENGTH - length)
+  {
+    errno = EFBIG;
+    return false;
+  }
+
+  if(!append_to_add_buffer(table, string, string_length))
+  {
+    return false;
+  }
+
+  table->piece_with_micro_inserts->length += string_length;
+  table->undo_with_micro_inserts->add_length += string_length;
+  table->text_length = length + string_length;
+  table->text_length_known = true;
+
+  return true;
+}
+
+bool piece_table_stop_micro_inserts_unlocked(piece_table* table)
+{
   if(!table)
   {
-    return NULL;
+    return false;
   }
 
-  table->original_buffer = NULL;
-  table->add_buffer = NULL;
-  table->pieces_head = NULL;
-  // depreciated
-  table->undo_stack_top = NULL;
-  table->redo_stack_top = NULL;
-  // new operations
-  table->memsafe_undo_stack_top = NULL;
-  table->memsafe_redo_stack_top = NULL;
+  if(!table->undo_with_micro_inserts)
+  {
+    return false;
+  }
+
+  if(!record_operation(table, table->undo_with_micro_inserts))
+  {
+    return false;
+  }
+
+  // Clearing micro insert session
   table->piece_with_micro_inserts = NULL;
   table->undo_with_micro_inserts = NULL;
 
-  return table;
+  return true;
 }
 
-piece_table* piece_table_from_string(const char* string)
+bool piece_table_remove_unlocked(piece_table* table,
+                                 const unsigned int position,
+                                 const unsigned int length)
 {
-  if(!string)
+  if(!table)
   {
-    return NULL;
+    return false;
   }
 
-  piece_table* table = piece_table_new();
-  if(!table)
+  // kept only when known, removes don't need it
+  bool text_length_known = table->text_length_known;
+  unsigned int text_length = table->text_length;
+
+  if(!invalidate_piece_index(table))
   {
-    return NULL;
+    return false;
   }
 
-  table->original_buffer = strdup(string);
-  if(!table->original_buffer)
+  if(length == 0)
   {
-    return NULL;
+    table->text_length_known = text_length_known;
+    return true;
+  }
+
+  // finding starting & ending pieces of removed range
+  piece* prev_piece = NULL;
+  piece* starting_piece = table->pieces_head;
+  unsigned int starting_piece_offset = position;
+  unsigned int pieces_visited = 1;
+  while(starting_piece && starting_piece_offset >= starting_piece->length)
+  {
+    starting_piece_offset -= starting_piece->length;
+    prev_piece = starting_piece;
+    starting_piece = starting_piece->next;
+    pieces_visited++;
+  }
+  count_stat(table, lookups, 1);
+  count_stat(table, pieces_visited, pieces_visited);
+  if(!starting_piece)
+  {
+    // position out of bounds
+    return false;
+  }
+
+  piece* ending_piece = starting_piece;
+  unsigned int ending_piece_offset = starting_piece_offset + length;
+  while(ending_piece && ending_piece_offset > ending_piece->length)
+  {
+    ending_piece_offset -= ending_piece->length;
+    ending_piece = ending_piece->next;
+  }
+  if(!ending_piece || starting_piece_offset + length < length)
+  {
+    // length out of bounds
+    return false;
+  }
+  piece* next_piece = ending_piece->next;
+  unsigned int add_length = add_buffer_bytes_between(
+    starting_piece, starting_piece_offset, ending_piece, ending_piece_offset);
+
+  // pieces of the range are left untouched for undo & redo,
+  // parts of starting & ending pieces outside it become new pieces
+  piece* replacement_piece = next_piece;
+  if(ending_piece_offset < ending_piece->length)
+  {
+    replacement_piece =
+      piece_new(table,
+                ending_piece->buffer,
+                ending_piece->start_position + ending_piece_offset,
+                ending_piece->length - ending_piece_offset);
+    if(!replacement_piece)
+    {
+      return false;
+    }
+    replacement_piece->next = next_piece;
+    count_stat(table, splits, 1);
+  }
+  if(starting_piece_offset > 0)
+  {
+    piece* left_piece = piece_new(table,
+                                  starting_piece->buffer,
+                                  starting_piece->start_position,
+                                  starting_piece_offset);
+    if(!left_piece)
+    {
+      if(replacement_piece != next_piece)
+      {
+        piece_free(table, replacement_piece);
+      }
+      return false;
+    }
+    left_piece->next = replacement_piece;
+    replacement_piece = left_piece;
+    count_stat(table, splits, 1);
   }
 
-  table->pieces_head = piece_new(ORIGINAL, 0, strlen(string));
+  // virtually removing the pieces, the operation keeps them
+  if(prev_piece)
+  {
+    prev_piece->next = replacement_piece;
+  }
+  else
+  {
+    table->pieces_head = replacement_piece;
+  }
   if(!table->pieces_head)
   {
-    return NULL;
+    // whole text was removed
+    if(!ensure_piece(table))
+    {
+      return false;
+    }
+    replacement_piece = table->pieces_head;
   }
 
-  return table;
+  operation* op = operation_new(
+    table, REMOVE, prev_piece, starting_piece, ending_piece, next_piece);
+  if(op)
+  {
+    op->replacement_piece = replacement_piece;
+    op->add_length = add_length;
+    record_operation(table, op);
+    table->add_buffer_kept_length += add_length;
+  }
+  else
+  {
+    printf("Unable to record REMOVE operation!\n");
+    table->add_buffer_wasted_length += add_length;
+  }
+
+  table->text_length = text_length - length;
+  table->text_length_known = text_length_known;
+
+  return true;
 }
 
-bool piece_table_insert(piece_table* table,
-                        const unsigned int position,
-                        const char* string)
+char piece_table_get_char_at_unlocked(const piece_table* table,
+                                      const unsigned int position)
 {
   if(!table)
   {
-    return false;
+    return '\0';
   }
 
-  if(!string)
+  count_stat(table, lookups, 1);
+  const piece_index* index = get_piece_index(table);
+  if(index)
   {
-    return false;
+    count_stat(table, pieces_visited, piece_index_search_steps(index));
+    return piece_index_get_char_at(index, position);
   }
 
   unsigned int remaining_offset = position;
-  piece* p = table->pieces_head;
+  piece* p = get_pieces(table);
   while(p)
   {
-    if(remaining_offset <= p->length)
+    count_stat(table, pieces_visited, 1);
+    if(remaining_offset < p->length)
     {
-      break;
+      return table->sources[p->buffer]->data[p->start_position + remaining_offset];
     }
     remaining_offset -= p->length;
     p = p->next;
   }
 
-  if(!p)
-  {
-    // position out of bounds
-    return false;
-  }
+  return '\0';
+}
 
-  // inserting memsafe operation
-  // as it is based on commad approach
-  // we don't care about how the pieces are mutated
-  // we just record the operation done
-  memsafe_operation* msop = memsafe_operation_new(INSERT, position, 0, string);
-  if(msop)
+char* piece_table_get_slice_unlocked(const piece_table* table,
+                                     const unsigned int position,
+                                     const unsigned int length)
+{
+  if(!table)
   {
-    push_memsafe_operation_on_stack(&table->memsafe_undo_stack_top, msop);
+    return NULL;
   }
-  else
+
+  count_stat(table, lookups, 1);
+  const piece_index* index = get_piece_index(table);
+  if(index)
   {
-    printf("Unable to record INSERT operation onto undo stack");
+    count_stat(table, pieces_visited, piece_index_search_steps(index));
+    return piece_index_get_slice(index, position, length);
   }
 
-  unsigned int add_buffer_length =
-    table->add_buffer ? strlen(table->add_buffer) : 0;
-  unsigned int string_length = strlen(string);
-  unsigned int new_add_buffer_length = add_buffer_length + string_length + 1;
+  piece* starting_piece = NULL;
+  piece* ending_piece = NULL;
+  unsigned int starting_piece_offset = 0, ending_piece_offset = 0;
 
-  if(!table->add_buffer)
+  starting_piece_offset = position;
+  piece* p = get_pieces(table);
+  while(p)
   {
-    table->add_buffer = strdup(string);
-    if(!table->add_buffer)
+    count_stat(table, pieces_visited, 1);
+    if(starting_piece_offset <= p->length)
     {
-      return false;
+      break;
     }
+    starting_piece_offset -= p->length;
+    p = p->next;
   }
-  else
+  if(!p)
   {
-    char* temp =
-      (char*)realloc(table->add_buffer, sizeof(char) * new_add_buffer_length);
-    if(!temp)
-    {
-      return false;
-    }
-    table->add_buffer = temp;
-    memcpy(table->add_buffer + add_buffer_length,
-           string,
-           sizeof(char) * string_length);
-    table->add_buffer[new_add_buffer_length - 1] = '\0';
+    // starting position out of bounds
+    return NULL;
   }
+  starting_piece = p;
 
-  // If we are inserting at end of any piece
-  if(remaining_offset == p->length)
+  p = get_pieces(table);
+  ending_piece_offset = position + length;
+  while(p)
   {
-    // inserting at end
-    // just increase the length of the piece
-    // p->length += strlen(string);
-    // or insert a new piece (works best for undo & redo)
-    if(!insert_piece_after(piece_new(ADD, add_buffer_length, string_length), p))
+    count_stat(table, pieces_visited, 1);
+    if(ending_piece_offset <= p->length)
     {
-      return false;
+      break;
     }
+    ending_piece_offset -= p->length;
+    p = p->next;
+  }
+  if(!p)
+  {
+    // starting position or length out of bounds
+    return NULL;
+  }
+  ending_piece = p;
 
-    // inserting undo operation for this insert
-    // operation* op = operation_new(INSERT, p, p->next, p->next, p->next->next);
-    // if(op)
-    // {
-    //   push_operation_on_stack(&table->undo_stack_top, op);
-    // }
-    // else
-    // {
-    //   printf("Unable to record INSERT operation onto undo stack");
-    // }
+  char* slice = (char*)calloc(length + 1, sizeof(char));
+  if(!slice)
+  {
+    return NULL;
+  }
 
-    return true;
+  if(starting_piece == ending_piece)
+  {
+    memcpy(slice,
+           table->sources[starting_piece->buffer]->data +
+             starting_piece->start_position + starting_piece_offset,
+           length);
+    slice[length] = '\0';
+    return slice;
   }
 
-  if(remaining_offset == 0)
+  unsigned int destination_copy_offset = 0;
+  memcpy(slice,
+         table->sources[starting_piece->buffer]->data +
+           starting_piece->start_position + starting_piece_offset,
+         starting_piece->length - starting_piece_offset);
+
+  destination_copy_offset += starting_piece->length - starting_piece_offset;
+  p = starting_piece->next;
+
+  while(p != ending_piece)
   {
-    // insert new ADD buffer piece before current piece
-    piece* new_p = piece_new(ADD, add_buffer_length, string_length);
-    new_p->next = p;
-    if(p == table->pieces_head)
-    {
-      table->pieces_head = new_p;
+    char* source =
+      table->sources[p->buffer]->data;
+    memcpy(
+      slice + destination_copy_offset, source + p->start_position, p->length);
+    destination_copy_offset += p->length;
+    p = p->next;
+  }
 
-      // inserting undo operation for this insert
-      // operation* op = operation_new(INSERT, NULL, new_p, new_p, p);
-      // if(op)
-      // {
-      //   push_operation_on_stack(&table->undo_stack_top, op);
-      // }
-      // else
-      // {
-      //   printf("Unable to record INSERT operation onto undo stack");
-      // }
+  memcpy(slice + destination_copy_offset,
+         table->sources[ending_piece->buffer]->data +
+           ending_piece->start_position,
+         sizeof(char) * ending_piece_offset);
 
-      return true;
-    }
-    piece* temp = table->pieces_head;
-    while(temp->next != p)
-    {
-      temp = temp->next;
-    }
-    temp->next = new_p;
+  slice[length] = '\0';
+  return slice;
+}
 
-    // inserting undo operation for this insert
-    // operation* op = operation_new(INSERT, temp, new_p, new_p, p);
-    // if(op)
-    // {
-    //   push_operation_on_stack(&table->undo_stack_top, op);
-    // }
-    // else
-    // {
-    //   printf("Unable to record INSERT operation onto undo stack");
-    // }
+char* piece_table_to_string_unlocked(const piece_table* table)
+{
+  if(!table)
+  {
+    return NULL;
+  }
 
-    return true;
+  const piece_index* index = get_piece_index(table);
+  if(index)
+  {
+    return piece_index_get_slice(index, 0, index->length);
   }
 
-  if(!split_piece_at(p, remaining_offset))
+  unsigned int string_length = 0;
+  piece* p = get_pieces(table);
+  while(p)
   {
-    return false;
+    string_length += p->length;
+    p = p->next;
   }
-  if(!insert_piece_after(piece_new(ADD, add_buffer_length, string_length), p))
+
+  char* string = (char*)calloc((string_length + 1), sizeof(char));
+  if(!string)
   {
-    return false;
+    return NULL;
   }
 
-  // inserting undo operation for this insert
-  // operation* op = operation_new(INSERT, p, p->next, p->next, p->next->next);
-  // if(op)
-  // {
-  //   push_operation_on_stack(&table->undo_stack_top, op);
-  // }
-  // else
-  // {
-  //   printf("Unable to record INSERT operation onto undo stack");
-  // }
+  p = get_pieces(table);
+  unsigned int string_back = 0;
+  while(p)
+  {
+    char* source_string =
+      table->sources[p->buffer]->data;
+    memcpy(string + string_back, source_string + p->start_position, p->length);
+    string_back += p->length;
+    p = p->next;
+  }
+  string[string_length] = '\0';
 
-  return true;
+  return string;
 }
 
-bool piece_table_start_micro_inserts(piece_table* table,
-                                     const unsigned int position)
+int piece_table_get_length_unlocked(const piece_table* table)
 {
   if(!table)
   {
-    return false;
+    return -1;
   }
 
-  unsigned int remaining_offset = position;
-  piece* p = table->pieces_head;
+  const piece_index* index = get_piece_index(table);
+  if(index)
+  {
+    return index->length;
+  }
+
+  int length = 0;
+  piece* p = get_pieces(table);
   while(p)
   {
-    if(remaining_offset <= p->length)
-    {
-      break;
-    }
-    remaining_offset -= p->length;
+    length += p->length;
     p = p->next;
   }
 
-  if(!p)
+  return length;
+}
+
+char* piece_table_get_line_unlocked(const piece_table* table,
+                                    const unsigned int line)
+{
+  if(!table)
   {
-    // position out of bounds
-    return false;
+    return NULL;
   }
 
-  unsigned int add_buffer_length =
-    table->add_buffer ? strlen(table->add_buffer) : 0;
-
-  // If we are inserting at end of any piece
-  if(remaining_offset == p->length)
+  // line starts right after newline line - 1, lines are counted from 1.
+  // Newlines of pieces are counted with line indexes of their buffers
+  // where built, so only the last piece is searched.
+  unsigned int newlines_before_line = line > 1 ? line - 1 : 0;
+  unsigned int line_start = 0;
+  unsigned int piece_offset = 0;
+  piece* p = get_pieces(table);
+  count_stat(table, lookups, 1);
+  while(newlines_before_line > 0)
   {
-    // inserting at end
-    // just increase the length of the piece
-    // p->length += strlen(string);
-    // or insert a new piece (works best for undo & redo)
-    if(!insert_piece_after(piece_new(ADD, add_buffer_length, 0), p))
+    if(!p)
     {
-      return false;
+      // line is out of bounds
+      return NULL;
     }
+    count_stat(table, pieces_visited, 1);
 
-    // inserting undo operation for this insert
-    operation* op = operation_new(INSERT, p, p->next, p->next, p->next->next);
-    if(op)
-    {
-      table->piece_with_micro_inserts = p->next;
-      table->undo_with_micro_inserts = op;
-      // push_operation_on_stack(&table->undo_stack_top, op);
-    }
-    else
+    const text_buffer* buffer = table->sources[p->buffer];
+    unsigned int piece_end = p->start_position + p->length;
+    unsigned int newlines =
+      source_count_newlines(buffer, p->start_position, piece_end);
+    if(newlines >= newlines_before_line)
     {
-      printf("Unable to record INSERT operation onto undo stack");
+      unsigned int newline = source_find_newline(
+        buffer, p->start_position, piece_end, newlines_before_line);
+      piece_offset = newline - p->start_position + 1;
+      line_start += piece_offset;
+      break;
     }
 
-    return true;
+    newlines_before_line -= newlines;
+    line_start += p->length;
+    p = p->next;
   }
 
-  if(remaining_offset == 0)
+  // line ends right before the next newline or at end of text
+  unsigned int line_length = 0;
+  while(p)
   {
-    // insert new ADD buffer piece before current piece
-    piece* new_p = piece_new(ADD, add_buffer_length, 0);
-    new_p->next = p;
-    if(p == table->pieces_head)
-    {
-      table->pieces_head = new_p;
-
-      // inserting undo operation for this insert
-      operation* op = operation_new(INSERT, NULL, new_p, new_p, p);
-      if(op)
-      {
-        table->piece_with_micro_inserts = new_p;
-        table->undo_with_micro_inserts = op;
-        // push_operation_on_stack(&table->undo_stack_top, op);
-      }
-      else
-      {
-        printf("Unable to record INSERT operation onto undo stack");
-      }
-
-      return true;
-    }
-    piece* temp = table->pieces_head;
-    while(temp->next != p)
-    {
-      temp = temp->next;
-    }
-    temp->next = new_p;
-
-    // inserting undo operation for this insert
-    operation* op = operation_new(INSERT, temp, new_p, new_p, p);
-    if(op)
-    {
-      table->piece_with_micro_inserts = new_p;
-      table->undo_with_micro_inserts = op;
-      // push_operation_on_stack(&table->undo_stack_top, op);
-    }
-    else
+    const text_buffer* buffer = table->sources[p->buffer];
+    unsigned int start = p->start_position + piece_offset;
+    unsigned int piece_end = p->start_position + p->length;
+    unsigned int newline = source_find_newline(buffer, start, piece_end, 1);
+    line_length += newline - start;
+    if(newline < piece_end)
     {
-      printf("Unable to record INSERT operation onto undo stack");
+      break;
     }
 
-    return true;
+    piece_offset = 0;
+    p = p->next;
   }
 
-  if(!split_piece_at(p, remaining_offset))
+  return piece_table_get_slice_unlocked(table, line_start, line_length);
+}
+
+bool piece_table_replace_unlocked(piece_table* table,
+                                  const unsigned int position,
+                                  const unsigned int length,
+                                  const char* string)
+{
+  if(!table)
   {
     return false;
   }
-  if(!insert_piece_after(piece_new(ADD, add_buffer_length, 0), p))
+
+  if(!string)
   {
     return false;
   }
 
-  // inserting undo operation for this insert
-  operation* op = operation_new(INSERT, p, p->next, p->next, p->next->next);
-  if(op)
+  if(!piece_table_remove_unlocked(table, position, length))
   {
-    table->piece_with_micro_inserts = p->next;
-    table->undo_with_micro_inserts = op;
-    // push_operation_on_stack(&table->undo_stack_top, op);
+    return false;
   }
-  else
+
+  if(!piece_table_insert_unlocked(table, position, string))
   {
-    printf("Unable to record INSERT operation onto undo stack");
+    return false;
   }
 
   return true;
 }
 
-bool piece_table_micro_insert(piece_table* table, const char* string)
+bool piece_table_undo_unlocked(piece_table* table)
 {
   if(!table)
   {
     return false;
   }
 
-  if(!string)
-  {
-    return false;
-  }
-
-  if(!table->piece_with_micro_inserts)
+  if(!invalidate_piece_index(table))
   {
     return false;
   }
 
-  if(!table->undo_with_micro_inserts)
+  if(!table->undo_stack_top)
   {
     return false;
   }
 
-  unsigned int add_buffer_length =
-    table->add_buffer ? strlen(table->add_buffer) : 0;
-  unsigned int string_length = strlen(string);
-  unsigned int new_add_buffer_length = add_buffer_length + string_length + 1;
-
-  if(!table->add_buffer)
+  operation* op = table->undo_stack_top;
+  if(op->type == REMOVE)
   {
-    table->add_buffer = strdup(string);
-    if(!table->add_buffer)
+    // putting removed pieces back in place of their replacements,
+    // end_piece still links to next_piece
+    if(!op->prev_piece)
     {
-      return false;
+      table->pieces_head = op->start_piece;
+    }
+    else
+    {
+      op->prev_piece->next = op->start_piece;
     }
+    table->add_buffer_kept_length -= op->add_length;
   }
   else
   {
-    char* temp =
-      (char*)realloc(table->add_buffer, sizeof(char) * new_add_buffer_length);
-    if(!temp)
+    // virtually removing the inserted piece
+    // by connecting prev_piece, next_piece
+    if(!op->prev_piece)
     {
-      return false;
+      table->pieces_head = op->next_piece;
+    }
+    else
+    {
+      op->prev_piece->next = op->next_piece;
     }
-    table->add_buffer = temp;
-    memcpy(table->add_buffer + add_buffer_length,
-           string,
-           sizeof(char) * string_length);
-    table->add_buffer[new_add_buffer_length - 1] = '\0';
+    table->add_buffer_kept_length += op->add_length;
   }
 
-  table->piece_with_micro_inserts->length += string_length;
+  if(!move_operation_from_undo_to_redo_stack(table))
+  {
+    return false;
+  }
 
   return true;
 }
 
-bool piece_table_stop_micro_inserts(piece_table* table)
+bool piece_table_redo_unlocked(piece_table* table)
 {
   if(!table)
   {
     return false;
   }
 
-  if(!table->undo_with_micro_inserts)
+  if(!invalidate_piece_index(table))
   {
     return false;
   }
 
-  if(!push_operation_on_stack(&table->undo_stack_top,
-                              table->undo_with_micro_inserts))
+  if(!table->redo_stack_top)
   {
     return false;
   }
 
-  // Clearing micro insert session
-  table->piece_with_micro_inserts = NULL;
-  table->undo_with_micro_inserts = NULL;
+  operation* op = table->redo_stack_top;
+  if(op->type == REMOVE)
+  {
+    // virtually removing pieces again
+    if(!op->prev_piece)
+    {
+      table->pieces_head = op->replacement_piece;
+    }
+    else
+    {
+      op->prev_piece->next = op->replacement_piece;
+    }
+    table->add_buffer_kept_length += op->add_length;
+  }
+  else
+  {
+    // inserting pieces from start_piece to end_piece
+    // between prev_piece and next_piece
+    if(!op->prev_piece)
+    {
+      table->pieces_head = op->start_piece;
+    }
+    else
+    {
+      op->prev_piece->next = op->start_piece;
+    }
+    op->end_piece->next = op->next_piece;
+    table->add_buffer_kept_length -= op->add_length;
+  }
+
+  if(!move_operation_from_redo_to_undo_stack(table))
+  {
+    return false;
+  }
 
   return true;
 }
 
-bool piece_table_remove(piece_table* table,
-                        const unsigned int position,
-                        const unsigned int length)
+bool piece_table_memsafe_remove_unlocked(piece_table* table,
+                                         const unsigned int position,
+                                         const unsigned int length)
 {
   if(!table)
   {
     return false;
   }
 
+  return memsafe_remove_slice(table, position, length, true);
+}
+
+bool memsafe_remove_slice(piece_table* table,
+                          const unsigned int position,
+                          const unsigned int length,
+                          const bool record)
+{
+  if(!invalidate_piece_index(table))
+  {
+    return false;
+  }
+
   piece* starting_piece = NULL;
   piece* ending_piece = NULL;
   unsigned int starting_piece_offset = 0, ending_piece_offset = 0;
@@ -1147,52 +5664,32 @@ bool piece_table_remove(piece_table* table,
   }
   ending_piece = p;
 
+  // memsafe operations keep copies of text, not add buffer bytes
+  table->add_buffer_wasted_length += add_buffer_bytes_between(
+    starting_piece, starting_piece_offset, ending_piece, ending_piece_offset);
+
+  if(record)
+  {
+    printf("HEHEHEEEHEHHEEHE\n");
+    memsafe_operation* msop =
+      memsafe_operation_new(table, REMOVE, position, length, NULL);
+    if(msop)
+    {
+      record_memsafe_operation(table, msop);
+    }
+    else
+    {
+      printf("Unable to record REMOVE operation!\n");
+    }
+  }
+
   // removal happening in same piece
   if(starting_piece == ending_piece)
   {
     // removal happening at the end
     if(starting_piece_offset + length == p->length)
     {
-      // we can just change the length of the piece
-      // does not work for undo & redo
-      // starting_piece->length -= length;
-
-      // split piece at starting piece offset
-      if(!split_piece_at(starting_piece, starting_piece_offset))
-      {
-        return false;
-      }
-
-      piece* op_starting_piece = starting_piece;
-      if(starting_piece->length == 0)
-      {
-        piece* op_starting_piece = table->pieces_head;
-        while(op_starting_piece->next != starting_piece)
-        {
-          op_starting_piece = op_starting_piece->next;
-        }
-        remove_piece_from_table(table, starting_piece);
-      }
-
-      // inserting undo operation for this remove
-      operation* op = operation_new(REMOVE,
-                                    op_starting_piece,
-                                    op_starting_piece->next,
-                                    op_starting_piece->next,
-                                    op_starting_piece->next->next);
-      if(op)
-      {
-        push_operation_on_stack(&table->undo_stack_top, op);
-      }
-      else
-      {
-        printf("Unable to record REMOVE operation!\n");
-      }
-
-      // virtually removing the piece to be removed
-      // by connecting starting piece and piece next to removable piece
-      op_starting_piece->next = op_starting_piece->next->next;
-
+      starting_piece->length -= length;
       return true;
     }
 
@@ -1202,787 +5699,1184 @@ bool piece_table_remove(piece_table* table,
     // we need to split twice at starting_offset, starting_offset+length
     // the virtuall remove the middle piece
     // by connecting the starting end ending pieces among splitted pieces.
-    if(!split_piece_at(starting_piece, starting_piece_offset + length))
+    if(!split_piece_at(table, starting_piece, starting_piece_offset + length))
     {
       return false;
     }
     // starting_piece->length -= length;
-    if(starting_piece_offset != 0 &&
-       !split_piece_at(starting_piece, starting_piece_offset))
+    if(!split_piece_at(table, starting_piece, starting_piece_offset))
     {
       return false;
     }
 
-    piece* op_starting_piece = starting_piece;
-    if(starting_piece_offset == 0 || starting_piece->length == 0)
-    {
-      // find piece before starting piece
-      // it will be the previous piece for the operation
-      if(starting_piece == table->pieces_head)
-      {
-        op_starting_piece = NULL;
-      }
-      else
-      {
-        op_starting_piece = table->pieces_head;
-        while(op_starting_piece && op_starting_piece->next != starting_piece)
-        {
-          op_starting_piece = op_starting_piece->next;
-        }
-        remove_piece_from_table(table, starting_piece);
-      }
-    }
+    remove_piece_from_table(table, starting_piece->next);
 
-    operation* op = NULL;
-    if(op_starting_piece)
-    {
-      op = operation_new(REMOVE,
-                         op_starting_piece,
-                         op_starting_piece->next,
-                         op_starting_piece->next,
-                         op_starting_piece->next->next);
-    }
-    else
-    {
-      op = operation_new(REMOVE,
-                         op_starting_piece,
-                         starting_piece,
-                         starting_piece,
-                         starting_piece->next);
-    }
-    if(op)
-    {
-      push_operation_on_stack(&table->undo_stack_top, op);
-    }
-    else
-    {
-      printf("Unable to record REMOVE operation!\n");
-    }
+    return true;
+  }
 
-    // virtually removing the piece to be removed
-    // by connecting starting piece and piece next to removable piece
-    if(op_starting_piece)
-    {
-      op_starting_piece->next = op_starting_piece->next->next;
-    }
-    else
-    {
-      table->pieces_head = starting_piece->next;
-    }
+  // here arise two cases:
+  // - starting and ending pieces are next to each other
+  // - some piece exist between starting and ending pieces
+  // in either case we could just split pieces as:
+  // - starting piece at starting piece offset (resulting in 1, 2)
+  // - ending piece at ending piece offset (resulting in 3, 4)
+  // then virtually remove pieces between: 1, 4
+  // this removes complexity of handling pieces between 2, 3
+
+  if(starting_piece_offset != starting_piece->length &&
+     !split_piece_at(table, starting_piece, starting_piece_offset))
+  {
+    return false;
+  }
+  // if(starting_piece->next->length == 0)
+  // {
+  //   remove_piece_from_table(table, starting_piece->next);
+  // }
+  if(ending_piece_offset != ending_piece->length &&
+     !split_piece_at(table, ending_piece, ending_piece_offset))
+  {
+    printf("ending_piece_offset = %d, ending_piece_length = %d\n",
+           ending_piece_offset,
+           ending_piece->length);
+    return false;
+  }
+  // if(ending_piece->next->length == 0)
+  // {
+  //   remove_piece_from_table(table, ending_piece->next);
+  // }
 
+  if(starting_piece->next == ending_piece)
+  {
+    remove_piece_from_table(table, ending_piece);
     return true;
   }
 
-  // here arise two cases:
-  // - starting and ending pieces are next to each other
-  // - some piece exist between starting and ending pieces
-  // in either case we could just split pieces as:
-  // - starting piece at starting piece offset (resulting in 1, 2)
-  // - ending piece at ending piece offset (resulting in 3, 4)
-  // then virtually remove pieces between: 1, 4
-  // this removes complexity of handling pieces between 2, 3
-
-  if(!split_piece_at(starting_piece, starting_piece_offset))
+  p = starting_piece->next;
+  piece* pnext = NULL;
+  while(p != ending_piece)
   {
-    return false;
+    piece_free(table, pnext);
+    pnext = p;
+    p = p->next;
   }
+  piece_free(table, pnext);
+  starting_piece->next = ending_piece->next;
+  piece_free(table, p);
+
+  return true;
+}
 
-  piece* op_starting_piece = starting_piece;
-  if(starting_piece->length == 0)
+bool piece_table_memsafe_undo_unlocked(piece_table* table)
+{
+  if(!table)
   {
-    op_starting_piece = table->pieces_head;
-    while(op_starting_piece->next != starting_piece)
-    {
-      op_starting_piece = op_starting_piece->next;
-    }
-    remove_piece_from_table(table, starting_piece);
+    return false;
   }
 
-  if(!split_piece_at(ending_piece, ending_piece_offset))
+  if(!invalidate_piece_index(table))
   {
     return false;
   }
 
-  piece* op_ending_piece = ending_piece;
-  if(ending_piece->length == 0)
+  if(!table->memsafe_undo_stack_top)
   {
-    op_ending_piece = table->pieces_head;
-    while(op_ending_piece->next != ending_piece)
-    {
-      op_ending_piece = op_ending_piece->next;
-    }
-    remove_piece_from_table(table, ending_piece);
+    return false;
   }
 
-  operation* op = operation_new(REMOVE,
-                                op_starting_piece,
-                                op_starting_piece->next,
-                                op_ending_piece,
-                                op_ending_piece->next);
-  if(op)
+  // REMOVE operations don't keep removed text, so only inserts are undone
+  memsafe_operation* op = table->memsafe_undo_stack_top;
+  if(op->type == INSERT &&
+     !memsafe_remove_slice(table,
+                           op->start_position,
+                           op->string ? strlen(op->string) : op->length,
+                           false))
   {
-    push_operation_on_stack(&table->undo_stack_top, op);
+    return false;
   }
-  else
+
+  if(!move_memsafe_operation_from_undo_to_redo_stack(table))
   {
-    printf("Unable to record REMOVE operation!\n");
+    return false;
   }
 
-  // // remove all pieces lying between starting, ending pieces
-  // // adjust length of starting piece
-  // // adjust starting_position of ending piece
-  // if(starting_piece->next != ending_piece)
-  // {
-  //   if(!remove_slice_between_pieces(starting_piece, ending_piece))
-  //   {
-  //     return false;
-  //   }
-  // }
-
-  // starting_piece->length = starting_piece_offset;
-  // if(starting_piece->length == 0)
-  // {
-  //   remove_piece_from_table(table, starting_piece);
-  // }
-  // ending_piece->start_position = ending_piece_offset;
-
   return true;
 }
 
-char piece_table_get_char_at(const piece_table* table,
-                             const unsigned int position)
+bool piece_table_memsafe_redo_unlocked(piece_table* table)
 {
   if(!table)
   {
-    return '\0';
+    return false;
   }
 
-  unsigned int remaining_offset = position;
-  piece* p = table->pieces_head;
-  while(p)
+  if(!invalidate_piece_index(table))
   {
-    if(remaining_offset <= p->length)
-    {
-      return (p->buffer == ORIGINAL
-                ? table->original_buffer
-                : table->add_buffer)[p->start_position + remaining_offset];
-    }
-    remaining_offset -= p->length;
-    p = p->next;
+    return false;
   }
 
-  return '\0';
-}
+  if(!table->memsafe_redo_stack_top)
+  {
+    return false;
+  }
 
-char* piece_table_get_slice(const piece_table* table,
-                            const unsigned int position,
-                            const unsigned int length)
-{
-  if(!table)
+  memsafe_operation* op = table->memsafe_redo_stack_top;
+  if(op->type == INSERT && !memsafe_redo_insert(table, op))
   {
-    return NULL;
+    return false;
   }
 
-  piece* starting_piece = NULL;
-  piece* ending_piece = NULL;
-  unsigned int starting_piece_offset = 0, ending_piece_offset = 0;
+  if(!move_memsafe_operation_from_redo_to_undo_stack(table))
+  {
+    return false;
+  }
 
-  starting_piece_offset = position;
+  return true;
+}
+
+bool memsafe_redo_insert(piece_table* table, const memsafe_operation* op)
+{
+  unsigned int remaining_offset = op->start_position;
   piece* p = table->pieces_head;
   while(p)
   {
-    if(starting_piece_offset <= p->length)
+    if(remaining_offset <= p->length)
     {
       break;
     }
-    starting_piece_offset -= p->length;
+    remaining_offset -= p->length;
     p = p->next;
   }
   if(!p)
   {
-    // starting position out of bounds
-    return NULL;
+    // position out of bounds
+    return false;
   }
-  starting_piece = p;
 
-  p = table->pieces_head;
-  ending_piece_offset = position + length;
-  while(p)
+  piece* new_p = NULL;
+  if(op->source)
   {
-    if(ending_piece_offset <= p->length)
+    unsigned int source = 0;
+    if(!table_find_source(table, op->source, &source))
     {
-      break;
+      return false;
     }
-    ending_piece_offset -= p->length;
-    p = p->next;
+    new_p = piece_new(table, source, op->source_start, op->length);
   }
-  if(!p)
+  else
   {
-    // starting position or length out of bounds
-    return NULL;
+    unsigned int add_buffer_length = table->add_buffer_length;
+    unsigned int string_length = strlen(op->string);
+    if(!append_to_add_buffer(table, op->string, string_length))
+    {
+      return false;
+    }
+    new_p = piece_new(table, ADD, add_buffer_length, string_length);
+  }
+  if(!new_p)
+  {
+    return false;
   }
-  ending_piece = p;
 
-  char* slice = (char*)calloc(length + 1, sizeof(char));
-  if(!slice)
+  if(!insert_piece_at(table, p, remaining_offset, new_p))
   {
-    return NULL;
+    piece_free(table, new_p);
+    return false;
   }
 
-  if(starting_piece == ending_piece)
+  return true;
+}
+
+piece_table* piece_table_clone_unlocked(const piece_table* table)
+{
+  if(!table)
   {
-    memcpy(slice,
-           (starting_piece->buffer == ORIGINAL ? table->original_buffer
-                                               : table->add_buffer) +
-             starting_piece_offset,
-           starting_piece->length - starting_piece_offset);
-    slice[length] = '\0';
-    return slice;
+    return NULL;
   }
 
-  unsigned int destination_copy_offset = 0;
-  memcpy(slice,
-         (starting_piece->buffer == ORIGINAL ? table->original_buffer
-                                             : table->add_buffer) +
-           starting_piece_offset,
-         starting_piece->length - starting_piece_offset);
+  piece_index* index = retain_piece_index(table);
+  if(!index)
+  {
+    return NULL;
+  }
 
-  destination_copy_offset += starting_piece->length - starting_piece_offset;
-  p = starting_piece->next;
+  piece_table* clone = piece_table_new_with_allocator(&table->allocator);
+  if(!clone)
+  {
+    piece_index_release(index);
+    return NULL;
+  }
 
-  while(p != ending_piece)
+  // sharing buffers instead of copying text,
+  // whichever table appends first keeps appending in place
+  if(!table_share_sources(clone, index))
   {
-    char* source =
-      p->buffer == ORIGINAL ? table->original_buffer : table->add_buffer;
-    memcpy(
-      slice + destination_copy_offset, source + p->start_position, p->length);
-    destination_copy_offset += p->length;
-    p = p->next;
+    piece_index_release(index);
+    piece_table_free(clone);
+    return NULL;
   }
+  clone->add_buffer_length = index->add_buffer_length;
+  // history isn't cloned, bytes only it references are wasted by the clone
+  clone->add_buffer_wasted_length =
+    table->add_buffer_wasted_length + table->add_buffer_kept_length;
+  clone->huge_pages = table->huge_pages;
 
-  memcpy(slice + destination_copy_offset,
-         (ending_piece->buffer == ORIGINAL ? table->original_buffer
-                                           : table->add_buffer) +
-           ending_piece->start_position,
-         sizeof(char) * ending_piece_offset);
+  // pieces are copied out of the index on first change of the clone
+  clone->cow_index = index;
 
-  slice[length] = '\0';
-  return slice;
+  return clone;
 }
 
-char* piece_table_to_string(const piece_table* table)
+bool piece_table_freeze_unlocked(piece_table* table)
 {
   if(!table)
   {
-    return NULL;
+    return false;
   }
 
-  unsigned int string_length = 0;
+  if(!invalidate_piece_index(table))
+  {
+    return false;
+  }
+
+  if(table->undo_with_micro_inserts)
+  {
+    // micro insert session is still open
+    return false;
+  }
+
+  unsigned int length = 0;
   piece* p = table->pieces_head;
   while(p)
   {
-    string_length += p->length;
+    length += p->length;
     p = p->next;
   }
 
-  char* string = (char*)calloc((string_length + 1), sizeof(char));
-  if(!string)
+  text_buffer* frozen_buffer = text_buffer_new(&table->allocator);
+  text_buffer* empty_buffer = text_buffer_new(&table->allocator);
+  char* string = (char*)table_alloc(table, sizeof(char) * (length + 1));
+  if(!frozen_buffer || !empty_buffer || !string)
   {
-    return NULL;
+    text_buffer_release(frozen_buffer);
+    text_buffer_release(empty_buffer);
+    table_free(table, string);
+    return false;
   }
+  frozen_buffer->data = string;
+  frozen_buffer->length = length;
+  frozen_buffer->capacity = length + 1;
 
-  p = table->pieces_head;
   unsigned int string_back = 0;
+  p = table->pieces_head;
   while(p)
   {
     char* source_string =
-      p->buffer == ORIGINAL ? table->original_buffer : table->add_buffer;
+      table->sources[p->buffer]->data;
     memcpy(string + string_back, source_string + p->start_position, p->length);
     string_back += p->length;
     p = p->next;
   }
-  string[string_length] = '\0';
+  string[length] = '\0';
+
+  piece* frozen_piece = piece_new(table, ORIGINAL, 0, length);
+  if(!frozen_piece)
+  {
+    text_buffer_release(frozen_buffer);
+    text_buffer_release(empty_buffer);
+    return false;
+  }
+
+  // dropping old buffers, snapshots may still reference them
+  for(unsigned int i = 0; i < table->sources_count; i++)
+  {
+    text_buffer_release(table->sources[i]);
+  }
+  table->sources[ORIGINAL] = frozen_buffer;
+  table->sources[ADD] = empty_buffer;
+  table->sources_count = 2;
+  table->add_buffer_length = 0;
+
+  // dropping fragmented pieces
+  if(table->pieces_head && !recursively_free_pieces(table, table->pieces_head))
+  {
+    return false;
+  }
+  table->pieces_head = frozen_piece;
+
+  // dropping history, along with pieces only operations still own
+  free_operation_stack(table, table->undo_stack_top, false);
+  free_operation_stack(table, table->redo_stack_top, true);
+  table->undo_stack_top = NULL;
+  table->redo_stack_top = NULL;
+
+  if(table->memsafe_undo_stack_top &&
+     !recursively_free_memsafe_operation_stack(
+       table, table->memsafe_undo_stack_top, false))
+  {
+    return false;
+  }
+  if(table->memsafe_redo_stack_top &&
+     !recursively_free_memsafe_operation_stack(
+       table, table->memsafe_redo_stack_top, true))
+  {
+    return false;
+  }
+  table->memsafe_undo_stack_top = NULL;
+  table->memsafe_redo_stack_top = NULL;
+  table->add_buffer_kept_length = 0;
+  table->add_buffer_wasted_length = 0;
+
+  return true;
+}
+
+bool piece_table_compact_unlocked(piece_table* table)
+{
+  if(!table)
+  {
+    return false;
+  }
+
+  if(!invalidate_piece_index(table))
+  {
+    return false;
+  }
+
+  if(table->undo_with_micro_inserts)
+  {
+    // micro insert session keeps appending to the end of add buffer
+    return false;
+  }
+
+  if(!table->sources[ADD]->data)
+  {
+    return true;
+  }
+
+  // collecting every piece that still references add buffer,
+  // memsafe operations own their strings so they don't reference it
+  piece** pieces = NULL;
+  unsigned int pieces_count = 0;
+  if(!collect_add_pieces(table, &pieces, &pieces_count))
+  {
+    return false;
+  }
+
+  if(pieces_count == 0)
+  {
+    table_free(table, pieces);
+    text_buffer* empty_buffer = text_buffer_new(&table->allocator);
+    if(!empty_buffer)
+    {
+      return false;
+    }
+    text_buffer_release(table->sources[ADD]);
+    table->sources[ADD] = empty_buffer;
+    table->add_buffer_length = 0;
+    table->add_buffer_kept_length = 0;
+    table->add_buffer_wasted_length = 0;
+    return true;
+  }
+
+  add_buffer_range* ranges = (add_buffer_range*)table_alloc(
+    table, sizeof(add_buffer_range) * pieces_count);
+  if(!ranges)
+  {
+    table_free(table, pieces);
+    return false;
+  }
+  for(unsigned int i = 0; i < pieces_count; i++)
+  {
+    ranges[i].start_position = pieces[i]->start_position;
+    ranges[i].end_position = pieces[i]->start_position + pieces[i]->length;
+  }
+
+  unsigned int ranges_count = 0;
+  unsigned int live_length =
+    merge_add_buffer_ranges(ranges, pieces_count, &ranges_count);
+
+  if(live_length == table->add_buffer_length)
+  {
+    // nothing to reclaim
+    table->add_buffer_wasted_length = 0;
+    table_free(table, ranges);
+    table_free(table, pieces);
+    return true;
+  }
+
+  // compacting into a new buffer, snapshots keep reading the old one
+  text_buffer* compacted_buffer = text_buffer_new(&table->allocator);
+  char* string = (char*)table_alloc(table, sizeof(char) * (live_length + 1));
+  if(!compacted_buffer || !string)
+  {
+    text_buffer_release(compacted_buffer);
+    table_free(table, string);
+    table_free(table, ranges);
+    table_free(table, pieces);
+    return false;
+  }
+  for(unsigned int i = 0; i < ranges_count; i++)
+  {
+    memcpy(string + ranges[i].new_start_position,
+           table->sources[ADD]->data + ranges[i].start_position,
+           ranges[i].end_position - ranges[i].start_position);
+  }
+  string[live_length] = '\0';
+  compacted_buffer->data = string;
+  compacted_buffer->length = live_length;
+  compacted_buffer->capacity = live_length + 1;
+
+  // rewriting piece offsets into compacted buffer
+  for(unsigned int i = 0; i < pieces_count; i++)
+  {
+    unsigned int low = 0, high = ranges_count - 1;
+    while(low < high)
+    {
+      unsigned int middle = low + (high - low + 1) / 2;
+      if(ranges[middle].start_position <= pieces[i]->start_position)
+      {
+        low = middle;
+      }
+      else
+      {
+        high = middle - 1;
+      }
+    }
+    pieces[i]->start_position = ranges[low].new_start_position +
+                                pieces[i]->start_position -
+                                ranges[low].start_position;
+  }
 
-  return string;
+  text_buffer_release(table->sources[ADD]);
+  table->sources[ADD] = compacted_buffer;
+  table->add_buffer_length = live_length;
+  table->add_buffer_wasted_length = 0;
+
+  table_free(table, ranges);
+  table_free(table, pieces);
+
+  return true;
 }
 
-int piece_table_get_length(const piece_table* table)
+bool piece_table_use_huge_pages_unlocked(piece_table* table, const bool enable)
 {
   if(!table)
   {
-    return -1;
+    return false;
   }
 
-  int length = 0;
-  piece* p = table->pieces_head;
-  while(p)
-  {
-    length += p->length;
-    p = p->next;
-  }
+#ifdef PIECE_TABLE_HAS_MMAP
+  // only affects buffers allocated from now on
+  table->huge_pages = enable;
 
-  return length;
+  return true;
+#else
+  return !enable;
+#endif
 }
 
-char* piece_table_get_line(const piece_table* table, const unsigned int line)
+bool piece_table_advise_unlocked(const piece_table* table,
+                                 const piece_table_access access)
 {
   if(!table)
   {
-    return NULL;
+    return false;
   }
 
-  unsigned int new_line_tokens = 0, line_length = 0;
-  char* string = NULL;
-
-  piece* p = table->pieces_head;
-  piece* starting_piece = p;
-  piece* ending_piece = NULL;
-  unsigned int starting_piece_offset = 0, ending_piece_offset = 0;
-
-  bool found_ending_piece = false;
-  while(p)
+  for(unsigned int i = 0; i < table->sources_count; i++)
   {
-    char* text =
-      p->buffer == ORIGINAL ? table->original_buffer : table->add_buffer;
-    for(unsigned int i = 0; i < p->length; i++)
+    const text_buffer* buffer = table->sources[i];
+    if(!advise_range(buffer->data,
+                     i == ADD ? table->add_buffer_length : buffer->length,
+                     access))
     {
-      if(text[p->start_position + i] != '\n')
-      {
-        continue;
-      }
-
-      new_line_tokens++;
+      return false;
+    }
+  }
 
-      if(new_line_tokens == line - 1)
-      {
-        starting_piece = p;
-        starting_piece_offset = i + 1;
-      }
+  return true;
+}
 
-      if(new_line_tokens == line)
-      {
-        ending_piece = p;
-        ending_piece_offset = i - 1;
-        found_ending_piece = true;
-        break;
-      }
-    }
+bool piece_table_memory_stats_unlocked(const piece_table* table,
+                                       piece_table_memory_usage* stats)
+{
+  if(!table)
+  {
+    return false;
+  }
 
-    if(found_ending_piece)
-    {
-      break;
-    }
+  if(!stats)
+  {
+    return false;
+  }
 
-    if(p->next)
-    {
-      p = p->next;
-    }
-    else
+  stats->original_buffer_bytes = table->sources[ORIGINAL]->capacity;
+  stats->add_buffer_used_bytes = table->add_buffer_length;
+  stats->add_buffer_capacity_bytes = table->sources[ADD]->capacity;
+  stats->add_buffer_wasted_bytes = table->add_buffer_wasted_length;
+  stats->sources_count = table->sources_count - 2;
+  stats->sources_bytes = 0;
+  for(unsigned int i = 2; i < table->sources_count; i++)
+  {
+    stats->sources_bytes += table->sources[i]->capacity;
+  }
+  stats->pieces_count = table->pieces_count;
+  stats->pieces_bytes = (size_t)table->pieces_count * sizeof(piece);
+  stats->piece_index_bytes =
+    table->index ? sizeof(piece_index) + (size_t)(table->index->count + 1) *
+                                           (sizeof(packed_piece) +
+                                            sizeof(unsigned int))
+                 : 0;
+  stats->line_index_bytes = 0;
+  for(unsigned int i = 0; i < table->sources_count; i++)
+  {
+    const line_index* lines =
+      (const line_index*)atomic_load_pointer(&table->sources[i]->lines);
+    if(lines)
     {
-      break;
+      stats->line_index_bytes += line_index_bytes(lines);
     }
   }
+  stats->undo_records_count = table->undo_records_count;
+  stats->undo_records_bytes = table->undo_records_bytes;
+  stats->redo_records_count = table->redo_records_count;
+  stats->redo_records_bytes = table->redo_records_bytes;
+  stats->total_bytes = sizeof(piece_table) + stats->original_buffer_bytes +
+                       stats->add_buffer_capacity_bytes +
+                       stats->sources_bytes + stats->pieces_bytes +
+                       stats->piece_index_bytes + stats->line_index_bytes +
+                       stats->undo_records_bytes + stats->redo_records_bytes;
 
-  if(line > new_line_tokens + 1)
-  {
-    // line is out of bounds
-    return NULL;
-  }
+  return true;
+}
 
-  if(!found_ending_piece)
+bool piece_table_set_tracer_unlocked(piece_table* table,
+                                     const piece_table_tracer* tracer)
+{
+  if(!table)
   {
-    // line is the last line of buffer
-    // hence lies in the last piece
-    ending_piece = p;
-    ending_piece_offset = p->length;
+    return false;
   }
 
-  if(starting_piece == ending_piece)
+  if(!tracer || (!tracer->begin && !tracer->end))
   {
-    // line lies in the same piece
-    line_length = ending_piece_offset - starting_piece_offset + 1;
-    string = (char*)calloc(line_length + 1, sizeof(char));
-    memcpy(string,
-           (starting_piece->buffer == ORIGINAL ? table->original_buffer
-                                               : table->add_buffer) +
-             starting_piece->start_position + starting_piece_offset,
-           line_length);
-    return string;
+    // disabling tracing
+    memset(&table->tracer, 0, sizeof(piece_table_tracer));
+    atomic_store_count(&table->tracing, 0);
+    return true;
   }
 
-  // calculating line length
-  line_length += starting_piece->length - starting_piece_offset;
-  p = starting_piece->next;
-  while(p != ending_piece)
+  table->tracer = *tracer;
+  atomic_store_count(&table->tracing, 1);
+
+  return true;
+}
+
+bool piece_table_get_stats_unlocked(const piece_table* table,
+                                    piece_table_stats* stats)
+{
+  if(!table || !stats)
   {
-    line_length += p->length;
-    p = p->next;
+    return false;
   }
-  line_length += ending_piece_offset;
 
-  string = (char*)calloc(line_length + 1, sizeof(char));
+#ifdef PIECE_TABLE_STATS
+  piece_table* counted = (piece_table*)table;
+  stats->lookups = atomic_load_size(&counted->stats.lookups);
+  stats->pieces_visited = atomic_load_size(&counted->stats.pieces_visited);
+  stats->splits = atomic_load_size(&counted->stats.splits);
+  stats->pieces_allocated = atomic_load_size(&counted->stats.pieces_allocated);
+  stats->pieces_freed = atomic_load_size(&counted->stats.pieces_freed);
+  stats->add_buffer_reallocations =
+    atomic_load_size(&counted->stats.add_buffer_reallocations);
+  stats->add_buffer_bytes_copied =
+    atomic_load_size(&counted->stats.add_buffer_bytes_copied);
+  stats->add_buffer_bytes_appended =
+    atomic_load_size(&counted->stats.add_buffer_bytes_appended);
+  stats->undo_records = atomic_load_size(&counted->stats.undo_records);
 
-  // copying string from starting piece
-  memcpy(string,
-         (starting_piece->buffer == ORIGINAL ? table->original_buffer
-                                             : table->add_buffer) +
-           starting_piece->start_position + starting_piece_offset,
-         starting_piece->length - starting_piece_offset);
+  return true;
+#else
+  // counters aren't compiled in
+  memset(stats, 0, sizeof(piece_table_stats));
+  return false;
+#endif
+}
 
-  unsigned int string_copy_offset =
-    starting_piece->length - starting_piece_offset;
-  p = starting_piece->next;
-  while(p != ending_piece)
+bool piece_table_reset_stats_unlocked(piece_table* table)
+{
+  if(!table)
   {
-    memcpy(
-      string + string_copy_offset,
-      (p->buffer == ORIGINAL ? table->original_buffer : table->add_buffer) +
-        p->start_position,
-      p->length);
-    string_copy_offset += p->length;
-    p = p->next;
+    return false;
   }
 
-  // copying string from ending piece
-  memcpy(string + string_copy_offset,
-         (ending_piece->buffer == ORIGINAL ? table->original_buffer
-                                           : table->add_buffer) +
-           ending_piece->start_position,
-         ending_piece_offset);
+#ifdef PIECE_TABLE_STATS
+  atomic_store_size(&table->stats.lookups, 0);
+  atomic_store_size(&table->stats.pieces_visited, 0);
+  atomic_store_size(&table->stats.splits, 0);
+  atomic_store_size(&table->stats.pieces_allocated, 0);
+  atomic_store_size(&table->stats.pieces_freed, 0);
+  atomic_store_size(&table->stats.add_buffer_reallocations, 0);
+  atomic_store_size(&table->stats.add_buffer_bytes_copied, 0);
+  atomic_store_size(&table->stats.add_buffer_bytes_appended, 0);
+  atomic_store_size(&table->stats.undo_records, 0);
 
-  string[line_length] = '\0';
-  return string;
+  return true;
+#else
+  return false;
+#endif
 }
 
-bool piece_table_replace(piece_table* table,
-                         const unsigned int position,
-                         const unsigned int length,
-                         const char* string)
+bool piece_table_free(piece_table* table)
 {
   if(!table)
   {
     return false;
   }
 
-  if(!string)
+  // background loading is stopped, its buffer stays indexed up to
+  // where it got for tables sharing it
+  file_loader_join(table, true);
+
+  // snapshots & clones may still reference the index
+  piece_index_release(table->index);
+  piece_index_release(table->cow_index);
+  table_lock_free(table);
+  // snapshots may outlive the table, they release buffers they reference
+  table_release_sources(table);
+
+  if(table->pieces_head && !recursively_free_pieces(table, table->pieces_head))
   {
     return false;
   }
 
-  if(!piece_table_remove(table, position, length))
+  // depreicated, operations free the pieces only they still own,
+  // an open micro insert session owns none
+  free_operation_stack(table, table->undo_stack_top, false);
+  free_operation_stack(table, table->redo_stack_top, true);
+  table_free(table, table->undo_with_micro_inserts);
+
+  // new stuff
+  if(table->memsafe_undo_stack_top &&
+     !recursively_free_memsafe_operation_stack(
+       table, table->memsafe_undo_stack_top, false))
   {
     return false;
   }
-
-  if(!piece_table_insert(table, position, string))
+  if(table->memsafe_redo_stack_top &&
+     !recursively_free_memsafe_operation_stack(
+       table, table->memsafe_redo_stack_top, true))
   {
     return false;
   }
 
+  table_free(table, table);
+
   return true;
 }
 
-bool piece_table_undo(piece_table* table)
+/// Split & Concat API Implementation
+bool piece_table_split_at(const piece_table* table,
+                          const unsigned int position,
+                          piece_table** left,
+                          piece_table** right)
 {
-  if(!table)
-  {
-    return false;
-  }
-
-  if(!table->undo_stack_top)
+  if(!table || !left || !right)
   {
     return false;
   }
 
-  // virtually removing the inserted piece
-  // by connecting prev_piece, next_piece
+  trace_call trace;
+  trace_begin(table, &trace, PIECE_TABLE_CALL_SPLIT_AT, position, 0);
 
-  operation* op = table->undo_stack_top;
-  if(!op->prev_piece)
+  // splitting a snapshot, so the table is locked only while taking it
+  piece_table_view* view = piece_table_snapshot(table);
+  if(!view)
   {
-    table->pieces_head = op->next_piece;
+    trace_end(table, &trace, false);
+    return false;
   }
-  else
+  if(position > view->length)
   {
-    op->prev_piece->next = op->next_piece;
+    piece_table_view_release(view);
+    trace_end(table, &trace, false);
+    return false;
   }
 
-  if(!move_operation_from_undo_to_redo_stack(table))
-  {
+  piece* left_tail = NULL;
+  piece* right_tail = NULL;
+  *left = piece_table_from_piece_index(view);
+  *right = piece_table_from_piece_index(view);
+  if(!*left || !*right ||
+     !append_piece_index_range(*left, &left_tail, view, 0, position) ||
+     !append_piece_index_range(
+       *right, &right_tail, view, position, view->length - position) ||
+     !ensure_piece(*left) || !ensure_piece(*right))
+  {
+    piece_table_free(*left);
+    piece_table_free(*right);
+    *left = NULL;
+    *right = NULL;
+    piece_table_view_release(view);
+    trace_end(table, &trace, false);
     return false;
   }
 
+  piece_table_view_release(view);
+  trace_end(table, &trace, true);
   return true;
 }
 
-bool piece_table_redo(piece_table* table)
+piece_table* piece_table_concat(const piece_table* a, const piece_table* b)
 {
-  if(!table)
+  if(!a || !b)
   {
-    return false;
+    return NULL;
   }
 
-  if(!table->redo_stack_top)
+  // traced as a call of the first table
+  trace_call trace;
+  trace_begin(a, &trace, PIECE_TABLE_CALL_CONCAT, 0, 0);
+
+  // snapshots are taken one at a time, so concurrent concats never deadlock
+  piece_table_view* a_view = piece_table_snapshot(a);
+  piece_table_view* b_view = piece_table_snapshot(b);
+  piece_table* table = a_view && b_view ? piece_table_from_piece_index(a_view)
+                                        : NULL;
+
+  piece* tail = NULL;
+  if(!table ||
+     !append_piece_index_range(table, &tail, a_view, 0, a_view->length) ||
+     !append_piece_index_range(table, &tail, b_view, 0, b_view->length) ||
+     !ensure_piece(table))
   {
-    return false;
+    piece_table_free(table);
+    table = NULL;
   }
 
-  // inserting pieces from start_piece to end_piece
-  // between prev_piece and next_piece
+  piece_table_view_release(a_view);
+  piece_table_view_release(b_view);
+  trace_end(a, &trace, table != NULL);
+  return table;
+}
 
-  operation* op = table->redo_stack_top;
-  if(!op->prev_piece)
+/// Snapshot API Implementation
+piece_table_view* piece_table_snapshot(const piece_table* table)
+{
+  if(!table)
   {
-    table->pieces_head = op->start_piece;
+    return NULL;
   }
-  else
+
+  trace_call trace;
+  trace_begin(table, &trace, PIECE_TABLE_CALL_SNAPSHOT, 0, 0);
+
+  // the lock is held only while the index is taken,
+  // reading the view never blocks writers of the table
+  table_read_lock(table);
+  piece_index* index = retain_piece_index(table);
+  table_read_unlock(table);
+  trace_end(table, &trace, index != NULL);
+
+  return index;
+}
+
+char piece_table_view_get_char_at(const piece_table_view* view,
+                                  const unsigned int position)
+{
+  if(!view)
   {
-    op->prev_piece->next = op->start_piece;
-    op->end_piece->next = op->next_piece;
+    return '\0';
   }
 
-  if(!move_operation_from_redo_to_undo_stack(table))
+  return piece_index_get_char_at(view, position);
+}
+
+char* piece_table_view_get_slice(const piece_table_view* view,
+                                 const unsigned int position,
+                                 const unsigned int length)
+{
+  if(!view)
   {
-    return false;
+    return NULL;
   }
 
-  return true;
+  return piece_index_get_slice(view, position, length);
 }
 
-bool piece_table_memsafe_remove(piece_table* table,
-                                const unsigned int position,
-                                const unsigned int length)
+int piece_table_view_get_length(const piece_table_view* view)
 {
-  if(!table)
+  if(!view)
   {
-    return false;
+    return -1;
   }
 
-  piece* starting_piece = NULL;
-  piece* ending_piece = NULL;
-  unsigned int starting_piece_offset = 0, ending_piece_offset = 0;
+  return view->length;
+}
 
-  starting_piece_offset = position;
-  piece* p = table->pieces_head;
-  while(p)
+char* piece_table_to_string_parallel(const piece_table* table,
+                                     const unsigned int threads)
+{
+  if(!table)
   {
-    if(starting_piece_offset <= p->length)
-    {
-      break;
-    }
-    starting_piece_offset -= p->length;
-    p = p->next;
+    return NULL;
   }
-  if(!p)
+
+  trace_call trace;
+  trace_begin(table, &trace, PIECE_TABLE_CALL_TO_STRING_PARALLEL, 0, 0);
+
+  // copying works on a snapshot,
+  // so writers are blocked only while the index is taken
+  piece_index* index = piece_table_snapshot(table);
+  char* string = index ? piece_index_to_string_parallel(index, threads) : NULL;
+  piece_index_release(index);
+  trace_end(table, &trace, string != NULL);
+
+  return string;
+}
+
+char* piece_table_view_to_string_parallel(const piece_table_view* view,
+                                          const unsigned int threads)
+{
+  if(!view)
   {
-    // position out of bounds
-    return false;
+    return NULL;
   }
-  starting_piece = p;
 
-  p = table->pieces_head;
-  ending_piece_offset = position + length;
-  while(p)
+  return piece_index_to_string_parallel(view, threads);
+}
+
+char* piece_table_view_to_string(const piece_table_view* view)
+{
+  if(!view)
   {
-    if(ending_piece_offset <= p->length)
-    {
-      break;
-    }
-    ending_piece_offset -= p->length;
-    p = p->next;
+    return NULL;
   }
-  if(!p)
+
+  return piece_index_get_slice(view, 0, view->length);
+}
+
+bool piece_table_view_release(piece_table_view* view)
+{
+  return piece_index_release(view);
+}
+
+bool piece_table_view_save(const piece_table_view* view, const char* path)
+{
+  if(!view || !path)
   {
-    // position or length out of bounds
     return false;
   }
-  ending_piece = p;
 
-  printf("HEHEHEEEHEHHEEHE\n");
-  memsafe_operation* msop =
-    memsafe_operation_new(REMOVE, position, length, NULL);
-  if(msop)
-  {
-    push_memsafe_operation_on_stack(&table->memsafe_undo_stack_top, msop);
-  }
-  else
+  return piece_index_save(view, path);
+}
+
+bool piece_table_save(const piece_table* table, const char* path)
+{
+  if(!table || !path)
   {
-    printf("Unable to record REMOVE operation!\n");
+    return false;
   }
 
-  // removal happening in same piece
-  if(starting_piece == ending_piece)
-  {
-    // removal happening at the end
-    if(starting_piece_offset + length == p->length)
-    {
-      starting_piece->length -= length;
-      return true;
-    }
+  trace_call trace;
+  trace_begin(table, &trace, PIECE_TABLE_CALL_SAVE, 0, 0);
 
-    // we need to split the node at starting_piece_offset+length
-    // then adjust the length of the current piece
-    // adjusting length, doesn't work for undo & redo
-    // we need to split twice at starting_offset, starting_offset+length
-    // the virtuall remove the middle piece
-    // by connecting the starting end ending pieces among splitted pieces.
-    if(!split_piece_at(starting_piece, starting_piece_offset + length))
-    {
-      return false;
-    }
-    // starting_piece->length -= length;
-    if(!split_piece_at(starting_piece, starting_piece_offset))
-    {
-      return false;
-    }
+  piece_index* index = piece_table_snapshot(table);
+  bool result = index && piece_index_save(index, path);
+  piece_index_release(index);
+  trace_end(table, &trace, result);
 
-    remove_piece_from_table(table, starting_piece->next);
+  return result;
+}
 
-    return true;
+bool piece_table_save_async(const piece_table* table,
+                            const char* path,
+                            piece_table_saved saved,
+                            void* user_data)
+{
+  if(!table || !path)
+  {
+    return false;
   }
 
-  // here arise two cases:
-  // - starting and ending pieces are next to each other
-  // - some piece exist between starting and ending pieces
-  // in either case we could just split pieces as:
-  // - starting piece at starting piece offset (resulting in 1, 2)
-  // - ending piece at ending piece offset (resulting in 3, 4)
-  // then virtually remove pieces between: 1, 4
-  // this removes complexity of handling pieces between 2, 3
+  // traced until the save is started
+  trace_call trace;
+  trace_begin(table, &trace, PIECE_TABLE_CALL_SAVE_ASYNC, 0, 0);
 
-  if(starting_piece_offset != starting_piece->length &&
-     !split_piece_at(starting_piece, starting_piece_offset))
+  save_job* job = (save_job*)table_alloc(table, sizeof(save_job));
+  if(!job)
+  {
+    trace_end(table, &trace, false);
+    return false;
+  }
+  job->path = table_strdup(table, path);
+  if(!job->path)
   {
+    table_free(table, job);
+    trace_end(table, &trace, false);
     return false;
   }
-  // if(starting_piece->next->length == 0)
-  // {
-  //   remove_piece_from_table(table, starting_piece->next);
-  // }
-  if(ending_piece_offset != ending_piece->length &&
-     !split_piece_at(ending_piece, ending_piece_offset))
+  job->saved = saved;
+  job->user_data = user_data;
+  job->allocator = table->allocator;
+
+  // snapshot only takes a reference to the packed pieces,
+  // the table can be changed as soon as it is taken
+  job->index = piece_table_snapshot(table);
+  if(!job->index)
   {
-    printf("ending_piece_offset = %d, ending_piece_length = %d\n",
-           ending_piece_offset,
-           ending_piece->length);
+    table_free(table, job->path);
+    table_free(table, job);
+    trace_end(table, &trace, false);
     return false;
   }
-  // if(ending_piece->next->length == 0)
-  // {
-  //   remove_piece_from_table(table, ending_piece->next);
-  // }
 
-  if(starting_piece->next == ending_piece)
+#ifdef _WIN32
+  HANDLE thread = CreateThread(NULL, 0, save_job_run, job, 0, NULL);
+  if(thread)
   {
-    remove_piece_from_table(table, ending_piece);
+    CloseHandle(thread);
+    trace_end(table, &trace, true);
     return true;
   }
-
-  p = starting_piece->next;
-  piece* pnext = NULL;
-  while(p != ending_piece)
+#else
+  pthread_t thread;
+  if(pthread_create(&thread, NULL, save_job_run, job) == 0)
   {
-    piece_free(pnext);
-    pnext = p;
-    p = p->next;
+    pthread_detach(thread);
+    trace_end(table, &trace, true);
+    return true;
   }
-  piece_free(pnext);
-  starting_piece->next = ending_piece->next;
-  piece_free(p);
+#endif
 
+  // saving in the calling thread if no thread can be started
+  save_job_run(job);
+  trace_end(table, &trace, true);
   return true;
 }
 
-bool piece_table_memsafe_undo(piece_table* table)
+piece_table_source* piece_table_source_from_string(const char* string)
 {
-  if(!table)
+  if(!string)
   {
-    return false;
+    return NULL;
   }
 
-  if(!table->memsafe_undo_stack_top)
+  const piece_table_allocator allocator = {
+    default_alloc, default_realloc, default_free, NULL};
+  return text_buffer_from_string(&allocator, string);
+}
+
+piece_table_source* piece_table_source_from_file(const char* path)
+{
+  if(!path)
   {
-    return false;
+    return NULL;
   }
 
-  // TODO: move memsafe operation from undo to redo stack
-  memsafe_operation* op = table->memsafe_undo_stack_top;
-  if(op->type == INSERT)
+  const piece_table_allocator allocator = {
+    default_alloc, default_realloc, default_free, NULL};
+  return text_buffer_from_file(&allocator, path);
+}
+
+piece_table* piece_table_from_source(piece_table_source* source)
+{
+  if(!source)
   {
-    piece_table_memsafe_remove(table, op->start_position, strlen(op->string));
+    return NULL;
   }
 
-  if(!move_memsafe_operation_from_undo_to_redo_stack(table))
+  piece_table* table = piece_table_new();
+  if(!table)
   {
-    return false;
+    return NULL;
   }
 
-  return true;
+  // source is only read, so every table made from it shares its text
+  text_buffer_retain(source);
+  if(!table_set_original(table, source))
+  {
+    piece_table_free(table);
+    return NULL;
+  }
+
+  return table;
 }
 
-bool piece_table_memsafe_redo(piece_table* table)
+bool piece_table_insert_source(piece_table* table,
+                               const unsigned int position,
+                               piece_table_source* source)
 {
-  if(!table)
+  if(!table || !source)
   {
     return false;
   }
 
-  if(!table->memsafe_redo_stack_top)
+  trace_call trace;
+  trace_begin(table,
+              &trace,
+              PIECE_TABLE_CALL_INSERT_SOURCE,
+              position,
+              source->length);
+  table_write_lock(table);
+  bool result = table_insert_source(table, position, source);
+  table_write_unlock(table);
+  trace_end(table, &trace, result);
+
+  return result;
+}
+
+bool piece_table_source_release(piece_table_source* source)
+{
+  if(!source)
   {
     return false;
   }
 
-  // TODO: move memsafe operation from redo to undo stack
-
+  text_buffer_release(source);
   return true;
 }
 
-bool piece_table_free(piece_table* table)
+/// Dump Implementation
+void dump_printf(dump_writer* writer, const char* format, ...)
 {
-  if(!table)
+  va_list arguments;
+  va_start(arguments, format);
+  int length = vsnprintf(writer->buffer + writer->length,
+                         DUMP_BUFFER_SIZE - writer->length,
+                         format,
+                         arguments);
+  va_end(arguments);
+  if(length < 0)
+  {
+    return;
+  }
+
+  if(writer->length + (size_t)length >= DUMP_BUFFER_SIZE)
+  {
+    // didn't fit, formatting again into the flushed buffer
+    dump_flush(writer);
+    va_start(arguments, format);
+    length = vsnprintf(writer->buffer, DUMP_BUFFER_SIZE, format, arguments);
+    va_end(arguments);
+    if(length < 0)
+    {
+      return;
+    }
+  }
+  writer->length += (size_t)length;
+}
+
+void dump_flush(dump_writer* writer)
+{
+  if(writer->length > 0)
   {
-    return false;
+    writer->sink(writer->buffer, writer->length, writer->user_data);
+    writer->length = 0;
   }
+}
 
-  free(table->original_buffer);
-  free(table->add_buffer);
+const char* buffer_name(const unsigned int buffer)
+{
+  return buffer == ORIGINAL ? "original" : buffer == ADD ? "add" : "source";
+}
 
-  if(table->pieces_head && !recursively_free_pieces(table->pieces_head))
+bool piece_table_dump(const piece_table* table,
+                      const unsigned int max_pieces,
+                      piece_table_sink sink,
+                      void* user_data)
+{
+  if(!table || !sink)
   {
     return false;
   }
 
-  // depreicated
-  // if(table->undo_stack_top &&
-  //    !recursively_free_operation_stack(table->undo_stack_top))
-  // {
-  //   return false;
-  // }
-  // if(table->redo_stack_top &&
-  //    !recursively_free_operation_stack(table->redo_stack_top))
-  // {
-  //   return false;
-  // }
-
-  // new stuff
-  if(table->memsafe_undo_stack_top &&
-     !recursively_free_memsafe_operation_stack(table->memsafe_undo_stack_top))
+  // taking counters & a snapshot of pieces under the lock,
+  // formatting & writing to the sink without it
+  piece_table_memory_usage usage;
+  table_read_lock(table);
+  bool counted = piece_table_memory_stats_unlocked(table, &usage);
+  piece_index* index = counted ? retain_piece_index(table) : NULL;
+  table_read_unlock(table);
+  if(!index)
   {
     return false;
   }
-  if(table->memsafe_redo_stack_top &&
-     !recursively_free_memsafe_operation_stack(table->memsafe_redo_stack_top))
+
+  unsigned int histogram[DUMP_HISTOGRAM_BUCKETS] = {0};
+  for(unsigned int i = 0; i < index->count; i++)
   {
-    return false;
+    unsigned int bucket = 0;
+    for(unsigned int length = index->pieces[i].length; length > 0;
+        length >>= 1)
+    {
+      bucket++;
+    }
+    histogram[bucket]++;
   }
 
-  free(table);
+  dump_writer writer;
+  writer.sink = sink;
+  writer.user_data = user_data;
+  writer.length = 0;
+
+  dump_printf(&writer,
+              "{\"length\":%u,\"pieces\":%u,\"piece_lengths\":[",
+              index->length,
+              index->count);
+  bool first = true;
+  for(unsigned int i = 0; i < DUMP_HISTOGRAM_BUCKETS; i++)
+  {
+    if(histogram[i] == 0)
+    {
+      continue;
+    }
+    unsigned int min = i == 0 ? 0 : 1u << (i - 1);
+    unsigned int max = i == 0 ? 0 : min + (min - 1);
+    dump_printf(&writer,
+                "%s{\"min\":%u,\"max\":%u,\"count\":%u}",
+                first ? "" : ",",
+                min,
+                max,
+                histogram[i]);
+    first = false;
+  }
+
+  dump_printf(&writer,
+              "],\"buffers\":{\"original_bytes\":%zu,"
+              "\"add_used_bytes\":%zu,\"add_capacity_bytes\":%zu,"
+              "\"add_wasted_bytes\":%zu,\"sources\":%zu,"
+              "\"sources_bytes\":%zu},",
+              usage.original_buffer_bytes,
+              usage.add_buffer_used_bytes,
+              usage.add_buffer_capacity_bytes,
+              usage.add_buffer_wasted_bytes,
+              usage.sources_count,
+              usage.sources_bytes);
+  dump_printf(&writer,
+              "\"undo_depth\":%zu,\"redo_depth\":%zu,\"memory_bytes\":%zu,"
+              "\"first_pieces\":[",
+              usage.undo_records_count,
+              usage.redo_records_count,
+              usage.total_bytes);
+  for(unsigned int i = 0; i < index->count && i < max_pieces; i++)
+  {
+    dump_printf(&writer,
+                "%s{\"buffer\":\"%s\",\"start\":%u,\"length\":%u}",
+                i == 0 ? "" : ",",
+                buffer_name(index->pieces[i].buffer),
+                index->pieces[i].start_position,
+                index->pieces[i].length);
+  }
+  dump_printf(&writer, "]}\n");
+  dump_flush(&writer);
+
+  piece_index_release(index);
 
   return true;
 }
 
 /// Loggers Implementation
-bool piece_table_log(piece_table* table)
+bool piece_table_log_unlocked(piece_table* table)
 {
   if(!table)
   {
@@ -1993,12 +6887,15 @@ bool piece_table_log(piece_table* table)
 
   // logging buffers
   printf(
-    "Piece Table: {\n\toriginal_buffer: %s,\n\tadd_buffer: %s,\n\tpieces: [",
-    table->original_buffer,
-    table->add_buffer);
+    "Piece Table: {\n\toriginal_buffer: %.*s,\n\tadd_buffer: %.*s,"
+    "\n\tpieces: [",
+    table->sources[ORIGINAL]->length,
+    table->sources[ORIGINAL]->data ? table->sources[ORIGINAL]->data : "",
+    table->add_buffer_length,
+    table->sources[ADD]->data ? table->sources[ADD]->data : "");
 
   // logging pieces
-  if(!table->pieces_head)
+  if(!get_pieces(table))
   {
     // printf("]\n}\n");
     printf("],");
@@ -2006,12 +6903,14 @@ bool piece_table_log(piece_table* table)
   }
   else
   {
-    piece* p = table->pieces_head;
+    piece* p = get_pieces(table);
     while(p)
     {
       printf("\n\t\t{\n\t\t\tbuffer: %s,\n\t\t\tstart_position: "
              "%d,\n\t\t\tlength: %d\n\t\t}",
-             p->buffer == ORIGINAL ? "ORIGINAL" : "ADD",
+             p->buffer == ORIGINAL ? "ORIGINAL"
+             : p->buffer == ADD    ? "ADD"
+                                   : "FILE",
              p->start_position,
              p->length);
       p = p->next;
@@ -2135,3 +7034,426 @@ bool piece_table_log(piece_table* table)
 
   return true;
 }
+
+/// Thread Safe Piece Table API Implementation
+bool piece_table_enable_thread_safety(piece_table* table)
+{
+  if(!table)
+  {
+    return false;
+  }
+
+  if(table->lock)
+  {
+    return true;
+  }
+
+  return table_lock_new(table);
+}
+
+bool piece_table_insert(piece_table* table,
+                        const unsigned int position,
+                        const char* string)
+{
+  trace_call trace;
+  trace_begin_string(table,
+                       &trace,
+                       PIECE_TABLE_CALL_INSERT,
+                       position,
+                       string);
+  table_write_lock(table);
+  bool result = piece_table_insert_unlocked(table, position, string);
+  table_write_unlock(table);
+  trace_end(table, &trace, result);
+
+  return result;
+}
+
+bool piece_table_insert_file(piece_table* table,
+                             const unsigned int position,
+                             const char* path)
+{
+  trace_call trace;
+  trace_begin(table, &trace, PIECE_TABLE_CALL_INSERT_FILE, position, 0);
+  table_write_lock(table);
+  bool result = piece_table_insert_file_unlocked(table, position, path);
+  table_write_unlock(table);
+  trace_end(table, &trace, result);
+  return result;
+}
+
+bool piece_table_start_micro_inserts(piece_table* table,
+                                     const unsigned int position)
+{
+  trace_call trace;
+  trace_begin(
+    table, &trace, PIECE_TABLE_CALL_START_MICRO_INSERTS, position, 0);
+  table_write_lock(table);
+  bool result = piece_table_start_micro_inserts_unlocked(table, position);
+  table_write_unlock(table);
+  trace_end(table, &trace, result);
+
+  return result;
+}
+
+bool piece_table_micro_insert(piece_table* table, const char* string)
+{
+  trace_call trace;
+  trace_begin_string(table,
+                       &trace,
+                       PIECE_TABLE_CALL_MICRO_INSERT,
+                       0,
+                       string);
+  table_write_lock(table);
+  bool result = piece_table_micro_insert_unlocked(table, string);
+  table_write_unlock(table);
+  trace_end(table, &trace, result);
+
+  return result;
+}
+
+bool piece_table_stop_micro_inserts(piece_table* table)
+{
+  trace_call trace;
+  trace_begin(table, &trace, PIECE_TABLE_CALL_STOP_MICRO_INSERTS, 0, 0);
+  table_write_lock(table);
+  bool result = piece_table_stop_micro_inserts_unlocked(table);
+  table_write_unlock(table);
+  trace_end(table, &trace, result);
+
+  return result;
+}
+
+bool piece_table_remove(piece_table* table,
+                        const unsigned int position,
+                        const unsigned int length)
+{
+  trace_call trace;
+  trace_begin(table, &trace, PIECE_TABLE_CALL_REMOVE, position, length);
+  table_write_lock(table);
+  bool result = piece_table_remove_unlocked(table, position, length);
+  table_write_unlock(table);
+  trace_end(table, &trace, result);
+
+  return result;
+}
+
+bool piece_table_replace(piece_table* table,
+                         const unsigned int position,
+                         const unsigned int length,
+                         const char* string)
+{
+  trace_call trace;
+  trace_begin(table, &trace, PIECE_TABLE_CALL_REPLACE, position, length);
+  table_write_lock(table);
+  bool result = piece_table_replace_unlocked(table, position, length, string);
+  table_write_unlock(table);
+  trace_end(table, &trace, result);
+
+  return result;
+}
+
+bool piece_table_undo(piece_table* table)
+{
+  trace_call trace;
+  trace_begin(table, &trace, PIECE_TABLE_CALL_UNDO, 0, 0);
+  table_write_lock(table);
+  bool result = piece_table_undo_unlocked(table);
+  table_write_unlock(table);
+  trace_end(table, &trace, result);
+
+  return result;
+}
+
+bool piece_table_redo(piece_table* table)
+{
+  trace_call trace;
+  trace_begin(table, &trace, PIECE_TABLE_CALL_REDO, 0, 0);
+  table_write_lock(table);
+  bool result = piece_table_redo_unlocked(table);
+  table_write_unlock(table);
+  trace_end(table, &trace, result);
+
+  return result;
+}
+
+bool piece_table_memsafe_remove(piece_table* table,
+                                const unsigned int position,
+                                const unsigned int length)
+{
+  trace_call trace;
+  trace_begin(
+    table, &trace, PIECE_TABLE_CALL_MEMSAFE_REMOVE, position, length);
+  table_write_lock(table);
+  bool result = piece_table_memsafe_remove_unlocked(table, position, length);
+  table_write_unlock(table);
+  trace_end(table, &trace, result);
+
+  return result;
+}
+
+bool piece_table_memsafe_undo(piece_table* table)
+{
+  trace_call trace;
+  trace_begin(table, &trace, PIECE_TABLE_CALL_MEMSAFE_UNDO, 0, 0);
+  table_write_lock(table);
+  bool result = piece_table_memsafe_undo_unlocked(table);
+  table_write_unlock(table);
+  trace_end(table, &trace, result);
+
+  return result;
+}
+
+bool piece_table_memsafe_redo(piece_table* table)
+{
+  trace_call trace;
+  trace_begin(table, &trace, PIECE_TABLE_CALL_MEMSAFE_REDO, 0, 0);
+  table_write_lock(table);
+  bool result = piece_table_memsafe_redo_unlocked(table);
+  table_write_unlock(table);
+  trace_end(table, &trace, result);
+
+  return result;
+}
+
+char piece_table_get_char_at(const piece_table* table,
+                             const unsigned int position)
+{
+  trace_call trace;
+  trace_begin(table, &trace, PIECE_TABLE_CALL_GET_CHAR_AT, position, 0);
+  table_read_lock(table);
+  char result = piece_table_get_char_at_unlocked(table, position);
+  table_read_unlock(table);
+  trace_end(table, &trace, result != '\0');
+
+  return result;
+}
+
+char* piece_table_get_line(const piece_table* table, const unsigned int line)
+{
+  trace_call trace;
+  trace_begin(table, &trace, PIECE_TABLE_CALL_GET_LINE, line, 0);
+  table_read_lock(table);
+  char* result = piece_table_get_line_unlocked(table, line);
+  table_read_unlock(table);
+  trace_end(table, &trace, result != NULL);
+
+  return result;
+}
+
+bool piece_table_wait_loaded(piece_table* table)
+{
+  if(!table)
+  {
+    return false;
+  }
+
+  trace_call trace;
+  trace_begin(table, &trace, PIECE_TABLE_CALL_WAIT_LOADED, 0, 0);
+  bool result = file_loader_join(table, false);
+  trace_end(table, &trace, result);
+
+  return result;
+}
+
+bool piece_table_index_lines(const piece_table* table,
+                             const unsigned int threads,
+                             piece_table_progress progress,
+                             void* user_data)
+{
+  if(!table)
+  {
+    return false;
+  }
+
+  trace_call trace;
+  trace_begin(table, &trace, PIECE_TABLE_CALL_INDEX_LINES, 0, 0);
+
+  // sources are taken under the lock and indexed without it,
+  // text before their length never changes while they are referenced
+  table_read_lock(table);
+  unsigned int sources_count = table->sources_count;
+  text_buffer** sources =
+    (text_buffer**)table_alloc(table, sizeof(text_buffer*) * sources_count);
+  if(sources)
+  {
+    for(unsigned int i = 0; i < sources_count; i++)
+    {
+      sources[i] = table->sources[i];
+      text_buffer_retain(sources[i]);
+    }
+  }
+  table_read_unlock(table);
+  if(!sources)
+  {
+    trace_end(table, &trace, false);
+    return false;
+  }
+
+  // add buffer of the table is left out, its pieces are small & scanned
+  size_t total_bytes = 0;
+  for(unsigned int i = 0; i < sources_count; i++)
+  {
+    total_bytes += i == ADD ? 0 : sources[i]->length;
+  }
+
+  bool result = true;
+  size_t done_bytes = 0;
+  for(unsigned int i = 0; i < sources_count; i++)
+  {
+    if(i != ADD)
+    {
+      result = line_index_build(sources[i],
+                                threads,
+                                progress,
+                                done_bytes,
+                                total_bytes,
+                                user_data,
+                                NULL) &&
+               result;
+      done_bytes += sources[i]->length;
+    }
+    text_buffer_release(sources[i]);
+  }
+  table_free(table, sources);
+  trace_end(table, &trace, result);
+
+  return result;
+}
+
+char* piece_table_get_slice(const piece_table* table,
+                            const unsigned int position,
+                            const unsigned int length)
+{
+  trace_call trace;
+  trace_begin(table, &trace, PIECE_TABLE_CALL_GET_SLICE, position, length);
+  table_read_lock(table);
+  char* result = piece_table_get_slice_unlocked(table, position, length);
+  table_read_unlock(table);
+  trace_end(table, &trace, result != NULL);
+
+  return result;
+}
+
+int piece_table_get_length(const piece_table* table)
+{
+  table_read_lock(table);
+  int result = piece_table_get_length_unlocked(table);
+  table_read_unlock(table);
+
+  return result;
+}
+
+char* piece_table_to_string(const piece_table* table)
+{
+  trace_call trace;
+  trace_begin(table, &trace, PIECE_TABLE_CALL_TO_STRING, 0, 0);
+  table_read_lock(table);
+  char* result = piece_table_to_string_unlocked(table);
+  table_read_unlock(table);
+  trace_end(table, &trace, result != NULL);
+
+  return result;
+}
+
+piece_table* piece_table_clone(const piece_table* table)
+{
+  trace_call trace;
+  trace_begin(table, &trace, PIECE_TABLE_CALL_CLONE, 0, 0);
+  table_read_lock(table);
+  piece_table* clone = piece_table_clone_unlocked(table);
+  table_read_unlock(table);
+  trace_end(table, &trace, clone != NULL);
+  return clone;
+}
+
+bool piece_table_freeze(piece_table* table)
+{
+  trace_call trace;
+  trace_begin(table, &trace, PIECE_TABLE_CALL_FREEZE, 0, 0);
+  table_write_lock(table);
+  bool result = piece_table_freeze_unlocked(table);
+  table_write_unlock(table);
+  trace_end(table, &trace, result);
+
+  return result;
+}
+
+bool piece_table_compact(piece_table* table)
+{
+  trace_call trace;
+  trace_begin(table, &trace, PIECE_TABLE_CALL_COMPACT, 0, 0);
+  table_write_lock(table);
+  bool result = piece_table_compact_unlocked(table);
+  table_write_unlock(table);
+  trace_end(table, &trace, result);
+
+  return result;
+}
+
+bool piece_table_use_huge_pages(piece_table* table, const bool enable)
+{
+  table_write_lock(table);
+  bool result = piece_table_use_huge_pages_unlocked(table, enable);
+  table_write_unlock(table);
+
+  return result;
+}
+
+bool piece_table_advise(const piece_table* table,
+                        const piece_table_access access)
+{
+  table_read_lock(table);
+  bool result = piece_table_advise_unlocked(table, access);
+  table_read_unlock(table);
+
+  return result;
+}
+
+bool piece_table_memory_stats(const piece_table* table,
+                              piece_table_memory_usage* stats)
+{
+  table_read_lock(table);
+  bool result = piece_table_memory_stats_unlocked(table, stats);
+  table_read_unlock(table);
+
+  return result;
+}
+
+bool piece_table_set_tracer(piece_table* table,
+                            const piece_table_tracer* tracer)
+{
+  table_write_lock(table);
+  bool result = piece_table_set_tracer_unlocked(table, tracer);
+  table_write_unlock(table);
+
+  return result;
+}
+
+bool piece_table_get_stats(const piece_table* table, piece_table_stats* stats)
+{
+  table_read_lock(table);
+  bool result = piece_table_get_stats_unlocked(table, stats);
+  table_read_unlock(table);
+
+  return result;
+}
+
+bool piece_table_reset_stats(piece_table* table)
+{
+  // counters are atomic, readers may keep counting meanwhile
+  table_read_lock(table);
+  bool result = piece_table_reset_stats_unlocked(table);
+  table_read_unlock(table);
+
+  return result;
+}
+
+bool piece_table_log(piece_table* table)
+{
+  table_read_lock(table);
+  bool result = piece_table_log_unlocked(table);
+  table_read_unlock(table);
+
+  return result;
+}
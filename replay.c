@@ -0,0 +1,746 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "piece-table.h"
+
+#ifdef _WIN32
+#  include <windows.h>
+#else
+#  include <time.h>
+#endif
+
+// Replays a recorded editing trace through piece_table_insert() and
+// piece_table_remove(), reporting time, latency histogram, pieces & memory,
+// and checking the final text against the expected one.
+//   gcc -O2 replay.c piece_table.c -o replay -lpthread
+//   ./replay trace.json [expected.txt]
+// Add -DPIECE_TABLE_STATS to print operation counters as well.
+//
+// Traces are either JSON, as published with text editing traces:
+//   {"startContent": "...", "endContent": "...",
+//    "txns": [{"patches": [[position, deleted, "inserted"], ...]}, ...]}
+// or {"edits": [[position, deleted, "inserted"], ...], "finalText": "..."},
+// or text, one patch per line with \n, \t, \r & \\ escaped in texts:
+//   # comment
+//   < start content
+//   > expected content
+//   position deleted inserted
+// Positions are byte offsets, traces with non-ASCII text should be
+// converted to byte offsets first.
+
+#define HISTOGRAM_BUCKETS 24
+
+typedef struct patch
+{
+  unsigned int position;
+  unsigned int deleted;
+  char* inserted;
+} patch;
+
+typedef struct trace
+{
+  char* start_content;
+  char* end_content;
+  patch* patches;
+  unsigned int count;
+  unsigned int capacity;
+  bool non_ascii;
+} trace;
+
+typedef struct parser
+{
+  const char* cursor;
+  const char* end;
+} parser;
+
+double now_seconds()
+{
+#ifdef _WIN32
+  LARGE_INTEGER frequency, counter;
+  QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&counter);
+  return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+#endif
+}
+
+char* read_file(const char* path, size_t* length)
+{
+  FILE* file = fopen(path, "rb");
+  if(!file)
+  {
+    return NULL;
+  }
+
+  fseek(file, 0, SEEK_END);
+  long file_length = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  if(file_length < 0)
+  {
+    fclose(file);
+    return NULL;
+  }
+
+  char* data = (char*)malloc((size_t)file_length + 1);
+  if(!data || fread(data, 1, (size_t)file_length, file) != (size_t)file_length)
+  {
+    free(data);
+    fclose(file);
+    return NULL;
+  }
+  data[file_length] = '\0';
+  fclose(file);
+
+  *length = (size_t)file_length;
+  return data;
+}
+
+bool add_patch(trace* t,
+               const unsigned int position,
+               const unsigned int deleted,
+               char* inserted)
+{
+  if(t->count == t->capacity)
+  {
+    unsigned int capacity = t->capacity ? t->capacity * 2 : 1024;
+    patch* patches = (patch*)realloc(t->patches, sizeof(patch) * capacity);
+    if(!patches)
+    {
+      return false;
+    }
+    t->patches = patches;
+    t->capacity = capacity;
+  }
+
+  for(const char* c = inserted; c && *c; c++)
+  {
+    t->non_ascii = t->non_ascii || (unsigned char)*c >= 0x80;
+  }
+
+  t->patches[t->count].position = position;
+  t->patches[t->count].deleted = deleted;
+  t->patches[t->count].inserted = inserted;
+  t->count++;
+  return true;
+}
+
+/// JSON Traces
+
+void skip_space(parser* p)
+{
+  while(p->cursor < p->end &&
+        (*p->cursor == ' ' || *p->cursor == '\n' || *p->cursor == '\r' ||
+         *p->cursor == '\t'))
+  {
+    p->cursor++;
+  }
+}
+
+bool expect(parser* p, const char c)
+{
+  skip_space(p);
+  if(p->cursor < p->end && *p->cursor == c)
+  {
+    p->cursor++;
+    return true;
+  }
+  return false;
+}
+
+// appends code point as UTF-8
+char* put_utf8(char* out, const unsigned long code_point)
+{
+  if(code_point < 0x80)
+  {
+    *out++ = (char)code_point;
+  }
+  else if(code_point < 0x800)
+  {
+    *out++ = (char)(0xC0 | (code_point >> 6));
+    *out++ = (char)(0x80 | (code_point & 0x3F));
+  }
+  else if(code_point < 0x10000)
+  {
+    *out++ = (char)(0xE0 | (code_point >> 12));
+    *out++ = (char)(0x80 | ((code_point >> 6) & 0x3F));
+    *out++ = (char)(0x80 | (code_point & 0x3F));
+  }
+  else
+  {
+    *out++ = (char)(0xF0 | (code_point >> 18));
+    *out++ = (char)(0x80 | ((code_point >> 12) & 0x3F));
+    *out++ = (char)(0x80 | ((code_point >> 6) & 0x3F));
+    *out++ = (char)(0x80 | (code_point & 0x3F));
+  }
+  return out;
+}
+
+bool parse_hex4(parser* p, unsigned long* value)
+{
+  if(p->end - p->cursor < 4)
+  {
+    return false;
+  }
+  *value = 0;
+  for(int i = 0; i < 4; i++)
+  {
+    char c = *p->cursor++;
+    *value <<= 4;
+    if(c >= '0' && c <= '9')
+    {
+      *value |= (unsigned long)(c - '0');
+    }
+    else if(c >= 'a' && c <= 'f')
+    {
+      *value |= (unsigned long)(c - 'a' + 10);
+    }
+    else if(c >= 'A' && c <= 'F')
+    {
+      *value |= (unsigned long)(c - 'A' + 10);
+    }
+    else
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool parse_string(parser* p, char** string)
+{
+  if(!expect(p, '"'))
+  {
+    return false;
+  }
+
+  // unescaped string is never longer than the escaped one
+  const char* close = p->cursor;
+  while(close < p->end && *close != '"')
+  {
+    close += *close == '\\' ? 2 : 1;
+  }
+  char* out = (char*)malloc((size_t)(close - p->cursor) + 1);
+  if(!out)
+  {
+    return false;
+  }
+  *string = out;
+
+  while(p->cursor < p->end && *p->cursor != '"')
+  {
+    char c = *p->cursor++;
+    if(c != '\\')
+    {
+      *out++ = c;
+      continue;
+    }
+    if(p->cursor >= p->end)
+    {
+      return false;
+    }
+    c = *p->cursor++;
+    switch(c)
+    {
+      case 'n': *out++ = '\n'; break;
+      case 't': *out++ = '\t'; break;
+      case 'r': *out++ = '\r'; break;
+      case 'b': *out++ = '\b'; break;
+      case 'f': *out++ = '\f'; break;
+      case 'u':
+      {
+        unsigned long code_point = 0, low = 0;
+        if(!parse_hex4(p, &code_point))
+        {
+          return false;
+        }
+        // surrogate pair
+        if(code_point >= 0xD800 && code_point < 0xDC00 &&
+           p->end - p->cursor >= 6 && p->cursor[0] == '\\' &&
+           p->cursor[1] == 'u')
+        {
+          p->cursor += 2;
+          if(!parse_hex4(p, &low))
+          {
+            return false;
+          }
+          code_point = 0x10000 + ((code_point - 0xD800) << 10) + (low - 0xDC00);
+        }
+        out = put_utf8(out, code_point);
+        break;
+      }
+      default: *out++ = c; break;
+    }
+  }
+  *out = '\0';
+
+  return expect(p, '"');
+}
+
+bool parse_number(parser* p, unsigned int* number)
+{
+  skip_space(p);
+  char* number_end = NULL;
+  long value = strtol(p->cursor, &number_end, 10);
+  if(number_end == p->cursor || value < 0)
+  {
+    return false;
+  }
+  p->cursor = number_end;
+  *number = (unsigned int)value;
+  return true;
+}
+
+bool skip_value(parser* p)
+{
+  skip_space(p);
+  if(p->cursor >= p->end)
+  {
+    return false;
+  }
+
+  if(*p->cursor == '"')
+  {
+    char* string = NULL;
+    bool parsed = parse_string(p, &string);
+    free(string);
+    return parsed;
+  }
+
+  if(*p->cursor == '{' || *p->cursor == '[')
+  {
+    char close = *p->cursor == '{' ? '}' : ']';
+    p->cursor++;
+    if(expect(p, close))
+    {
+      return true;
+    }
+    do
+    {
+      if(close == '}')
+      {
+        if(!skip_value(p) || !expect(p, ':'))
+        {
+          return false;
+        }
+      }
+      if(!skip_value(p))
+      {
+        return false;
+      }
+    } while(expect(p, ','));
+    return expect(p, close);
+  }
+
+  // numbers, true, false & null
+  while(p->cursor < p->end && !strchr(",]} \n\r\t", *p->cursor))
+  {
+    p->cursor++;
+  }
+  return true;
+}
+
+// [position, deleted, "inserted"], inserted text is optional
+bool parse_patch(parser* p, trace* t)
+{
+  unsigned int position = 0, deleted = 0;
+  char* inserted = NULL;
+  if(!expect(p, '[') || !parse_number(p, &position) || !expect(p, ',') ||
+     !parse_number(p, &deleted))
+  {
+    return false;
+  }
+  if(expect(p, ',') && !parse_string(p, &inserted))
+  {
+    free(inserted);
+    return false;
+  }
+  if(!expect(p, ']') || !add_patch(t, position, deleted, inserted))
+  {
+    free(inserted);
+    return false;
+  }
+  return true;
+}
+
+bool parse_patches(parser* p, trace* t)
+{
+  if(!expect(p, '['))
+  {
+    return false;
+  }
+  if(expect(p, ']'))
+  {
+    return true;
+  }
+  do
+  {
+    if(!parse_patch(p, t))
+    {
+      return false;
+    }
+  } while(expect(p, ','));
+  return expect(p, ']');
+}
+
+bool parse_transaction(parser* p, trace* t)
+{
+  if(!expect(p, '{'))
+  {
+    return false;
+  }
+  if(expect(p, '}'))
+  {
+    return true;
+  }
+  do
+  {
+    char* key = NULL;
+    if(!parse_string(p, &key) || !expect(p, ':'))
+    {
+      free(key);
+      return false;
+    }
+    bool parsed =
+      strcmp(key, "patches") == 0 ? parse_patches(p, t) : skip_value(p);
+    free(key);
+    if(!parsed)
+    {
+      return false;
+    }
+  } while(expect(p, ','));
+  return expect(p, '}');
+}
+
+bool parse_transactions(parser* p, trace* t)
+{
+  if(!expect(p, '['))
+  {
+    return false;
+  }
+  if(expect(p, ']'))
+  {
+    return true;
+  }
+  do
+  {
+    if(!parse_transaction(p, t))
+    {
+      return false;
+    }
+  } while(expect(p, ','));
+  return expect(p, ']');
+}
+
+bool parse_json_trace(const char* data, const size_t length, trace* t)
+{
+  parser p = {data, data + length};
+  if(!expect(&p, '{'))
+  {
+    return false;
+  }
+  if(expect(&p, '}'))
+  {
+    return true;
+  }
+  do
+  {
+    char* key = NULL;
+    if(!parse_string(&p, &key) || !expect(&p, ':'))
+    {
+      free(key);
+      return false;
+    }
+
+    bool parsed = false;
+    if(strcmp(key, "startContent") == 0)
+    {
+      parsed = parse_string(&p, &t->start_content);
+    }
+    else if(strcmp(key, "endContent") == 0 || strcmp(key, "finalText") == 0)
+    {
+      parsed = parse_string(&p, &t->end_content);
+    }
+    else if(strcmp(key, "txns") == 0)
+    {
+      parsed = parse_transactions(&p, t);
+    }
+    else if(strcmp(key, "edits") == 0)
+    {
+      parsed = parse_patches(&p, t);
+    }
+    else
+    {
+      parsed = skip_value(&p);
+    }
+    free(key);
+    if(!parsed)
+    {
+      return false;
+    }
+  } while(expect(&p, ','));
+
+  return expect(&p, '}');
+}
+
+/// Text Traces
+
+char* unescape_line(const char* line, const char* line_end)
+{
+  char* out = (char*)malloc((size_t)(line_end - line) + 1);
+  if(!out)
+  {
+    return NULL;
+  }
+
+  char* o = out;
+  while(line < line_end)
+  {
+    char c = *line++;
+    if(c == '\\' && line < line_end)
+    {
+      c = *line++;
+      c = c == 'n' ? '\n' : c == 't' ? '\t' : c == 'r' ? '\r' : c;
+    }
+    *o++ = c;
+  }
+  *o = '\0';
+  return out;
+}
+
+bool parse_text_trace(const char* data, const size_t length, trace* t)
+{
+  const char* end = data + length;
+  const char* line = data;
+  while(line < end)
+  {
+    const char* line_end = (const char*)memchr(line, '\n', end - line);
+    if(!line_end)
+    {
+      line_end = end;
+    }
+    const char* content_end =
+      line_end > line && line_end[-1] == '\r' ? line_end - 1 : line_end;
+
+    if(line < content_end && *line == '<')
+    {
+      t->start_content = unescape_line(line + 2 > content_end ? content_end
+                                                              : line + 2,
+                                       content_end);
+    }
+    else if(line < content_end && *line == '>')
+    {
+      t->end_content = unescape_line(line + 2 > content_end ? content_end
+                                                            : line + 2,
+                                     content_end);
+    }
+    else if(line < content_end && *line != '#')
+    {
+      char* number_end = NULL;
+      unsigned long position = strtoul(line, &number_end, 10);
+      if(number_end == line)
+      {
+        return false;
+      }
+      const char* text = number_end;
+      unsigned long deleted = strtoul(text, &number_end, 10);
+      if(number_end == text)
+      {
+        return false;
+      }
+      text = number_end < content_end && *number_end == ' ' ? number_end + 1
+                                                            : number_end;
+      char* inserted = unescape_line(text, content_end);
+      if(!inserted || !add_patch(t,
+                                 (unsigned int)position,
+                                 (unsigned int)deleted,
+                                 inserted))
+      {
+        free(inserted);
+        return false;
+      }
+    }
+
+    line = line_end + 1;
+  }
+
+  return true;
+}
+
+/// Replay
+
+void print_histogram(const unsigned int* buckets, const unsigned int count)
+{
+  printf("latency histogram:\n");
+  for(unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++)
+  {
+    if(buckets[i] == 0)
+    {
+      continue;
+    }
+
+    unsigned int bar = (unsigned int)(50.0 * buckets[i] / count + 0.5);
+    if(i == 0)
+    {
+      printf("  %8s < %-7u us %10u ", "", 1u, buckets[i]);
+    }
+    else
+    {
+      printf("  %8u - %-7u us %10u ", 1u << (i - 1), 1u << i, buckets[i]);
+    }
+    for(unsigned int j = 0; j < bar; j++)
+    {
+      putchar('#');
+    }
+    putchar('\n');
+  }
+}
+
+int main(int argc, char** argv)
+{
+  if(argc < 2)
+  {
+    printf("Usage: %s trace.json|trace.txt [expected.txt]\n", argv[0]);
+    return 1;
+  }
+
+  size_t length = 0;
+  char* data = read_file(argv[1], &length);
+  if(!data)
+  {
+    printf("Unable to read %s!\n", argv[1]);
+    return 1;
+  }
+
+  trace t = {NULL, NULL, NULL, 0, 0, false};
+  const char* first = data;
+  while(first < data + length && strchr(" \n\r\t", *first))
+  {
+    first++;
+  }
+  bool parsed = first < data + length && *first == '{'
+                  ? parse_json_trace(data, length, &t)
+                  : parse_text_trace(data, length, &t);
+  free(data);
+  if(!parsed)
+  {
+    printf("Unable to parse %s!\n", argv[1]);
+    return 1;
+  }
+  if(argc > 2)
+  {
+    free(t.end_content);
+    t.end_content = read_file(argv[2], &length);
+    if(!t.end_content)
+    {
+      printf("Unable to read %s!\n", argv[2]);
+      return 1;
+    }
+  }
+  if(t.non_ascii)
+  {
+    printf("Warning: trace has non-ASCII text, positions are taken as "
+           "byte offsets!\n");
+  }
+
+  piece_table* pt = piece_table_from_string(t.start_content ? t.start_content
+                                                            : "");
+  if(!pt)
+  {
+    printf("Cannot create piece_table!\n");
+    return 1;
+  }
+
+  unsigned int buckets[HISTOGRAM_BUCKETS] = {0};
+  unsigned int failed = 0;
+  double total = 0, slowest = 0;
+  for(unsigned int i = 0; i < t.count; i++)
+  {
+    const patch* p = &t.patches[i];
+    double start = now_seconds();
+    if(p->deleted > 0 && !piece_table_remove(pt, p->position, p->deleted))
+    {
+      failed++;
+    }
+    if(p->inserted && p->inserted[0] &&
+       !piece_table_insert(pt, p->position, p->inserted))
+    {
+      failed++;
+    }
+    double elapsed = now_seconds() - start;
+
+    total += elapsed;
+    slowest = elapsed > slowest ? elapsed : slowest;
+    unsigned int bucket = 0;
+    for(double us = elapsed * 1e6; us >= 1 && bucket + 1 < HISTOGRAM_BUCKETS;
+        us /= 2)
+    {
+      bucket++;
+    }
+    buckets[bucket]++;
+  }
+
+  printf("patches: %u in %.3f s, %.0f patches/s, max %.1f us\n",
+         t.count,
+         total,
+         total > 0 ? t.count / total : 0,
+         slowest * 1e6);
+  print_histogram(buckets, t.count ? t.count : 1);
+
+  piece_table_memory_usage usage;
+  piece_table_memory_stats(pt, &usage);
+  printf("length: %d, pieces: %zu, library: %zu bytes "
+         "(add buffer %zu, pieces %zu, undo %zu)\n",
+         piece_table_get_length(pt),
+         usage.pieces_count,
+         usage.total_bytes,
+         usage.add_buffer_capacity_bytes,
+         usage.pieces_bytes,
+         usage.undo_records_bytes + usage.redo_records_bytes);
+
+  // only counted when built with -DPIECE_TABLE_STATS
+  piece_table_stats stats;
+  if(piece_table_get_stats(pt, &stats))
+  {
+    printf("lookups: %zu, %.1f pieces visited per lookup, splits: %zu\n",
+           stats.lookups,
+           stats.lookups ? (double)stats.pieces_visited / stats.lookups : 0,
+           stats.splits);
+    printf("pieces allocated: %zu, freed: %zu, undo records: %zu\n",
+           stats.pieces_allocated,
+           stats.pieces_freed,
+           stats.undo_records);
+    printf("add buffer reallocations: %zu, %zu bytes copied, "
+           "%zu bytes appended\n",
+           stats.add_buffer_reallocations,
+           stats.add_buffer_bytes_copied,
+           stats.add_buffer_bytes_appended);
+  }
+
+  int result = failed ? 1 : 0;
+  if(failed)
+  {
+    printf("%u patches failed!\n", failed);
+  }
+  if(t.end_content)
+  {
+    char* text = piece_table_to_string(pt);
+    bool matches = text && strcmp(text, t.end_content) == 0;
+    printf("final content: %s\n", matches ? "matches" : "DIFFERS");
+    result = matches ? result : 1;
+    free(text);
+  }
+
+  piece_table_free(pt);
+  for(unsigned int i = 0; i < t.count; i++)
+  {
+    free(t.patches[i].inserted);
+  }
+  free(t.patches);
+  free(t.start_content);
+  free(t.end_content);
+
+  return result;
+}
@@ -0,0 +1,1555 @@
+#if defined(__unix__) && !defined(_XOPEN_SOURCE)
+// for ftruncate() & fileno() in strict C99
+#  define _XOPEN_SOURCE 700
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "piece-table.h"
+
+#ifdef _WIN32
+#  include <process.h>
+#  include <windows.h>
+#  define process_id _getpid
+#else
+#  include <pthread.h>
+#  include <time.h>
+#  include <unistd.h>
+#  define process_id getpid
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#  include <sys/stat.h>
+#endif
+
+// Checks public functions against expected text & memory counters.
+// Meant to run under ASan/LSan too, so leaks fail the run:
+//   gcc -fsanitize=address,undefined test_api.c piece_table.c -o test_api
+// and under TSan, so races between threads sharing a table fail it too:
+//   gcc -fsanitize=thread test_api.c piece_table.c -o test_api -lpthread
+
+// Longest wait for a callback before its test fails instead of hanging
+#define CALLBACK_TIMEOUT_SECONDS 30
+
+// Set once by a callback on another thread, waited for by the test
+typedef struct test_event
+{
+#ifdef _WIN32
+  SRWLOCK lock;
+  CONDITION_VARIABLE changed;
+#else
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+#endif
+  bool set;
+} test_event;
+
+void test_event_init(test_event* event)
+{
+#ifdef _WIN32
+  InitializeSRWLock(&event->lock);
+  InitializeConditionVariable(&event->changed);
+#else
+  pthread_mutex_init(&event->lock, NULL);
+  pthread_cond_init(&event->changed, NULL);
+#endif
+  event->set = false;
+}
+
+void test_event_destroy(test_event* event)
+{
+#ifndef _WIN32
+  pthread_cond_destroy(&event->changed);
+  pthread_mutex_destroy(&event->lock);
+#else
+  (void)event;
+#endif
+}
+
+void test_event_set(test_event* event)
+{
+#ifdef _WIN32
+  AcquireSRWLockExclusive(&event->lock);
+  event->set = true;
+  WakeAllConditionVariable(&event->changed);
+  ReleaseSRWLockExclusive(&event->lock);
+#else
+  pthread_mutex_lock(&event->lock);
+  event->set = true;
+  pthread_cond_broadcast(&event->changed);
+  pthread_mutex_unlock(&event->lock);
+#endif
+}
+
+bool test_event_wait(test_event* event)
+{
+#ifdef _WIN32
+  ULONGLONG deadline = GetTickCount64() + CALLBACK_TIMEOUT_SECONDS * 1000;
+  AcquireSRWLockExclusive(&event->lock);
+  while(!event->set)
+  {
+    ULONGLONG now = GetTickCount64();
+    if(now >= deadline ||
+       (!SleepConditionVariableSRW(
+          &event->changed, &event->lock, (DWORD)(deadline - now), 0) &&
+        GetLastError() != ERROR_TIMEOUT))
+    {
+      break;
+    }
+  }
+  bool set = event->set;
+  ReleaseSRWLockExclusive(&event->lock);
+#else
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += CALLBACK_TIMEOUT_SECONDS;
+  pthread_mutex_lock(&event->lock);
+  int error = 0;
+  while(!event->set && error != ETIMEDOUT)
+  {
+    error = pthread_cond_timedwait(&event->changed, &event->lock, &deadline);
+  }
+  bool set = event->set;
+  pthread_mutex_unlock(&event->lock);
+#endif
+  if(!set)
+  {
+    printf("Timed out waiting for a callback\n");
+  }
+  return set;
+}
+
+// Temp files are named after the process, so test_api & test_api_asan
+// can run at once, e.g. with ctest -j
+void temp_path(char* path, const size_t size, const char* name)
+{
+  snprintf(path, size, "test_api_%ld_%s.tmp", (long)process_id(), name);
+}
+
+bool expect_text(const piece_table* pt, const char* expected)
+{
+  char* text = piece_table_to_string(pt);
+  bool matches = text && strcmp(text, expected) == 0;
+  if(!matches)
+  {
+    printf("Expected \"%s\", got \"%s\"\n", expected, text ? text : "NULL");
+  }
+  free(text);
+  return matches;
+}
+
+bool expect_count(const char* name, size_t count, size_t expected)
+{
+  if(count != expected)
+  {
+    printf("Expected %s %zu, got %zu\n", name, expected, count);
+    return false;
+  }
+  return true;
+}
+
+bool expect_string(char* string, const char* expected)
+{
+  bool matches = string && strcmp(string, expected) == 0;
+  if(!matches)
+  {
+    printf("Expected \"%s\", got \"%s\"\n",
+           expected,
+           string ? string : "NULL");
+  }
+  free(string);
+  return matches;
+}
+
+bool test_remove()
+{
+  piece_table* pt = piece_table_from_string("Hola\nCola");
+  if(!pt)
+  {
+    printf("Cannot create piece_table!\n");
+    return false;
+  }
+
+  // range from inside the first piece to inside the last one,
+  // with whole pieces between them
+  bool result = piece_table_insert(pt, 4, ", Hehe") &&
+                piece_table_insert(pt, 10, "!") &&
+                expect_text(pt, "Hola, Hehe!\nCola") &&
+                !piece_table_remove(pt, 2, 100) &&
+                piece_table_remove(pt, 2, 11) && expect_text(pt, "Hoola");
+
+  // undo relinks the removed pieces, redo their replacements,
+  // freeing leaves the undone remove owning the replacements
+  result = result && piece_table_undo(pt) &&
+           expect_text(pt, "Hola, Hehe!\nCola") && piece_table_redo(pt) &&
+           expect_text(pt, "Hoola") && piece_table_undo(pt) &&
+           expect_text(pt, "Hola, Hehe!\nCola");
+
+  piece_table_free(pt);
+
+  // removes of whole pieces from the start, then of the whole text
+  pt = piece_table_from_string("Hola\nCola");
+  if(!pt)
+  {
+    printf("Cannot create piece_table!\n");
+    return false;
+  }
+  result = result && piece_table_insert(pt, 0, "Ay ") &&
+           piece_table_remove(pt, 0, 7) && expect_text(pt, "\nCola") &&
+           piece_table_remove(pt, 0, 5) && expect_text(pt, "") &&
+           piece_table_get_length(pt) == 0 && piece_table_undo(pt) &&
+           expect_text(pt, "\nCola") && piece_table_undo(pt) &&
+           expect_text(pt, "Ay Hola\nCola") && piece_table_redo(pt) &&
+           expect_text(pt, "\nCola");
+
+  piece_table_free(pt);
+  return result;
+}
+
+bool test_freeze()
+{
+  piece_table* pt = piece_table_from_string("Hola\nCola\nGola");
+  if(!pt)
+  {
+    printf("Cannot create piece_table!\n");
+    return false;
+  }
+
+  // removes detach pieces only their undo records own
+  bool result = piece_table_insert(pt, 4, ", Hehe") &&
+                piece_table_remove(pt, 2, 4) &&
+                piece_table_remove(pt, 0, 1) &&
+                expect_text(pt, "oHehe\nCola\nGola");
+
+  result = result && piece_table_freeze(pt) &&
+           expect_text(pt, "oHehe\nCola\nGola");
+
+  piece_table_memory_usage usage;
+  result = result && piece_table_memory_stats(pt, &usage) &&
+           expect_count("pieces", usage.pieces_count, 1) &&
+           expect_count("undo records", usage.undo_records_count, 0) &&
+           expect_count("undo bytes", usage.undo_records_bytes, 0) &&
+           expect_count("add buffer bytes", usage.add_buffer_used_bytes, 0);
+
+  // freed history is not undone into
+  result = result && !piece_table_undo(pt) && piece_table_insert(pt, 0, "F") &&
+           expect_text(pt, "FoHehe\nCola\nGola");
+
+  piece_table_free(pt);
+
+  // undone records own the pieces they unlinked instead
+  pt = piece_table_from_string("Hola\nCola\nGola");
+  if(!pt)
+  {
+    printf("Cannot create piece_table!\n");
+    return false;
+  }
+  result = result && piece_table_remove(pt, 2, 4) && piece_table_undo(pt) &&
+           piece_table_start_micro_inserts(pt, 4) &&
+           piece_table_micro_insert(pt, "!") &&
+           piece_table_stop_micro_inserts(pt) && piece_table_undo(pt) &&
+           expect_text(pt, "Hola\nCola\nGola") && piece_table_freeze(pt) &&
+           piece_table_memory_stats(pt, &usage) &&
+           expect_count("pieces", usage.pieces_count, 1) &&
+           expect_count("redo records", usage.redo_records_count, 0) &&
+           expect_text(pt, "Hola\nCola\nGola");
+
+  piece_table_free(pt);
+  return result;
+}
+
+bool test_add_buffer_waste()
+{
+  piece_table* pt = piece_table_from_string("Hola");
+  if(!pt)
+  {
+    printf("Cannot create piece_table!\n");
+    return false;
+  }
+
+  // pieces left & right of the remove overlap the removed one,
+  // the undone insert leaves 3 bytes nothing references
+  piece_table_memory_usage usage;
+  bool result = piece_table_insert(pt, 4, "abcdef") &&
+                piece_table_remove(pt, 6, 2) &&
+                piece_table_insert(pt, 0, "XYZ") &&
+                piece_table_memsafe_undo(pt) &&
+                expect_text(pt, "Holaabef") &&
+                piece_table_memory_stats(pt, &usage) &&
+                expect_count("add bytes", usage.add_buffer_used_bytes, 9) &&
+                expect_count("wasted bytes", usage.add_buffer_wasted_bytes, 3);
+
+  result = result && piece_table_compact(pt) && expect_text(pt, "Holaabef") &&
+           piece_table_memory_stats(pt, &usage) &&
+           expect_count("add bytes", usage.add_buffer_used_bytes, 6) &&
+           expect_count("wasted bytes", usage.add_buffer_wasted_bytes, 0);
+
+  // only the remove record references "cd", a clone has no history
+  piece_table* clone = result ? piece_table_clone(pt) : NULL;
+  result = result && clone && piece_table_memory_stats(clone, &usage) &&
+           expect_count("clone waste", usage.add_buffer_wasted_bytes, 2);
+  piece_table_free(clone);
+
+  result = result && piece_table_undo(pt) && piece_table_redo(pt) &&
+           piece_table_undo(pt) && expect_text(pt, "Holaabcdef") &&
+           piece_table_memory_stats(pt, &usage) &&
+           expect_count("undone waste", usage.add_buffer_wasted_bytes, 0);
+
+  piece_table* left = NULL;
+  piece_table* right = NULL;
+  result = result && piece_table_split_at(pt, 4, &left, &right) &&
+           piece_table_memory_stats(left, &usage) &&
+           expect_count("left waste", usage.add_buffer_wasted_bytes, 6) &&
+           piece_table_memory_stats(right, &usage) &&
+           expect_count("right waste", usage.add_buffer_wasted_bytes, 0);
+  piece_table_free(left);
+  piece_table_free(right);
+
+  // freezing drops history along with bytes only it referenced
+  result = result && piece_table_redo(pt) && piece_table_freeze(pt) &&
+           expect_text(pt, "Holaabef") &&
+           piece_table_memory_stats(pt, &usage) &&
+           expect_count("frozen waste", usage.add_buffer_wasted_bytes, 0);
+
+  piece_table_free(pt);
+  return result;
+}
+
+bool test_piece_index()
+{
+  piece_table* pt = piece_table_from_string("Hola\nCola\nGola");
+  if(!pt)
+  {
+    printf("Cannot create piece_table!\n");
+    return false;
+  }
+
+  // lookups right after edits walk the pieces,
+  // the index is built once lookups outnumber edits
+  piece_table_memory_usage usage;
+  bool result = true;
+  for(unsigned int i = 0; i < 8 && result; i++)
+  {
+    result = piece_table_insert(pt, 2 * i, "x") &&
+             piece_table_get_char_at(pt, 2 * i) == 'x' &&
+             piece_table_memory_stats(pt, &usage) &&
+             expect_count("piece index bytes", usage.piece_index_bytes, 0);
+  }
+
+  char* slice = NULL;
+  for(unsigned int i = 0; i < 8 && result; i++)
+  {
+    slice = piece_table_get_slice(pt, 0, 6);
+    result = slice && strcmp(slice, "xHxoxl") == 0 &&
+             piece_table_get_char_at(pt, 14) == 'x' &&
+             piece_table_get_length(pt) == 22;
+    free(slice);
+  }
+  result = result && piece_table_memory_stats(pt, &usage) &&
+           expect_text(pt, "xHxoxlxax\nxCxoxla\nGola");
+#ifndef PIECE_TABLE_NO_PIECE_INDEX
+  result = result && usage.piece_index_bytes > 0;
+#endif
+
+  // next edit drops it
+  result = result && piece_table_remove(pt, 0, 1) &&
+           piece_table_get_char_at(pt, 0) == 'H' &&
+           piece_table_memory_stats(pt, &usage) &&
+           expect_count("piece index bytes", usage.piece_index_bytes, 0);
+
+  piece_table_free(pt);
+  return result;
+}
+
+bool test_file_limit()
+{
+#if defined(__unix__) || defined(__APPLE__)
+  // sparse file one byte over the limit, no disk space is used
+  char path[64];
+  temp_path(path, sizeof(path), "large");
+  FILE* file = fopen(path, "wb");
+  bool result = file && ftruncate(fileno(file),
+                                  (off_t)PIECE_TABLE_MAX_LENGTH + 1) == 0;
+  if(file)
+  {
+    fclose(file);
+  }
+
+  errno = 0;
+  piece_table* pt = piece_table_from_file(path);
+  result = result && !pt && errno == EFBIG;
+  piece_table_free(pt);
+
+  pt = piece_table_from_string("Hola");
+  errno = 0;
+  result = result && pt && !piece_table_insert_file(pt, 0, path) &&
+           errno == EFBIG && expect_text(pt, "Hola");
+  piece_table_free(pt);
+
+  // string inserts stop at the limit too, micro inserts included
+  file = fopen(path, "wb");
+  result = result && file &&
+           ftruncate(fileno(file), (off_t)PIECE_TABLE_MAX_LENGTH - 1) == 0;
+  if(file)
+  {
+    fclose(file);
+  }
+
+  pt = piece_table_from_file(path);
+  unsigned int end = PIECE_TABLE_MAX_LENGTH - 1;
+  errno = 0;
+  result = result && pt && !piece_table_insert(pt, end, "ab") &&
+           errno == EFBIG && piece_table_insert(pt, end, "a") &&
+           piece_table_start_micro_inserts(pt, 0);
+  errno = 0;
+  result = result && !piece_table_micro_insert(pt, "b") && errno == EFBIG &&
+           piece_table_stop_micro_inserts(pt) &&
+           expect_count("length",
+                        (unsigned int)piece_table_get_length(pt),
+                        PIECE_TABLE_MAX_LENGTH);
+  piece_table_free(pt);
+
+  remove(path);
+  return result;
+#else
+  return true;
+#endif
+}
+
+#define READERS 4
+#define READER_ROUNDS 2000
+#define WRITER_ROUNDS 2000
+
+typedef struct reader_state
+{
+  piece_table* pt;
+  bool result;
+} reader_state;
+
+// Reads while the writer inserts & removes at the start of the second line
+// and appends to the last one, so the first line never changes
+void read_concurrently(reader_state* state)
+{
+  state->result = true;
+  for(unsigned int i = 0; i < READER_ROUNDS && state->result; i++)
+  {
+    char* slice = piece_table_get_slice(state->pt, 0, 5);
+    char* line = piece_table_get_line(state->pt, 1);
+    piece_table_view* view = piece_table_snapshot(state->pt);
+    char* text = view ? piece_table_view_to_string(view) : NULL;
+    state->result =
+      piece_table_get_char_at(state->pt, 0) == 'H' && slice &&
+      strcmp(slice, "Hola\n") == 0 && line && strcmp(line, "Hola") == 0 &&
+      text && strncmp(text, "Hola\n", 5) == 0 &&
+      strlen(text) == (size_t)piece_table_view_get_length(view);
+    free(text);
+    piece_table_view_release(view);
+    free(line);
+    free(slice);
+  }
+}
+
+#ifdef _WIN32
+DWORD WINAPI reader_thread(LPVOID state)
+{
+  read_concurrently((reader_state*)state);
+  return 0;
+}
+#else
+void* reader_thread(void* state)
+{
+  read_concurrently((reader_state*)state);
+  return NULL;
+}
+#endif
+
+#ifdef _WIN32
+typedef HANDLE reader_handle;
+#else
+typedef pthread_t reader_handle;
+#endif
+
+// Starts READERS threads reading pt, gives how many were started
+unsigned int start_readers(piece_table* pt,
+                           reader_state* states,
+                           reader_handle* threads)
+{
+  unsigned int started = 0;
+  for(; started < READERS; started++)
+  {
+    states[started].pt = pt;
+#ifdef _WIN32
+    threads[started] =
+      CreateThread(NULL, 0, reader_thread, &states[started], 0, NULL);
+    if(!threads[started])
+    {
+      break;
+    }
+#else
+    if(pthread_create(
+         &threads[started], NULL, reader_thread, &states[started]) != 0)
+    {
+      break;
+    }
+#endif
+  }
+
+  return started;
+}
+
+bool join_readers(const unsigned int started,
+                  reader_state* states,
+                  reader_handle* threads)
+{
+  bool result = true;
+  for(unsigned int i = 0; i < started; i++)
+  {
+#ifdef _WIN32
+    WaitForSingleObject(threads[i], INFINITE);
+    CloseHandle(threads[i]);
+#else
+    pthread_join(threads[i], NULL);
+#endif
+    result = result && states[i].result;
+  }
+
+  return result;
+}
+
+bool test_thread_safety()
+{
+  piece_table* pt = piece_table_from_string("Hola\nCola\nGola");
+  if(!pt || !piece_table_enable_thread_safety(pt))
+  {
+    printf("Cannot create piece_table!\n");
+    piece_table_free(pt);
+    return false;
+  }
+
+  reader_state states[READERS];
+  reader_handle threads[READERS];
+  unsigned int started = start_readers(pt, states, threads);
+
+  bool result = started == READERS;
+  for(unsigned int i = 0; i < WRITER_ROUNDS && result; i++)
+  {
+    result = piece_table_insert(pt, 5, "Ay ") &&
+             piece_table_remove(pt, 5, 3) &&
+             piece_table_insert(pt, piece_table_get_length(pt), "!");
+  }
+
+  result = join_readers(started, states, threads) && result;
+
+  result = result &&
+           expect_count("length",
+                        (size_t)piece_table_get_length(pt),
+                        14 + WRITER_ROUNDS) &&
+           expect_string(piece_table_get_slice(pt, 0, 16),
+                         "Hola\nCola\nGola!!");
+
+  piece_table_free(pt);
+  return result;
+}
+
+bool test_memsafe_insert_source()
+{
+  piece_table* pt = piece_table_from_string("Hola");
+  piece_table_source* source = piece_table_source_from_string(", Cola");
+  if(!pt || !source)
+  {
+    printf("Cannot create piece_table!\n");
+    piece_table_free(pt);
+    piece_table_source_release(source);
+    return false;
+  }
+
+  // undo records keep the source, so it's redone after being released
+  bool result = piece_table_insert_source(pt, 4, source) &&
+                piece_table_insert(pt, 0, "Ay ") &&
+                expect_text(pt, "Ay Hola, Cola");
+  piece_table_source_release(source);
+
+  result = result && piece_table_memsafe_undo(pt) &&
+           expect_text(pt, "Hola, Cola") && piece_table_memsafe_undo(pt) &&
+           expect_text(pt, "Hola") && !piece_table_memsafe_undo(pt) &&
+           piece_table_memsafe_redo(pt) && expect_text(pt, "Hola, Cola") &&
+           piece_table_memsafe_redo(pt) && expect_text(pt, "Ay Hola, Cola") &&
+           !piece_table_memsafe_redo(pt);
+
+  piece_table_memory_usage usage;
+  result = result && piece_table_memory_stats(pt, &usage) &&
+           expect_count("undo records", usage.undo_records_count, 2) &&
+           expect_count("redo records", usage.redo_records_count, 0);
+
+  piece_table_free(pt);
+  return result;
+}
+
+void loader_progress(size_t done_bytes, size_t total_bytes, void* user_data)
+{
+  (void)done_bytes;
+  (void)total_bytes;
+  test_event_set((test_event*)user_data);
+}
+
+bool test_line_index_wait()
+{
+  // several chunks of short lines, so the loader is still indexing them
+  // when the caller indexes lines too
+  char path[64];
+  temp_path(path, sizeof(path), "lines");
+  FILE* file = fopen(path, "wb");
+  if(!file)
+  {
+    printf("Cannot create %s!\n", path);
+    return false;
+  }
+  for(unsigned int i = 0; i < 1000000; i++)
+  {
+    fprintf(file, "line %07u\n", i);
+  }
+  fclose(file);
+
+  test_event indexing;
+  test_event_init(&indexing);
+  piece_table* pt = piece_table_from_file_async(
+    path, 1, loader_progress, NULL, &indexing);
+  if(!pt)
+  {
+    printf("Cannot create piece_table!\n");
+    test_event_destroy(&indexing);
+    remove(path);
+    return false;
+  }
+
+  // waits for the loader instead of returning before lines are indexed
+  piece_table_memory_usage indexed, loaded;
+  bool result = test_event_wait(&indexing) &&
+                piece_table_index_lines(pt, 2, NULL, NULL) &&
+                piece_table_memory_stats(pt, &indexed) &&
+                piece_table_wait_loaded(pt) &&
+                piece_table_memory_stats(pt, &loaded) &&
+                expect_count("line index bytes",
+                             indexed.line_index_bytes,
+                             loaded.line_index_bytes);
+
+  char* line = piece_table_get_line(pt, 1000000);
+  result = result && line && strcmp(line, "line 0999999") == 0;
+  free(line);
+
+  piece_table_free(pt);
+  test_event_destroy(&indexing);
+  remove(path);
+  return result;
+}
+
+typedef struct loaded_call
+{
+  bool free_table;
+  bool result;
+  test_event called;
+} loaded_call;
+
+void loaded_waits(piece_table* table, bool success, void* user_data)
+{
+  loaded_call* call = (loaded_call*)user_data;
+  call->result = success && piece_table_wait_loaded(table) &&
+                 expect_text(table, "Hola\nCola\n");
+  if(call->free_table)
+  {
+    piece_table_free(table);
+  }
+  test_event_set(&call->called);
+}
+
+bool test_loaded_callback()
+{
+  char path[64];
+  temp_path(path, sizeof(path), "loaded");
+  FILE* file = fopen(path, "wb");
+  if(!file)
+  {
+    printf("Cannot create %s!\n", path);
+    return false;
+  }
+  fputs("Hola\nCola\n", file);
+  fclose(file);
+
+  // waiting for or freeing the table from the loader thread detaches it
+  bool result = true;
+  for(int free_table = 0; free_table < 2 && result; free_table++)
+  {
+    loaded_call call;
+    call.free_table = free_table;
+    call.result = false;
+    test_event_init(&call.called);
+    piece_table* pt =
+      piece_table_from_file_async(path, 1, NULL, loaded_waits, &call);
+    result = pt != NULL && test_event_wait(&call.called) && call.result;
+    if(!free_table)
+    {
+      result = result && piece_table_wait_loaded(pt);
+      piece_table_free(pt);
+    }
+    test_event_destroy(&call.called);
+  }
+
+  remove(path);
+  return result;
+}
+
+bool test_save_mode()
+{
+#if defined(__unix__) || defined(__APPLE__)
+  // replaced file keeps its mode, the text is read back from it
+  char path[64];
+  temp_path(path, sizeof(path), "save");
+  FILE* file = fopen(path, "wb");
+  bool result = file && fputs("old", file) >= 0;
+  if(file)
+  {
+    fclose(file);
+  }
+  result = result && chmod(path, 0640) == 0;
+
+  piece_table* pt = piece_table_from_string("Hola\nCola");
+  struct stat saved;
+  result = result && pt && piece_table_save(pt, path) &&
+           stat(path, &saved) == 0 &&
+           expect_count("mode", saved.st_mode & 0777, 0640);
+  piece_table_free(pt);
+
+  pt = piece_table_from_file(path);
+  result = result && pt && expect_text(pt, "Hola\nCola");
+
+  // saving through a symlink replaces the file it points to
+  char link[64];
+  temp_path(link, sizeof(link), "link");
+  result = result && symlink(path, link) == 0 &&
+           piece_table_insert(pt, 0, "Ay ") && piece_table_save(pt, link) &&
+           lstat(link, &saved) == 0 && S_ISLNK(saved.st_mode) &&
+           stat(path, &saved) == 0 &&
+           expect_count("mode", saved.st_mode & 0777, 0640);
+  piece_table_free(pt);
+  pt = piece_table_from_file(path);
+  result = result && pt && expect_text(pt, "Ay Hola\nCola");
+  piece_table_free(pt);
+
+  remove(link);
+  remove(path);
+
+  // new file gets the mode open() would give it
+  mode_t mask = umask(027);
+  pt = piece_table_from_string("Hola");
+  result = result && pt && piece_table_save(pt, path) &&
+           stat(path, &saved) == 0 &&
+           expect_count("new mode", saved.st_mode & 0777, 0640);
+  remove(path);
+  umask(022);
+  result = result && pt && piece_table_save(pt, path) &&
+           stat(path, &saved) == 0 &&
+           expect_count("new mode", saved.st_mode & 0777, 0644);
+  umask(mask);
+  piece_table_free(pt);
+
+  remove(path);
+  return result;
+#else
+  return true;
+#endif
+}
+
+bool test_clone()
+{
+  piece_table* pt = piece_table_from_string("Hola\nCola");
+  if(!pt)
+  {
+    printf("Cannot create piece_table!\n");
+    return false;
+  }
+
+  // clone shares buffers & packed pieces, appends of either table
+  // don't show up in the other one
+  bool result = piece_table_insert(pt, 4, ", Hehe") &&
+                piece_table_get_char_at(pt, 5) == ' ';
+  piece_table* clone = piece_table_clone(pt);
+  result = result && clone && piece_table_insert(clone, 0, "Ay ") &&
+           piece_table_insert(pt, 0, "Oy ") &&
+           expect_text(clone, "Ay Hola, Hehe\nCola") &&
+           expect_text(pt, "Oy Hola, Hehe\nCola");
+
+  // clone outlives the table it was cloned from
+  piece_table_free(pt);
+  piece_table_memory_usage usage;
+  result = result && piece_table_remove(clone, 7, 6) &&
+           expect_text(clone, "Ay Hola\nCola") &&
+           piece_table_memory_stats(clone, &usage) &&
+           expect_count("clone undo records", usage.undo_records_count, 2);
+
+  piece_table_free(clone);
+  return result;
+}
+
+bool test_split_concat()
+{
+  piece_table* pt = piece_table_from_string("Hola\nCola");
+  if(!pt)
+  {
+    printf("Cannot create piece_table!\n");
+    return false;
+  }
+
+  piece_table* left = NULL;
+  piece_table* right = NULL;
+  bool result = piece_table_insert(pt, 4, ", Hehe") &&
+                !piece_table_split_at(pt, 100, &left, &right) &&
+                piece_table_split_at(pt, 7, &left, &right) &&
+                expect_text(left, "Hola, H") && expect_text(right, "ehe\nCola");
+  piece_table* joined = result ? piece_table_concat(right, left) : NULL;
+
+  // parts are tables of their own, sharing buffers of pt
+  piece_table_free(pt);
+  result = result && joined && expect_text(joined, "ehe\nColaHola, H") &&
+           piece_table_insert(left, 7, "ehe") &&
+           piece_table_insert(joined, 0, "H") &&
+           expect_text(left, "Hola, Hehe") &&
+           expect_text(right, "ehe\nCola") &&
+           expect_text(joined, "Hehe\nColaHola, H") &&
+           piece_table_get_length(joined) == 16;
+
+  piece_table_free(joined);
+  piece_table_free(left);
+  piece_table_free(right);
+
+  // a clone appends to the add buffer it shares past the end of its source,
+  // appends to their concatenation must keep what the clone appended
+  pt = piece_table_from_string("abc");
+  piece_table* clone = NULL;
+  result = result && pt && piece_table_insert(pt, 3, "def") &&
+           (clone = piece_table_clone(pt)) != NULL &&
+           piece_table_insert(clone, 6, "XYZ");
+  joined = result ? piece_table_concat(pt, clone) : NULL;
+  result = result && joined && expect_text(joined, "abcdefabcdefXYZ") &&
+           piece_table_insert(joined, 0, "123") &&
+           piece_table_insert(clone, 9, "!") &&
+           expect_text(joined, "123abcdefabcdefXYZ") &&
+           expect_text(clone, "abcdefXYZ!") && expect_text(pt, "abcdef");
+
+  piece_table_free(joined);
+  piece_table_free(clone);
+  piece_table_free(pt);
+  return result;
+}
+
+bool test_snapshot()
+{
+  piece_table* pt = piece_table_from_string("Hola\nCola");
+  if(!pt)
+  {
+    printf("Cannot create piece_table!\n");
+    return false;
+  }
+
+  bool result = piece_table_insert(pt, 4, ", Hehe");
+  piece_table_view* view = piece_table_snapshot(pt);
+  result = result && view && piece_table_remove(pt, 0, 6) &&
+           piece_table_insert(pt, 0, "X") && expect_text(pt, "XHehe\nCola");
+
+  // edits, freezing & freeing the table don't reach the view
+  result = result && piece_table_freeze(pt) && piece_table_compact(pt);
+  piece_table_free(pt);
+  result = result && piece_table_view_get_length(view) == 15 &&
+           piece_table_view_get_char_at(view, 6) == 'H' &&
+           piece_table_view_get_char_at(view, 15) == '\0' &&
+           expect_string(piece_table_view_get_slice(view, 4, 6), ", Hehe") &&
+           expect_string(piece_table_view_to_string(view),
+                         "Hola, Hehe\nCola") &&
+           expect_string(piece_table_view_to_string_parallel(view, 2),
+                         "Hola, Hehe\nCola");
+
+  piece_table_view_release(view);
+  return result;
+}
+
+bool test_sources()
+{
+  char path[64];
+  temp_path(path, sizeof(path), "source");
+  FILE* file = fopen(path, "wb");
+  if(!file)
+  {
+    printf("Cannot create %s!\n", path);
+    return false;
+  }
+  fputs("Gola\n", file);
+  fclose(file);
+
+  piece_table_source* source = piece_table_source_from_string("Hola\n");
+  piece_table* pt = source ? piece_table_from_source(source) : NULL;
+  piece_table* other = piece_table_from_string("Cola\n");
+  bool result = pt && other;
+
+  // the same source inserted twice is kept once
+  piece_table_memory_usage usage;
+  result = result && piece_table_insert_source(other, 0, source) &&
+           piece_table_insert_source(other, 10, source) &&
+           piece_table_insert_file(other, 5, path) &&
+           piece_table_insert_file(pt, 5, path) &&
+           !piece_table_insert_file(pt, 100, path) &&
+           !piece_table_insert_source(pt, 100, source) &&
+           expect_text(pt, "Hola\nGola\n") &&
+           expect_text(other, "Hola\nGola\nCola\nHola\n") &&
+           piece_table_memory_stats(other, &usage) &&
+           expect_count("sources", usage.sources_count, 2);
+
+  // tables keep their own references
+  result = piece_table_source_release(source) && result &&
+           piece_table_insert(pt, 0, "Ay ") &&
+           expect_text(pt, "Ay Hola\nGola\n") &&
+           expect_string(piece_table_get_line(other, 4), "Hola");
+
+  piece_table_free(pt);
+  piece_table_free(other);
+  remove(path);
+  return result;
+}
+
+bool test_to_string_parallel()
+{
+  // several MiB, so more than one thread copies
+  const unsigned int length = 3u << 20;
+  char* string = (char*)malloc(length + 1);
+  if(!string)
+  {
+    return false;
+  }
+  for(unsigned int i = 0; i < length; i++)
+  {
+    string[i] = (char)('a' + i % 26);
+  }
+  string[length] = '\0';
+
+  piece_table* pt = piece_table_from_string(string);
+  bool result = pt != NULL;
+  for(unsigned int i = 0; i < 64 && result; i++)
+  {
+    result = piece_table_insert(pt, i * 40000, "-") &&
+             piece_table_remove(pt, i * 40000 + 7, 1);
+  }
+
+  char* expected = result ? piece_table_to_string(pt) : NULL;
+  char* parallel = result ? piece_table_to_string_parallel(pt, 4) : NULL;
+  result = result && expected && parallel && strcmp(expected, parallel) == 0 &&
+           strlen(parallel) == length;
+  free(parallel);
+  parallel = result ? piece_table_to_string_parallel(pt, 0) : NULL;
+  result = result && parallel && strcmp(expected, parallel) == 0;
+
+  free(parallel);
+  free(expected);
+  free(string);
+  piece_table_free(pt);
+  return result;
+}
+
+void count_progress(size_t done_bytes, size_t total_bytes, void* user_data)
+{
+  if(done_bytes == total_bytes)
+  {
+    (*(int*)user_data)++;
+  }
+}
+
+bool test_lines()
+{
+  piece_table* pt = piece_table_from_string("Hola\nCola\nGola");
+  if(!pt)
+  {
+    printf("Cannot create piece_table!\n");
+    return false;
+  }
+
+  // lines are counted from 1, across pieces & edits
+  int finished = 0;
+  piece_table_memory_usage usage;
+  bool result = expect_string(piece_table_get_line(pt, 2), "Cola") &&
+                piece_table_insert(pt, 5, "Ay\nOy ") &&
+                piece_table_index_lines(pt, 2, count_progress, &finished) &&
+                finished > 0 && piece_table_memory_stats(pt, &usage) &&
+                usage.line_index_bytes > 0 &&
+                expect_string(piece_table_get_line(pt, 1), "Hola") &&
+                expect_string(piece_table_get_line(pt, 2), "Ay") &&
+                expect_string(piece_table_get_line(pt, 3), "Oy Cola") &&
+                expect_string(piece_table_get_line(pt, 4), "Gola") &&
+                piece_table_get_line(pt, 5) == NULL;
+
+  piece_table_free(pt);
+  return result;
+}
+
+typedef struct save_call
+{
+  bool success;
+  test_event called;
+} save_call;
+
+void saved(bool success, double elapsed_seconds, void* user_data)
+{
+  save_call* call = (save_call*)user_data;
+  call->success = success && elapsed_seconds >= 0;
+  test_event_set(&call->called);
+}
+
+bool test_save()
+{
+  char path[64];
+  temp_path(path, sizeof(path), "saved");
+  piece_table* pt = piece_table_from_string("Hola\nCola");
+  if(!pt)
+  {
+    printf("Cannot create piece_table!\n");
+    return false;
+  }
+
+  // saving over the file the table was loaded from
+  bool result = piece_table_insert(pt, 4, ", Hehe") &&
+                piece_table_save(pt, path);
+  piece_table_free(pt);
+  pt = piece_table_from_file(path);
+  result = result && pt && piece_table_remove(pt, 0, 6) &&
+           piece_table_save(pt, path) && expect_text(pt, "Hehe\nCola");
+  piece_table_free(pt);
+  pt = piece_table_from_file(path);
+  result = result && pt && expect_text(pt, "Hehe\nCola");
+
+  // the table is changed while the snapshot is written
+  save_call call;
+  call.success = false;
+  test_event_init(&call.called);
+  bool saving = result && piece_table_save_async(pt, path, saved, &call);
+  result = saving && piece_table_insert(pt, 0, "X");
+  // waiting even if the insert failed, the callback still sets call
+  result = saving && test_event_wait(&call.called) && result && call.success;
+  test_event_destroy(&call.called);
+  piece_table_free(pt);
+  pt = piece_table_from_file(path);
+  result = result && pt && expect_text(pt, "Hehe\nCola");
+
+  piece_table_view* view = pt ? piece_table_snapshot(pt) : NULL;
+  result = result && view && piece_table_insert(pt, 0, "Y") &&
+           piece_table_view_save(view, path);
+  piece_table_view_release(view);
+  piece_table_free(pt);
+  pt = piece_table_from_file(path);
+  result = result && pt && expect_text(pt, "Hehe\nCola");
+
+  piece_table_free(pt);
+  remove(path);
+  return result;
+}
+
+bool test_memory_stats()
+{
+  piece_table* pt = piece_table_from_string("Hola");
+  if(!pt)
+  {
+    printf("Cannot create piece_table!\n");
+    return false;
+  }
+
+  // each insert inside a piece splits it, undone inserts move to redo
+  piece_table_memory_usage usage;
+  bool result = piece_table_insert(pt, 2, "xy") &&
+                piece_table_insert(pt, 6, "z") &&
+                piece_table_memory_stats(pt, &usage) &&
+                expect_count("pieces", usage.pieces_count, 4) &&
+                expect_count("add bytes", usage.add_buffer_used_bytes, 3) &&
+                expect_count("sources", usage.sources_count, 0) &&
+                expect_count("undo records", usage.undo_records_count, 2) &&
+                expect_count("redo records", usage.redo_records_count, 0);
+
+  size_t undo_bytes = usage.undo_records_bytes;
+  result = result && piece_table_memsafe_undo(pt) &&
+           expect_text(pt, "Hoxyla") && piece_table_memory_stats(pt, &usage) &&
+           expect_count("undo records", usage.undo_records_count, 1) &&
+           expect_count("redo records", usage.redo_records_count, 1) &&
+           expect_count("undo & redo bytes",
+                        usage.undo_records_bytes + usage.redo_records_bytes,
+                        undo_bytes) &&
+           usage.total_bytes >= usage.add_buffer_capacity_bytes +
+                                  usage.pieces_bytes +
+                                  usage.undo_records_bytes +
+                                  usage.redo_records_bytes;
+
+  result = result && piece_table_memsafe_redo(pt) &&
+           expect_text(pt, "Hoxylaz") && piece_table_memory_stats(pt, &usage) &&
+           expect_count("undo records", usage.undo_records_count, 2) &&
+           expect_count("redo records", usage.redo_records_count, 0) &&
+           expect_count("undo bytes", usage.undo_records_bytes, undo_bytes);
+
+  result = result && !piece_table_memory_stats(pt, NULL) &&
+           !piece_table_memory_stats(NULL, &usage);
+
+  piece_table_free(pt);
+  return result;
+}
+
+bool test_stats()
+{
+  piece_table* pt = piece_table_from_string("Hola");
+  if(!pt)
+  {
+    printf("Cannot create piece_table!\n");
+    return false;
+  }
+
+  piece_table_stats stats;
+  bool result = piece_table_insert(pt, 2, "xy");
+#ifdef PIECE_TABLE_STATS
+  result = result && piece_table_get_stats(pt, &stats) &&
+           expect_count("splits", stats.splits, 1) &&
+           expect_count("appended bytes", stats.add_buffer_bytes_appended, 2) &&
+           stats.lookups > 0 && stats.undo_records > 0 &&
+           piece_table_reset_stats(pt) && piece_table_get_stats(pt, &stats) &&
+           expect_count("splits", stats.splits, 0) &&
+           expect_count("lookups", stats.lookups, 0);
+#else
+  // counters aren't compiled in, so stats are zeroed
+  memset(&stats, 0xff, sizeof(stats));
+  result = result && !piece_table_get_stats(pt, &stats) &&
+           expect_count("splits", stats.splits, 0) &&
+           !piece_table_reset_stats(pt);
+#endif
+
+  piece_table_free(pt);
+  return result;
+}
+
+typedef struct trace_log
+{
+  int depth;
+  int max_depth;
+  int calls;
+  bool ordered;
+  piece_table_trace_event last;
+} trace_log;
+
+void log_call_begin(const piece_table* table,
+                 const piece_table_trace_event* event,
+                 void* user_data)
+{
+  (void)table;
+  trace_log* log = (trace_log*)user_data;
+  log->depth++;
+  if(log->depth > log->max_depth)
+  {
+    log->max_depth = log->depth;
+  }
+  log->ordered = log->ordered && event->end_nanoseconds == 0;
+}
+
+void log_call_end(const piece_table* table,
+               const piece_table_trace_event* event,
+               void* user_data)
+{
+  (void)table;
+  trace_log* log = (trace_log*)user_data;
+  log->depth--;
+  log->calls++;
+  log->ordered = log->ordered &&
+                 event->end_nanoseconds >= event->begin_nanoseconds;
+  log->last = *event;
+}
+
+bool test_tracer()
+{
+  piece_table* pt = piece_table_from_string("Hola");
+  if(!pt)
+  {
+    printf("Cannot create piece_table!\n");
+    return false;
+  }
+
+  trace_log log;
+  memset(&log, 0, sizeof(log));
+  log.ordered = true;
+  piece_table_tracer tracer = {log_call_begin, log_call_end, &log};
+
+  // events carry arguments & results of calls
+  bool result = piece_table_set_tracer(pt, &tracer) &&
+                piece_table_insert(pt, 2, "xyz") &&
+                log.last.call == PIECE_TABLE_CALL_INSERT &&
+                strcmp(log.last.name, "piece_table_insert") == 0 &&
+                log.last.position == 2 && log.last.length == 3 &&
+                log.last.success && !piece_table_remove(pt, 100, 1) &&
+                log.last.call == PIECE_TABLE_CALL_REMOVE &&
+                !log.last.success && expect_count("calls", log.calls, 2);
+
+  // save reports the snapshot it takes nested in it
+  char path[64];
+  temp_path(path, sizeof(path), "traced");
+  result = result && piece_table_save(pt, path) &&
+           log.last.call == PIECE_TABLE_CALL_SAVE && log.max_depth == 2 &&
+           log.depth == 0 && log.ordered;
+  remove(path);
+
+  int calls = log.calls;
+  result = result && piece_table_set_tracer(pt, NULL) &&
+           piece_table_insert(pt, 0, "A") &&
+           expect_count("calls", log.calls, calls);
+
+  piece_table_free(pt);
+  return result;
+}
+
+void ignore_call(const piece_table* table,
+                 const piece_table_trace_event* event,
+                 void* user_data)
+{
+  (void)table;
+  (void)event;
+  (void)user_data;
+}
+
+bool test_tracer_threads()
+{
+  piece_table* pt = piece_table_from_string("Hola\nCola\nGola");
+  if(!pt || !piece_table_enable_thread_safety(pt))
+  {
+    printf("Cannot create piece_table!\n");
+    piece_table_free(pt);
+    return false;
+  }
+
+  // calls already begun end with the tracer they began with
+  reader_state states[READERS];
+  reader_handle threads[READERS];
+  unsigned int started = start_readers(pt, states, threads);
+
+  piece_table_tracer tracer = {ignore_call, ignore_call, NULL};
+  bool result = started == READERS;
+  for(unsigned int i = 0; i < WRITER_ROUNDS && result; i++)
+  {
+    result = piece_table_set_tracer(pt, i % 2 == 0 ? &tracer : NULL);
+  }
+
+  result = join_readers(started, states, threads) && result;
+
+  piece_table_free(pt);
+  return result;
+}
+
+typedef struct dump_buffer
+{
+  char text[4096];
+  size_t length;
+  size_t chunks;
+} dump_buffer;
+
+void dump_sink(const char* text, size_t length, void* user_data)
+{
+  dump_buffer* buffer = (dump_buffer*)user_data;
+  if(buffer->length + length < sizeof(buffer->text))
+  {
+    memcpy(buffer->text + buffer->length, text, length);
+    buffer->length += length;
+    buffer->text[buffer->length] = '\0';
+  }
+  buffer->chunks++;
+}
+
+bool test_dump()
+{
+  piece_table* pt = piece_table_from_string("Hola\nCola");
+  if(!pt)
+  {
+    printf("Cannot create piece_table!\n");
+    return false;
+  }
+
+  // summary of pieces without any text
+  dump_buffer buffer;
+  memset(&buffer, 0, sizeof(buffer));
+  bool result = piece_table_insert(pt, 4, ", Hehe") &&
+                piece_table_dump(pt, 1, dump_sink, &buffer) &&
+                buffer.chunks > 0 && buffer.text[0] == '{' &&
+                strstr(buffer.text, "\"length\":15") &&
+                strstr(buffer.text, "\"pieces\":3") &&
+                strstr(buffer.text, "\"undo_depth\":1") &&
+                strstr(buffer.text,
+                       "\"first_pieces\":[{\"buffer\":\"original\","
+                       "\"start\":0,\"length\":4}]") &&
+                !strstr(buffer.text, "Hola") &&
+                !piece_table_dump(pt, 1, NULL, &buffer);
+
+  piece_table_free(pt);
+  return result;
+}
+
+typedef struct counting_allocator
+{
+  size_t allocations;
+  size_t live;
+  size_t largest;
+} counting_allocator;
+
+void* counting_alloc(size_t size, void* user_data)
+{
+  counting_allocator* counter = (counting_allocator*)user_data;
+  void* pointer = malloc(size);
+  if(pointer)
+  {
+    counter->allocations++;
+    counter->live++;
+    counter->largest = size > counter->largest ? size : counter->largest;
+  }
+  return pointer;
+}
+
+void* counting_realloc(void* pointer, size_t size, void* user_data)
+{
+  counting_allocator* counter = (counting_allocator*)user_data;
+  void* reallocated = realloc(pointer, size);
+  if(reallocated && !pointer)
+  {
+    counter->allocations++;
+    counter->live++;
+  }
+  if(reallocated)
+  {
+    counter->largest = size > counter->largest ? size : counter->largest;
+  }
+  return reallocated;
+}
+
+void counting_free(void* pointer, void* user_data)
+{
+  counting_allocator* counter = (counting_allocator*)user_data;
+  if(pointer)
+  {
+    counter->live--;
+  }
+  free(pointer);
+}
+
+bool test_allocator()
+{
+  counting_allocator counter = {0, 0, 0};
+  piece_table_allocator allocator = {
+    counting_alloc, counting_realloc, counting_free, &counter};
+
+  // everything a table allocates goes through its allocator,
+  // clones & views included, and is given back to it
+  piece_table* pt =
+    piece_table_from_string_with_allocator("Hola\nCola", &allocator);
+  bool result = pt && counter.allocations > 0 &&
+                piece_table_insert(pt, 4, ", Hehe") &&
+                piece_table_remove(pt, 0, 2) && piece_table_undo(pt) &&
+                piece_table_insert(pt, 0, "Z") &&
+                piece_table_memsafe_undo(pt) &&
+                expect_text(pt, "Hola, Hehe\nCola");
+  piece_table* clone = result ? piece_table_clone(pt) : NULL;
+  piece_table_view* view = result ? piece_table_snapshot(pt) : NULL;
+  size_t allocations = counter.allocations;
+  result = result && clone && view && piece_table_insert(clone, 0, "X") &&
+           piece_table_freeze(pt) && expect_text(clone, "XHola, Hehe\nCola") &&
+           counter.allocations > allocations;
+
+  // so do bookkeeping of saves, line indexes & parallel copies
+  char path[64];
+  temp_path(path, sizeof(path), "allocator");
+  char* text = NULL;
+  allocations = counter.allocations;
+  result = result && piece_table_save(clone, path) &&
+           counter.allocations > allocations;
+  allocations = counter.allocations;
+  result = result && piece_table_index_lines(clone, 2, NULL, NULL) &&
+           counter.allocations > allocations &&
+           (text = piece_table_to_string_parallel(clone, 2)) != NULL;
+  free(text);
+  remove(path);
+
+  piece_table_free(pt);
+  piece_table_free(clone);
+  result = result && expect_string(piece_table_view_to_string(view),
+                                   "Hola, Hehe\nCola");
+  piece_table_view_release(view);
+  result = result && expect_count("live allocations", counter.live, 0);
+
+  // allocator without every function is refused
+  allocator.realloc = NULL;
+  result = result && !piece_table_new_with_allocator(&allocator);
+
+  return result;
+}
+
+#define HUGE_PAGE_BYTES (2u * 1024u * 1024u)
+#define CHUNK_BYTES (64u * 1024u)
+
+// Appends count chunks of 64 KiB, each filled with a letter of its own
+bool append_chunks(piece_table* pt,
+                   const unsigned int first,
+                   const unsigned int count)
+{
+  char* chunk = (char*)malloc(CHUNK_BYTES + 1);
+  bool result = chunk != NULL;
+  for(unsigned int i = first; i < first + count && result; i++)
+  {
+    memset(chunk, 'a' + i % 26, CHUNK_BYTES);
+    chunk[CHUNK_BYTES] = '\0';
+    result = piece_table_insert(pt, piece_table_get_length(pt), chunk);
+  }
+  free(chunk);
+  return result;
+}
+
+bool expect_chunks(piece_table* pt, const unsigned int count)
+{
+  bool result = expect_count(
+    "length", (size_t)piece_table_get_length(pt), (size_t)count * CHUNK_BYTES);
+  for(unsigned int i = 0; i < count && result; i++)
+  {
+    char letter = (char)('a' + i % 26);
+    result = piece_table_get_char_at(pt, i * CHUNK_BYTES) == letter &&
+             piece_table_get_char_at(pt, (i + 1) * CHUNK_BYTES - 1) == letter;
+  }
+  if(!result)
+  {
+    printf("Chunks differ!\n");
+  }
+  return result;
+}
+
+bool test_huge_pages()
+{
+#if defined(__unix__) || defined(__APPLE__)
+  counting_allocator counter = {0, 0, 0};
+  piece_table_allocator allocator = {
+    counting_alloc, counting_realloc, counting_free, &counter};
+  piece_table* pt = piece_table_from_string_with_allocator("", &allocator);
+  if(!pt)
+  {
+    printf("Cannot create piece_table!\n");
+    return false;
+  }
+
+  // growth past a huge page maps whole huge pages instead of allocating,
+  // text appended before it is carried over
+  piece_table_memory_usage usage;
+  bool result = piece_table_use_huge_pages(pt, true) &&
+                append_chunks(pt, 0, 48) && expect_chunks(pt, 48) &&
+                piece_table_memory_stats(pt, &usage) &&
+                expect_count(
+                  "add bytes", usage.add_buffer_used_bytes, 48 * CHUNK_BYTES) &&
+                usage.add_buffer_capacity_bytes % HUGE_PAGE_BYTES == 0 &&
+                counter.largest < HUGE_PAGE_BYTES;
+
+  // disabled mid-session, growth goes back to the allocator
+  result = result && piece_table_use_huge_pages(pt, false) &&
+           append_chunks(pt, 48, 32) && expect_chunks(pt, 80) &&
+           counter.largest >= 80 * CHUNK_BYTES &&
+           piece_table_memory_stats(pt, &usage) &&
+           usage.add_buffer_capacity_bytes >= usage.add_buffer_used_bytes;
+
+  piece_table_free(pt);
+  result = result && expect_count("live allocations", counter.live, 0);
+  return result;
+#else
+  piece_table* pt = piece_table_new();
+  bool result = pt && !piece_table_use_huge_pages(pt, true) &&
+                piece_table_use_huge_pages(pt, false);
+  piece_table_free(pt);
+  return result;
+#endif
+}
+
+bool test_advise()
+{
+#if defined(__unix__) || defined(__APPLE__)
+  bool supported = true;
+#else
+  bool supported = false;
+#endif
+  piece_table_access modes[] = {PIECE_TABLE_ACCESS_SEQUENTIAL,
+                                PIECE_TABLE_ACCESS_RANDOM,
+                                PIECE_TABLE_ACCESS_WILLNEED,
+                                PIECE_TABLE_ACCESS_NORMAL};
+
+  char path[64];
+  temp_path(path, sizeof(path), "advise");
+  FILE* file = fopen(path, "wb");
+  bool result = file && fputs("Hola\nCola", file) >= 0;
+  if(file)
+  {
+    fclose(file);
+  }
+
+  // mapped file and heap buffers of a string table take the same advice,
+  // an empty add buffer has no pages to advise
+  piece_table* mapped = result ? piece_table_from_file(path) : NULL;
+  piece_table* string = piece_table_from_string("Hola\nCola");
+  result = result && mapped && string;
+  for(size_t i = 0; i < sizeof(modes) / sizeof(modes[0]) && result; i++)
+  {
+    result = piece_table_advise(mapped, modes[i]) == supported &&
+             piece_table_advise(string, modes[i]) == supported;
+  }
+
+  // advice never changes the text
+  result = result && piece_table_insert(mapped, 4, "!") &&
+           piece_table_advise(mapped, PIECE_TABLE_ACCESS_RANDOM) == supported &&
+           expect_text(mapped, "Hola!\nCola") &&
+           expect_text(string, "Hola\nCola") &&
+           !piece_table_advise(NULL, PIECE_TABLE_ACCESS_NORMAL);
+
+  piece_table_free(mapped);
+  piece_table_free(string);
+  remove(path);
+  return result;
+}
+
+int main()
+{
+  struct
+  {
+    const char* name;
+    bool (*run)();
+  } tests[] = {
+    {"remove", test_remove},
+    {"freeze", test_freeze},
+    {"add buffer waste", test_add_buffer_waste},
+    {"piece index", test_piece_index},
+    {"file limit", test_file_limit},
+    {"thread safety", test_thread_safety},
+    {"memsafe insert source", test_memsafe_insert_source},
+    {"line index wait", test_line_index_wait},
+    {"loaded callback", test_loaded_callback},
+    {"save mode", test_save_mode},
+    {"clone", test_clone},
+    {"split & concat", test_split_concat},
+    {"snapshot", test_snapshot},
+    {"sources", test_sources},
+    {"to string parallel", test_to_string_parallel},
+    {"lines", test_lines},
+    {"save", test_save},
+    {"memory stats", test_memory_stats},
+    {"stats", test_stats},
+    {"tracer", test_tracer},
+    {"tracer threads", test_tracer_threads},
+    {"dump", test_dump},
+    {"allocator", test_allocator},
+    {"huge pages", test_huge_pages},
+    {"advise", test_advise},
+  };
+
+  int failed = 0;
+  for(size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++)
+  {
+    bool passed = tests[i].run();
+    printf("%s: %s\n", tests[i].name, passed ? "passed" : "FAILED");
+    failed += !passed;
+  }
+
+  return failed ? 1 : 0;
+}